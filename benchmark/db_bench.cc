@@ -0,0 +1,259 @@
+//
+// Native counterpart of rocksdb_benchmark.dart. It runs the same benchmarks,
+// with the same keys, values and default options as the bindings, directly
+// against RocksDB. The difference between the two is the cost of the
+// bindings. Run with `make bench` or:
+//
+//     benchmark/db_bench [--num=100000] [--value-size=100] [--scan-length=100]
+//         [--threads=4] [--benchmarks=fillseq,fillrandom,...]
+//
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rocksdb/cache.h"
+#include "rocksdb/db.h"
+#include "rocksdb/filter_policy.h"
+#include "rocksdb/table.h"
+
+struct Settings {
+  int64_t num = 100000;
+  int64_t value_size = 100;
+  int64_t scan_length = 100;
+  int threads = 4;
+  std::string benchmarks = "fillseq,fillrandom,overwrite,readrandom,"
+                           "readmissing,seekscan,multireadrandom,"
+                           "multifillrandom";
+  std::string path = "/tmp/dart-rocksdb-db_bench";
+};
+
+// Per operation latencies and the total time of a benchmark, in nanoseconds.
+struct Result {
+  std::vector<int64_t> nanos;
+  int64_t elapsed_nanos = 0;
+
+  void report(const std::string &benchmark) const {
+    std::vector<int64_t> sorted = nanos;
+    std::sort(sorted.begin(), sorted.end());
+    auto percentile = [&sorted](double p) {
+      size_t index = std::min(sorted.size() - 1, (size_t)(sorted.size() * p));
+      return sorted[index] / 1e3;
+    };
+    double micros = elapsed_nanos / 1e3;
+    printf("%-16s: %9.3f micros/op %9.0f ops/sec p50 %7.2f p99 %7.2f micros "
+           "(native)\n",
+           benchmark.c_str(), micros / nanos.size(),
+           nanos.size() / (micros / 1e6), percentile(0.5), percentile(0.99));
+  }
+};
+
+static int64_t nowNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Time each call of op for the indexes in order.
+template <typename Op>
+static Result measure(const std::vector<int64_t> &order, Op op) {
+  Result result;
+  result.nanos.resize(order.size());
+  int64_t begin = nowNanos();
+  for (size_t i = 0; i < order.size(); i++) {
+    int64_t start = nowNanos();
+    op(order[i]);
+    result.nanos[i] = nowNanos() - start;
+  }
+  result.elapsed_nanos = nowNanos() - begin;
+  return result;
+}
+
+static std::vector<int64_t> sequential(int64_t count) {
+  std::vector<int64_t> order(count);
+  for (int64_t i = 0; i < count; i++) {
+    order[i] = i;
+  }
+  return order;
+}
+
+static std::vector<int64_t> shuffled(int64_t count, int seed) {
+  std::vector<int64_t> order = sequential(count);
+  std::shuffle(order.begin(), order.end(), std::mt19937(seed));
+  return order;
+}
+
+// The 16 digit, zero padded, decimal index, as used by the Dart benchmarks.
+static std::string key(int64_t index) {
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%016lld", (long long)index);
+  return buffer;
+}
+
+static void check(const rocksdb::Status &status) {
+  if (!status.ok()) {
+    fprintf(stderr, "%s\n", status.ToString().c_str());
+    exit(1);
+  }
+}
+
+// The options that RocksDB.open() uses by default.
+static rocksdb::Options defaultOptions() {
+  rocksdb::BlockBasedTableOptions table_options;
+  table_options.block_size = 4096;
+  table_options.filter_policy.reset(rocksdb::NewBloomFilterPolicy(10, false));
+  table_options.block_cache = rocksdb::NewLRUCache(8 * 1024 * 1024);
+  rocksdb::Options options;
+  options.create_if_missing = true;
+  options.table_factory.reset(
+      rocksdb::NewBlockBasedTableFactory(table_options));
+  return options;
+}
+
+static Result runBenchmark(const std::string &benchmark, rocksdb::DB *db,
+                           const Settings &settings) {
+  int64_t count = settings.num;
+  std::string value(settings.value_size, 'v');
+  rocksdb::WriteOptions write_options;
+  rocksdb::ReadOptions read_options;
+
+  if (benchmark == "fillseq" || benchmark == "fillrandom" ||
+      benchmark == "overwrite") {
+    std::vector<int64_t> order =
+        benchmark == "fillseq" ? sequential(count) : shuffled(count, 301);
+    return measure(order, [&](int64_t i) {
+      check(db->Put(write_options, key(i), value));
+    });
+  } else if (benchmark == "readrandom") {
+    return measure(shuffled(count, 302), [&](int64_t i) {
+      rocksdb::PinnableSlice result;
+      check(db->Get(read_options, db->DefaultColumnFamily(), key(i), &result));
+    });
+  } else if (benchmark == "readmissing") {
+    return measure(shuffled(count, 303), [&](int64_t i) {
+      rocksdb::PinnableSlice result;
+      rocksdb::Status status = db->Get(read_options, db->DefaultColumnFamily(),
+                                       key(i) + ".", &result);
+      if (!status.IsNotFound()) {
+        check(status);
+      }
+    });
+  } else if (benchmark == "seekscan") {
+    int64_t scans = std::max((int64_t)1, count / settings.scan_length);
+    std::vector<int64_t> order = shuffled(count, 304);
+    order.resize(scans);
+    return measure(order, [&](int64_t i) {
+      rocksdb::ReadOptions options;
+      options.total_order_seek = true;
+      rocksdb::Iterator *it = db->NewIterator(options);
+      it->Seek(key(i));
+      for (int64_t n = 0; n < settings.scan_length && it->Valid(); n++) {
+        it->Next();
+      }
+      check(it->status());
+      delete it;
+    });
+  } else if (benchmark == "multireadrandom" ||
+             benchmark == "multifillrandom") {
+    // Each thread takes an interleaved share of a random order of the keys.
+    int threads = settings.threads;
+    std::vector<Result> results(threads);
+    std::vector<std::thread> workers;
+    int64_t begin = nowNanos();
+    for (int t = 0; t < threads; t++) {
+      workers.push_back(std::thread([&, t]() {
+        std::vector<int64_t> order;
+        for (int64_t i : shuffled(count, 305 + t)) {
+          if (i % threads == t) {
+            order.push_back(i);
+          }
+        }
+        if (benchmark == "multireadrandom") {
+          results[t] = measure(order, [&](int64_t i) {
+            rocksdb::PinnableSlice result;
+            db->Get(read_options, db->DefaultColumnFamily(), key(i), &result);
+          });
+        } else {
+          results[t] = measure(order, [&](int64_t i) {
+            check(db->Put(write_options, key(i), value));
+          });
+        }
+      }));
+    }
+    Result result;
+    for (int t = 0; t < threads; t++) {
+      workers[t].join();
+      result.nanos.insert(result.nanos.end(), results[t].nanos.begin(),
+                          results[t].nanos.end());
+    }
+    result.elapsed_nanos = nowNanos() - begin;
+    return result;
+  }
+  fprintf(stderr, "Unknown benchmark: %s\n", benchmark.c_str());
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  Settings settings;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    size_t equals = arg.find('=');
+    std::string name = arg.substr(0, equals);
+    std::string value =
+        equals == std::string::npos ? "" : arg.substr(equals + 1);
+    if (name == "--num") {
+      settings.num = atoll(value.c_str());
+    } else if (name == "--value-size") {
+      settings.value_size = atoll(value.c_str());
+    } else if (name == "--scan-length") {
+      settings.scan_length = atoll(value.c_str());
+    } else if (name == "--threads") {
+      settings.threads = atoi(value.c_str());
+    } else if (name == "--benchmarks") {
+      settings.benchmarks = value;
+    } else if (name == "--db") {
+      settings.path = value;
+    } else {
+      fprintf(stderr, "Unknown argument: %s\n", arg.c_str());
+      return 1;
+    }
+  }
+
+  rocksdb::Options options = defaultOptions();
+  check(rocksdb::DestroyDB(settings.path, options));
+  rocksdb::DB *db;
+  check(rocksdb::DB::Open(options, settings.path, &db));
+  printf("Entries: %lld, value size: %lld, scan length: %lld, threads: %d\n",
+         (long long)settings.num, (long long)settings.value_size,
+         (long long)settings.scan_length, settings.threads);
+
+  bool is_filled = false;
+  size_t start = 0;
+  while (start <= settings.benchmarks.size()) {
+    size_t end = settings.benchmarks.find(',', start);
+    if (end == std::string::npos) {
+      end = settings.benchmarks.size();
+    }
+    std::string benchmark = settings.benchmarks.substr(start, end - start);
+    start = end + 1;
+    if (benchmark.empty()) {
+      continue;
+    }
+    if (!is_filled && benchmark.compare(0, 4, "fill") != 0) {
+      // The read benchmarks need the entries to exist.
+      runBenchmark("fillrandom", db, settings);
+    }
+    is_filled = true;
+    runBenchmark(benchmark, db, settings).report(benchmark);
+  }
+
+  delete db;
+  check(rocksdb::DestroyDB(settings.path, options));
+  return 0;
+}
@@ -0,0 +1,432 @@
+//
+// Benchmarks of the RocksDB bindings, reporting the same figures as the
+// native driver in db_bench.cc so that the overhead of the bindings can be
+// read off by comparing the two. Run with `make bench` or:
+//
+//     dart benchmark/rocksdb_benchmark.dart [--num=100000] [--value-size=100]
+//         [--scan-length=100] [--isolates=4] [--codecs=identity,utf8,json]
+//         [--benchmarks=fillseq,fillrandom,...]
+//
+// The compression benchmark, which only this driver has, compares the
+// settings of RocksOptions that compress table files. It is run apart from
+// the others with:
+//
+//     dart benchmark/rocksdb_benchmark.dart --benchmarks=compression
+//         [--compressions=none,snappy,lz4,zstd,zstd-dict,tiered]
+//
+import 'dart:async';
+import 'dart:convert';
+import 'dart:io';
+import 'dart:isolate';
+import 'dart:math';
+import 'dart:typed_data';
+
+import 'package:path/path.dart' as p;
+import 'package:rocksdb/rocksdb.dart';
+
+const List<String> allBenchmarks = <String>[
+  'fillseq',
+  'fillrandom',
+  'overwrite',
+  'readrandom',
+  'readmissing',
+  'seekscan',
+  'multireadrandom',
+  'multifillrandom',
+];
+
+/// The table file compressions compared by the compression benchmark.
+const Map<String, RocksOptions> compressionSettings = <String, RocksOptions>{
+  'none': RocksOptions(compression: RocksCompression.none),
+  'snappy': RocksOptions(compression: RocksCompression.snappy),
+  'lz4': RocksOptions(compression: RocksCompression.lz4),
+  'zstd': RocksOptions(compression: RocksCompression.zstd),
+  'zstd-dict': RocksOptions(
+      compression: RocksCompression.zstd,
+      compressionDictBytes: 16 * 1024,
+      compressionTrainBytes: 100 * 16 * 1024),
+  // Cheap compression where compactions rewrite data often, and strong
+  // compression with a dictionary where most of the data ends up.
+  'tiered': RocksOptions(
+      compressionPerLevel: <RocksCompression>[
+        RocksCompression.none,
+        RocksCompression.none,
+        RocksCompression.lz4
+      ],
+      bottommostCompression: RocksCompression.zstd,
+      bottommostCompressionLevel: 19,
+      compressionDictBytes: 16 * 1024,
+      compressionTrainBytes: 100 * 16 * 1024),
+};
+
+/// Settings of a run, passed to the isolates of the multi-isolate benchmarks.
+class Settings {
+  int num = 100000;
+  int valueSize = 100;
+  int scanLength = 100;
+  int isolates = 4;
+  List<String> codecs = <String>['identity', 'utf8', 'json'];
+  List<String> benchmarks = allBenchmarks;
+  List<String> compressions = compressionSettings.keys.toList();
+
+  Settings();
+
+  Settings.parse(List<String> args) {
+    for (var arg in args) {
+      var parts = arg.split('=');
+      if (parts.length != 2 || !parts[0].startsWith('--')) {
+        throw ArgumentError('Invalid argument: $arg');
+      }
+      var value = parts[1];
+      switch (parts[0]) {
+        case '--num':
+          num = int.parse(value);
+          break;
+        case '--value-size':
+          valueSize = int.parse(value);
+          break;
+        case '--scan-length':
+          scanLength = int.parse(value);
+          break;
+        case '--isolates':
+          isolates = int.parse(value);
+          break;
+        case '--codecs':
+          codecs = value.split(',');
+          break;
+        case '--benchmarks':
+          benchmarks = value.split(',');
+          break;
+        case '--compressions':
+          compressions = value.split(',');
+          break;
+        default:
+          throw ArgumentError('Unknown argument: $arg');
+      }
+    }
+  }
+}
+
+/// Creates the keys and values of one codec and opens databases using it.
+///
+/// Keys are the 16 digit, zero padded, decimal index of the entry so that the
+/// native driver uses identical keys.
+class Fixture {
+  final String name;
+  final int valueSize;
+  final String _payload;
+
+  Fixture(this.name, this.valueSize) : _payload = 'v' * valueSize {
+    if (!<String>['identity', 'utf8', 'json'].contains(name)) {
+      throw ArgumentError('Unknown codec: $name');
+    }
+  }
+
+  Future<RocksDB<dynamic, dynamic>> open(String path, {bool shared = false}) {
+    switch (name) {
+      case 'identity':
+        return RocksDB.openUint8List(path, shared: shared);
+      case 'utf8':
+        return RocksDB.openUtf8(path, shared: shared);
+      default:
+        var valueCodec = const JsonCodec()
+            .fuse(const Utf8Codec())
+            .fuse(const Uint8ListCodec());
+        return RocksDB.open<String, Object>(path,
+            shared: shared,
+            keyEncoding: RocksDB.utf8,
+            valueEncoding: valueCodec);
+    }
+  }
+
+  dynamic key(int index) {
+    var key = index.toString().padLeft(16, '0');
+    return name == 'identity' ? Uint8List.fromList(key.codeUnits) : key;
+  }
+
+  /// A key that sorts among the keys but is never written.
+  dynamic missingKey(int index) {
+    var key = '${index.toString().padLeft(16, '0')}.';
+    return name == 'identity' ? Uint8List.fromList(key.codeUnits) : key;
+  }
+
+  dynamic value(int index) {
+    switch (name) {
+      case 'identity':
+        var value = Uint8List(valueSize);
+        value.fillRange(0, valueSize, 0x76);
+        return value;
+      case 'utf8':
+        return _payload;
+      default:
+        // About the same size as the other values once encoded.
+        return <String, Object>{
+          'id': index,
+          'payload': _payload.substring(min(valueSize, 20))
+        };
+    }
+  }
+}
+
+/// Per operation latencies and the total time of a benchmark.
+class Result {
+  final Int64List ticks;
+  final int elapsedTicks;
+
+  Result(this.ticks, this.elapsedTicks);
+
+  static Result merge(List<Result> results, int elapsedTicks) {
+    var count = results.fold<int>(0, (n, r) => n + r.ticks.length);
+    var ticks = Int64List(count);
+    var offset = 0;
+    for (var result in results) {
+      ticks.setRange(offset, offset + result.ticks.length, result.ticks);
+      offset += result.ticks.length;
+    }
+    return Result(ticks, elapsedTicks);
+  }
+
+  void report(String benchmark, String codec) {
+    var ticksPerMicro = Stopwatch().frequency / 1e6;
+    var sorted = Int64List.fromList(ticks)..sort();
+    double percentile(double p) =>
+        sorted[min(sorted.length - 1, (sorted.length * p).floor())] /
+        ticksPerMicro;
+    var micros = elapsedTicks / ticksPerMicro;
+    var opsPerSec = ticks.length / (micros / 1e6);
+    print('${benchmark.padRight(16)}: '
+        '${(micros / ticks.length).toStringAsFixed(3).padLeft(9)} micros/op '
+        '${opsPerSec.toStringAsFixed(0).padLeft(9)} ops/sec '
+        'p50 ${percentile(0.5).toStringAsFixed(2).padLeft(7)} '
+        'p99 ${percentile(0.99).toStringAsFixed(2).padLeft(7)} micros '
+        '($codec)');
+  }
+}
+
+/// Time each call of [op] for the indexes in [order].
+Result measure(List<int> order, void Function(int index) op) {
+  var ticks = Int64List(order.length);
+  var total = Stopwatch()..start();
+  var watch = Stopwatch()..start();
+  for (var i = 0; i < order.length; i++) {
+    var index = order[i];
+    var start = watch.elapsedTicks;
+    op(index);
+    ticks[i] = watch.elapsedTicks - start;
+  }
+  return Result(ticks, total.elapsedTicks);
+}
+
+List<int> sequential(int count) => List<int>.generate(count, (i) => i);
+
+List<int> shuffled(int count, int seed) =>
+    sequential(count)..shuffle(Random(seed));
+
+/// Run a single threaded benchmark against [db], which already holds the
+/// entries 0 to num - 1 unless the benchmark fills it.
+Result runBenchmark(String benchmark, RocksDB<dynamic, dynamic> db,
+    Fixture fixture, Settings settings) {
+  var count = settings.num;
+  // Encode the keys and values up front, so that only the calls are timed.
+  List<dynamic> keys(List<int> order) => order.map(fixture.key).toList();
+  switch (benchmark) {
+    case 'fillseq':
+    case 'fillrandom':
+    case 'overwrite':
+      var order =
+          benchmark == 'fillseq' ? sequential(count) : shuffled(count, 301);
+      var k = keys(order);
+      var v = order.map(fixture.value).toList();
+      return measure(sequential(count), (i) => db.put(k[i], v[i]));
+    case 'readrandom':
+      var k = keys(shuffled(count, 302));
+      return measure(sequential(count), (i) {
+        if (db.get(k[i]) == null) {
+          throw StateError('Missing key ${k[i]}');
+        }
+      });
+    case 'readmissing':
+      var k = shuffled(count, 303).map(fixture.missingKey).toList();
+      return measure(sequential(count), (i) => db.get(k[i]));
+    case 'seekscan':
+      // Seek to a random key and read the entries that follow it.
+      var scans = max(1, count ~/ settings.scanLength);
+      var k = keys(shuffled(count, 304).sublist(0, scans));
+      return measure(sequential(scans), (i) {
+        for (var item in db.getItems(gte: k[i], limit: settings.scanLength)) {
+          if (item.value == null) {
+            throw StateError('Missing value');
+          }
+        }
+      });
+    default:
+      throw ArgumentError('Unknown benchmark: $benchmark');
+  }
+}
+
+/// Run a share of a multi-isolate benchmark on a database shared with the
+/// other isolates. The message is [reply port, codec, benchmark, path, num,
+/// value size, isolate index, isolate count].
+Future<void> runIsolate(List<dynamic> message) async {
+  var reply = message[0] as SendPort;
+  var fixture = Fixture(message[1] as String, message[5] as int);
+  var benchmark = message[2] as String;
+  var count = message[4] as int;
+  var index = message[6] as int;
+  var isolates = message[7] as int;
+
+  var db = await fixture.open(message[3] as String, shared: true);
+  // Each isolate takes an interleaved share of a random order of the keys.
+  var order = shuffled(count, 305 + index)
+      .where((i) => i % isolates == index)
+      .toList();
+  var k = order.map(fixture.key).toList();
+  Result result;
+  if (benchmark == 'multireadrandom') {
+    result = measure(sequential(order.length), (i) => db.get(k[i]));
+  } else {
+    var v = order.map(fixture.value).toList();
+    result = measure(sequential(order.length), (i) => db.put(k[i], v[i]));
+  }
+  db.close();
+  reply.send(result.ticks);
+}
+
+Future<Result> runMultiIsolate(String benchmark, String path, Fixture fixture,
+    Settings settings) async {
+  var port = ReceivePort();
+  var replies = port.take(settings.isolates).toList();
+  var total = Stopwatch()..start();
+  for (var i = 0; i < settings.isolates; i++) {
+    await Isolate.spawn(runIsolate, <dynamic>[
+      port.sendPort,
+      fixture.name,
+      benchmark,
+      path,
+      settings.num,
+      fixture.valueSize,
+      i,
+      settings.isolates
+    ]);
+  }
+  var ticks = await replies;
+  var elapsed = total.elapsedTicks;
+  port.close();
+  return Result.merge(
+      ticks.map((t) => Result(t as Int64List, 0)).toList(), elapsed);
+}
+
+/// A small JSON document, of about [valueSize] bytes, whose fields vary from
+/// one entry to the next but whose structure is shared, as the values of many
+/// applications are.
+String document(int index, int valueSize) {
+  var fields = <String, Object>{
+    'id': index,
+    'name': 'user-$index',
+    'email': 'user-$index@example.com',
+    'active': index.isEven,
+    'score': (index * 7919) % 1000,
+    'tags': <String>['tag-${index % 10}', 'tag-${index % 7}'],
+  };
+  for (var i = 0; jsonEncode(fields).length < valueSize; i++) {
+    fields['field-$i'] = 'value-${(index + i) % 100}';
+  }
+  return jsonEncode(fields);
+}
+
+/// Fill a database with JSON documents using each of the compression
+/// settings, compact it so that the table files are compressed as they would
+/// be once the data settles, and report the compression ratio, the size of
+/// the table files and the latency of random reads.
+Future<void> runCompression(String root, Settings settings) async {
+  var count = settings.num;
+  var keys =
+      sequential(count).map((i) => i.toString().padLeft(16, '0')).toList();
+  var values =
+      sequential(count).map((i) => document(i, settings.valueSize)).toList();
+  var rawBytes = keys.fold<int>(0, (n, k) => n + k.length) +
+      values.fold<int>(0, (n, v) => n + utf8.encode(v).length);
+
+  for (var name in settings.compressions) {
+    var options = compressionSettings[name];
+    if (options == null) {
+      throw ArgumentError('Unknown compression: $name');
+    }
+    var path = p.join(root, 'compression', name);
+    var dir = Directory(path);
+    if (dir.existsSync()) {
+      dir.deleteSync(recursive: true);
+    }
+    dir.createSync(recursive: true);
+
+    var db = await RocksDB.openUtf8(path, options: options);
+    var fill = Stopwatch()..start();
+    for (var i in shuffled(count, 301)) {
+      db.put(keys[i], values[i]);
+    }
+    await db.compactRange(null, null, bottommostForce: true);
+    fill.stop();
+    var tableBytes = db.intProperty('rocksdb.total-sst-files-size');
+    print('${'compression'.padRight(16)}: '
+        '${(rawBytes / tableBytes).toStringAsFixed(2).padLeft(9)} ratio '
+        '${(tableBytes / (1024 * 1024)).toStringAsFixed(1).padLeft(9)} MB '
+        '${(fill.elapsedMilliseconds / 1000).toStringAsFixed(2)} s to fill '
+        'and compact ($name)');
+
+    var reads = shuffled(count, 302).map((i) => keys[i]).toList();
+    measure(sequential(count), (i) {
+      if (db.get(reads[i]) == null) {
+        throw StateError('Missing key ${reads[i]}');
+      }
+    }).report('readrandom', name);
+    db.close();
+    dir.deleteSync(recursive: true);
+  }
+}
+
+Future<void> main(List<String> args) async {
+  var settings = Settings.parse(args);
+  var root = p.join(Directory.systemTemp.path, 'dart-rocksdb', 'benchmark');
+  print('Entries: ${settings.num}, value size: ${settings.valueSize}, '
+      'scan length: ${settings.scanLength}, isolates: ${settings.isolates}');
+
+  if (settings.benchmarks.contains('compression')) {
+    await runCompression(root, settings);
+    settings.benchmarks =
+        settings.benchmarks.where((b) => b != 'compression').toList();
+    if (settings.benchmarks.isEmpty) {
+      return;
+    }
+  }
+
+  for (var codec in settings.codecs) {
+    var fixture = Fixture(codec, settings.valueSize);
+    var path = p.join(root, codec);
+    var dir = Directory(path);
+    if (dir.existsSync()) {
+      dir.deleteSync(recursive: true);
+    }
+    dir.createSync(recursive: true);
+
+    // The database stays open as shared, so that the isolates of the
+    // multi-isolate benchmarks use the same instance.
+    var db = await fixture.open(path, shared: true);
+    var isFilled = false;
+    for (var benchmark in settings.benchmarks) {
+      if (!isFilled && !benchmark.startsWith('fill')) {
+        // The read benchmarks need the entries to exist.
+        runBenchmark('fillrandom', db, fixture, settings);
+      }
+      isFilled = true;
+      Result result;
+      if (benchmark.startsWith('multi')) {
+        result = await runMultiIsolate(benchmark, path, fixture, settings);
+      } else {
+        result = runBenchmark(benchmark, db, fixture, settings);
+      }
+      result.report(benchmark, codec);
+    }
+    db.close();
+    dir.deleteSync(recursive: true);
+  }
+}
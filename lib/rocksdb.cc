@@ -2,23 +2,53 @@
 // Copyright (c) 2016 Adam Lofts
 // Copyright (c) 2019 Logan Gorence
 //
+#include <errno.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include <cstring>
 #include <deque>
 #include <list>
 #include <map>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include "dart_api.h"
 #include "dart_native_api.h"
 
+#include "rocksdb/cache.h"
 #include "rocksdb/db.h"
 #include "rocksdb/filter_policy.h"
-
-// const int BLOOM_BITS_PER_KEY = 10;
+#include "rocksdb/iostats_context.h"
+#include "rocksdb/merge_operator.h"
+#include "rocksdb/perf_context.h"
+#include "rocksdb/slice_transform.h"
+#include "rocksdb/sst_file_writer.h"
+#include "rocksdb/statistics.h"
+#include "rocksdb/table.h"
+#include "rocksdb/utilities/checkpoint.h"
+#include "rocksdb/utilities/optimistic_transaction_db.h"
+#include "rocksdb/utilities/transaction_db.h"
+#include "rocksdb/version.h"
+
+// The backup engine moved to its own header, and its options were renamed, in
+// RocksDB 6.21.
+#if defined(__has_include)
+#if __has_include("rocksdb/utilities/backup_engine.h")
+#define HAVE_BACKUP_ENGINE_H 1
+#endif
+#endif
+#ifdef HAVE_BACKUP_ENGINE_H
+#include "rocksdb/utilities/backup_engine.h"
+#else
+#include "rocksdb/utilities/backupable_db.h"
+namespace rocksdb {
+typedef BackupableDBOptions BackupEngineOptions;
+}
+#endif
 
 Dart_NativeFunction ResolveName(Dart_Handle name, int argc,
                                 bool *auto_setup_scope);
@@ -47,30 +77,127 @@ int64_t statusToError(rocksdb::Status status) {
   if (status.IsCorruption()) {
     return -3;
   }
-  // RocksDB does not provide Status::IsInvalidArgument so we just assume all
-  // other errors are invalid argument.
+  if (status.IsInvalidArgument()) {
+    return -4;
+  }
+  // Other errors, such as NotSupported, are reported as invalid arguments
+  // too since the caller asked for something the db cannot do.
   if (!status.ok()) {
     return -4;
   }
   return 0;
 }
 
+// A caller of unreferenceDB() waiting for the db to be closed, either through
+// a port or by blocking until is_closed is set.
+struct CloseWaiter {
+  Dart_Port port;
+  pthread_mutex_t mutex;
+  pthread_cond_t closed;
+  bool is_closed;
+};
+
+// How the transactions of a db are coordinated, in the order of
+// RocksTransactionMode.
+enum TransactionMode {
+  kTransactionNone = 0,
+  kTransactionPessimistic = 1,
+  kTransactionOptimistic = 2
+};
+
+// How a db is opened, in the order of RocksOpenMode.
+enum OpenMode { kOpenReadWrite = 0, kOpenReadOnly = 1, kOpenSecondary = 2 };
+
+// The settings of a db given to referenceDB() besides its rocksdb options.
+struct OpenParams {
+  TransactionMode transaction_mode;
+  OpenMode open_mode;
+  std::string secondary_path;
+  int64_t catch_up_millis;
+  bool is_wal_disabled;
+  int64_t commit_delay_micros;
+  int64_t commit_max_bytes;
+};
+
+struct AsyncUpdateOp;
+
 struct DB {
   rocksdb::DB *db;
   int64_t refcount;
 
+  OpenMode open_mode;
+  // The directory of the info log of a secondary db.
+  std::string secondary_path;
+  // If greater than 0, a secondary db is caught up with its primary this often
+  // by the catch up thread, which runs until the db is closed.
+  int64_t catch_up_millis;
+  bool is_catching_up;
+  bool is_catch_up_stopped;
+  pthread_t catch_up_thread;
+  pthread_cond_t catch_up_stop;
+
+  // Writes are made without the write ahead log, see writeOptions().
+  bool is_wal_disabled;
+  // Durable asynchronous writes waiting for the commit thread, which applies
+  // them in groups with one sync of the log per group, and the total size of
+  // their updates. The thread is started by the first durable write and runs
+  // until the db is closed.
+  std::deque<AsyncUpdateOp *> commit_queue;
+  int64_t commit_queue_bytes;
+  // How long the commit thread waits for more writes to join a group, and the
+  // size of the updates that it stops waiting at.
+  int64_t commit_delay_micros;
+  int64_t commit_max_bytes;
+  bool is_committing;
+  bool is_commit_stopped;
+  pthread_t commit_thread;
+  pthread_cond_t commit_changed;
+
+  TransactionMode transaction_mode;
+  // The db as a TransactionDB or an OptimisticTransactionDB, depending on the
+  // transaction mode, for beginning transactions. NULL otherwise.
+  rocksdb::TransactionDB *transaction_db;
+  rocksdb::OptimisticTransactionDB *optimistic_db;
+
   bool is_shared;
   char *path;
-  int64_t block_size;
-  bool create_if_missing;
-  bool error_if_exists;
+  rocksdb::Options options;
+  // The column families in the order given to open, starting with the default
+  // column family. Operations refer to a column family by its index in this
+  // list.
+  std::vector<rocksdb::ColumnFamilyDescriptor> column_families;
+  std::vector<rocksdb::ColumnFamilyHandle *> handles;
+
+  // The table factory of each column family owns its block cache, which must
+  // outlive any values pinned in it.
+  std::vector<std::shared_ptr<rocksdb::TableFactory> > table_factories;
 
-  pthread_t thread;
   std::deque<Dart_Port> notify_list;
   int64_t open_status;
   pthread_mutex_t mutex;
+
+  // Set if the last reference was dropped before the open finished, in which
+  // case the db is closed as soon as it is open.
+  bool is_close_pending;
+  // Callers waiting for the db to be closed.
+  std::deque<CloseWaiter *> close_waiters;
+  // Dbs with the same path that were opened while this db was closing, and
+  // are opened once it and the other dbs they wait for are closed.
+  std::vector<DB *> open_after;
+  // The number of closing dbs with the same path that must be closed before
+  // this db is opened. Guarded by the shared mutex.
+  size_t open_wait_count;
 };
 
+// Returns the options of a write to the db. Without the write ahead log a
+// write cannot be synced, and is only durable once its memtable is flushed.
+static rocksdb::WriteOptions writeOptions(const DB *db, bool is_sync) {
+  rocksdb::WriteOptions options;
+  options.disableWAL = db->is_wal_disabled;
+  options.sync = is_sync && !db->is_wal_disabled;
+  return options;
+}
+
 struct cmp_str {
   bool operator()(char const *a, char const *b) const {
     return std::strcmp(a, b) < 0;
@@ -78,21 +205,219 @@ struct cmp_str {
 };
 
 typedef std::map<char const *, DB *, cmp_str> DBMap;
+
 pthread_mutex_t shared_mutex = PTHREAD_MUTEX_INITIALIZER;
 DBMap sharedDBs;
+// The dbs whose last reference has been dropped but that are not closed yet,
+// by path. There can be several for a path, such as two dbs opened without
+// sharing, one of which failed to lock the path. Opening the path again waits
+// for all of them to close.
+std::map<std::string, std::list<DB *> > closingDBs;
+
+// Opening and closing a db can take seconds, while the write ahead log is
+// replayed or the memtables are flushed, so they run on a pool of lifecycle
+// threads rather than on the caller's thread or under the shared mutex. The
+// pool is shared by all databases in the process.
+const int LIFECYCLE_POOL_THREADS = 4;
+
+struct LifecycleTask {
+  void (*run)(DB *db);
+  DB *db;
+};
 
-void *runOpen(void *ptr) {
-  // This function may not take the shared mutex because we take it when joining
-  // to this thread.
-  DB *native_db = (DB *)ptr;
-  rocksdb::Options options;
-  options.create_if_missing = native_db->create_if_missing;
-  options.error_if_exists = native_db->error_if_exists;
-  // options.block_size = native_db->block_size;
-  // options.filter_policy = rocksdb::NewBloomFilterPolicy(BLOOM_BITS_PER_KEY);
+pthread_mutex_t lifecycle_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t lifecycle_not_empty = PTHREAD_COND_INITIALIZER;
+std::deque<LifecycleTask> lifecycleQueue;
+bool isLifecyclePoolStarted = false;
 
-  rocksdb::Status status =
-      rocksdb::DB::Open(options, native_db->path, &native_db->db);
+void *runLifecycleWorker(void *ptr) {
+  while (true) {
+    pthread_mutex_lock(&lifecycle_mutex);
+    while (lifecycleQueue.empty()) {
+      pthread_cond_wait(&lifecycle_not_empty, &lifecycle_mutex);
+    }
+    LifecycleTask task = lifecycleQueue.front();
+    lifecycleQueue.pop_front();
+    pthread_mutex_unlock(&lifecycle_mutex);
+
+    task.run(task.db);
+  }
+  return NULL;
+}
+
+// Queue the task to be run by the lifecycle pool, starting the pool threads if
+// this is the first task.
+static void submitLifecycle(void (*run)(DB *db), DB *db) {
+  pthread_mutex_lock(&lifecycle_mutex);
+  if (!isLifecyclePoolStarted) {
+    isLifecyclePoolStarted = true;
+    for (int i = 0; i < LIFECYCLE_POOL_THREADS; i++) {
+      pthread_t thread;
+      pthread_attr_t attr;
+      pthread_attr_init(&attr);
+      pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+      int rc = pthread_create(&thread, &attr, runLifecycleWorker, NULL);
+      assert(rc == 0);
+      pthread_attr_destroy(&attr);
+    }
+  }
+  LifecycleTask task = {run, db};
+  lifecycleQueue.push_back(task);
+  pthread_cond_signal(&lifecycle_not_empty);
+  pthread_mutex_unlock(&lifecycle_mutex);
+}
+
+static void runOpen(DB *db);
+
+// Set the deadline to micros from now, for pthread_cond_timedwait().
+static void deadlineAfter(int64_t micros, struct timespec *deadline) {
+  clock_gettime(CLOCK_REALTIME, deadline);
+  deadline->tv_sec += micros / 1000000;
+  deadline->tv_nsec += (micros % 1000000) * 1000;
+  if (deadline->tv_nsec >= 1000000000) {
+    deadline->tv_sec += 1;
+    deadline->tv_nsec -= 1000000000;
+  }
+}
+
+// Catch a secondary db up with its primary every catch_up_millis until the db
+// is closed. A failed attempt is left to the next one.
+void *runCatchUp(void *ptr) {
+  DB *db = (DB *)ptr;
+  pthread_mutex_lock(&db->mutex);
+  while (!db->is_catch_up_stopped) {
+    struct timespec deadline;
+    deadlineAfter(db->catch_up_millis * 1000, &deadline);
+    int rc = 0;
+    while (!db->is_catch_up_stopped && rc != ETIMEDOUT) {
+      rc = pthread_cond_timedwait(&db->catch_up_stop, &db->mutex, &deadline);
+    }
+    if (!db->is_catch_up_stopped) {
+      pthread_mutex_unlock(&db->mutex);
+      db->db->TryCatchUpWithPrimary();
+      pthread_mutex_lock(&db->mutex);
+    }
+  }
+  pthread_mutex_unlock(&db->mutex);
+  return NULL;
+}
+
+// Close the db, wake up the callers waiting for it, start the opens of the
+// same path that were waiting for it, and free it.
+static void runClose(DB *db) {
+  // The commit queue is empty, since every queued write holds a reference.
+  pthread_mutex_lock(&db->mutex);
+  db->is_catch_up_stopped = true;
+  pthread_cond_signal(&db->catch_up_stop);
+  db->is_commit_stopped = true;
+  pthread_cond_signal(&db->commit_changed);
+  pthread_mutex_unlock(&db->mutex);
+  if (db->is_catching_up) {
+    pthread_join(db->catch_up_thread, NULL);
+  }
+  if (db->is_committing) {
+    pthread_join(db->commit_thread, NULL);
+  }
+  for (size_t i = 0; i < db->handles.size(); i++) {
+    db->db->DestroyColumnFamilyHandle(db->handles[i]);
+  }
+  delete db->db;
+
+  std::vector<DB *> open_after;
+  pthread_mutex_lock(&shared_mutex);
+  std::map<std::string, std::list<DB *> >::iterator it =
+      closingDBs.find(db->path);
+  it->second.remove(db);
+  if (it->second.empty()) {
+    closingDBs.erase(it);
+  }
+  for (size_t i = 0; i < db->open_after.size(); i++) {
+    DB *waiting = db->open_after[i];
+    waiting->open_wait_count -= 1;
+    if (waiting->open_wait_count == 0) {
+      open_after.push_back(waiting);
+    }
+  }
+  pthread_mutex_unlock(&shared_mutex);
+
+  // No one else refers to the db any more, so its waiters may be used
+  // without the lock.
+  while (!db->close_waiters.empty()) {
+    CloseWaiter *waiter = db->close_waiters.front();
+    db->close_waiters.pop_front();
+    if (waiter->port != ILLEGAL_PORT) {
+      Dart_PostInteger(waiter->port, 0);
+      delete waiter;
+    } else {
+      pthread_mutex_lock(&waiter->mutex);
+      waiter->is_closed = true;
+      pthread_cond_signal(&waiter->closed);
+      pthread_mutex_unlock(&waiter->mutex);
+    }
+  }
+
+  for (size_t i = 0; i < open_after.size(); i++) {
+    submitLifecycle(runOpen, open_after[i]);
+  }
+
+  free(db->path);
+  pthread_cond_destroy(&db->catch_up_stop);
+  pthread_cond_destroy(&db->commit_changed);
+  pthread_mutex_destroy(&db->mutex);
+  delete db;
+}
+
+static void runOpen(DB *native_db) {
+  const rocksdb::Options &options = native_db->options;
+  for (size_t i = 0; i < native_db->column_families.size(); i++) {
+    native_db->table_factories.push_back(
+        native_db->column_families[i].options.table_factory);
+  }
+
+  rocksdb::Status status;
+  if (native_db->open_mode != kOpenReadWrite) {
+    if (native_db->transaction_mode != kTransactionNone) {
+      status = rocksdb::Status::InvalidArgument(
+          "transactions need a read-write db");
+    } else if (native_db->open_mode == kOpenReadOnly) {
+      status = rocksdb::DB::OpenForReadOnly(
+          options, native_db->path, native_db->column_families,
+          &native_db->handles, &native_db->db);
+    } else {
+      status = rocksdb::DB::OpenAsSecondary(
+          options, native_db->path, native_db->secondary_path,
+          native_db->column_families, &native_db->handles, &native_db->db);
+    }
+  } else {
+    switch (native_db->transaction_mode) {
+    case kTransactionPessimistic:
+      status = rocksdb::TransactionDB::Open(
+          options, rocksdb::TransactionDBOptions(), native_db->path,
+          native_db->column_families, &native_db->handles,
+          &native_db->transaction_db);
+      native_db->db = native_db->transaction_db;
+      break;
+    case kTransactionOptimistic:
+      status = rocksdb::OptimisticTransactionDB::Open(
+          options, native_db->path, native_db->column_families,
+          &native_db->handles, &native_db->optimistic_db);
+      native_db->db = native_db->optimistic_db;
+      break;
+    default:
+      status = rocksdb::DB::Open(options, native_db->path,
+                                 native_db->column_families,
+                                 &native_db->handles, &native_db->db);
+      break;
+    }
+  }
+
+  if (status.ok() && native_db->open_mode == kOpenSecondary &&
+      native_db->catch_up_millis > 0) {
+    native_db->is_catching_up = true;
+    int rc = pthread_create(&native_db->catch_up_thread, NULL, runCatchUp,
+                            native_db);
+    assert(rc == 0);
+  }
 
   // Notify all ports the new status.
   pthread_mutex_lock(&native_db->mutex);
@@ -103,18 +428,27 @@ void *runOpen(void *ptr) {
     native_db->notify_list.pop_front();
     Dart_PostInteger(port, native_db->open_status);
   }
+  bool is_close_pending = native_db->is_close_pending;
   pthread_mutex_unlock(&native_db->mutex);
-  return NULL;
+
+  if (is_close_pending) {
+    runClose(native_db);
+  }
 }
 
 /// Open a db and take a reference to it.
 /// open_port_id will be notified when the db is ready or an error occurs.
-DB *referenceDB(const char *path, bool is_shared, Dart_Port open_port_id,
-                bool create_if_missing, bool error_if_exists,
-                int64_t block_size) {
+/// The options, column families and params are ignored if the db is shared and
+/// already open.
+DB *referenceDB(
+    const char *path, bool is_shared, Dart_Port open_port_id,
+    const rocksdb::Options &options,
+    const std::vector<rocksdb::ColumnFamilyDescriptor> &column_families,
+    const OpenParams &params) {
   DB *db = NULL;
   bool is_new = false;
 
+  // The shared mutex is only held while the maps are looked up and changed.
   pthread_mutex_lock(&shared_mutex);
 
   // Look for the db by path
@@ -134,10 +468,41 @@ DB *referenceDB(const char *path, bool is_shared, Dart_Port open_port_id,
     db->path = strdup(path);
     db->refcount = 0;
     db->open_status = 1;
-    db->create_if_missing = create_if_missing;
-    db->error_if_exists = error_if_exists;
-    db->block_size = block_size;
+    db->options = options;
+    db->column_families = column_families;
+    db->db = NULL;
+    db->transaction_mode = params.transaction_mode;
+    db->transaction_db = NULL;
+    db->optimistic_db = NULL;
+    db->open_mode = params.open_mode;
+    db->secondary_path = params.secondary_path;
+    db->catch_up_millis = params.catch_up_millis;
+    db->is_catching_up = false;
+    db->is_catch_up_stopped = false;
+    db->is_wal_disabled = params.is_wal_disabled;
+    db->commit_queue_bytes = 0;
+    db->commit_delay_micros = params.commit_delay_micros;
+    db->commit_max_bytes = params.commit_max_bytes;
+    db->is_committing = false;
+    db->is_commit_stopped = false;
+    db->is_close_pending = false;
     pthread_mutex_init(&db->mutex, NULL);
+    pthread_cond_init(&db->catch_up_stop, NULL);
+    pthread_cond_init(&db->commit_changed, NULL);
+
+    // If the path is still being closed, open it once every db closing it is
+    // closed.
+    db->open_wait_count = 0;
+    std::map<std::string, std::list<DB *> >::iterator it =
+        closingDBs.find(path);
+    if (it != closingDBs.end()) {
+      for (std::list<DB *>::iterator closing = it->second.begin();
+           closing != it->second.end(); ++closing) {
+        (*closing)->open_after.push_back(db);
+      }
+      db->open_wait_count = it->second.size();
+      is_new = false;
+    }
   }
 
   // If the db is shared add it to the map
@@ -150,7 +515,7 @@ DB *referenceDB(const char *path, bool is_shared, Dart_Port open_port_id,
   pthread_mutex_lock(&db->mutex);
   db->refcount += 1;
   if (db->open_status <= 0) {
-    // The open thread has finished.
+    // The open has finished.
     Dart_PostInteger(open_port_id, db->open_status);
   } else {
     db->notify_list.push_back(open_port_id);
@@ -158,82 +523,245 @@ DB *referenceDB(const char *path, bool is_shared, Dart_Port open_port_id,
   pthread_mutex_unlock(&db->mutex);
   pthread_mutex_unlock(&shared_mutex);
 
-  // Spawn a thread to open the DB
   if (is_new) {
-    pthread_attr_t attr;
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-    int rc = pthread_create(&db->thread, &attr, runOpen, (void *)db);
-    assert(rc == 0);
-    pthread_attr_destroy(&attr);
+    submitLifecycle(runOpen, db);
   }
   return db;
 }
 
-/// Drop a reference to a db.
-/// May result in the db being closed.
-void unreferenceDB(DB *db) {
+/// Drop a reference to a db. Dropping the last reference closes the db on a
+/// lifecycle thread, and returns true after adding the waiter, if any, to the
+/// callers to wake up once it is closed.
+bool unreferenceDB(DB *db, CloseWaiter *waiter = NULL) {
   bool is_finished;
+  bool is_open = false;
   // Take the shared mutex and the db mutex. This is so that if the refcount
-  // drops to 0 we can safely remove it from the shared map.
+  // drops to 0 we can safely move it from the shared map to the closing map.
   pthread_mutex_lock(&shared_mutex);
   pthread_mutex_lock(&db->mutex);
   db->refcount -= 1;
   is_finished = db->refcount == 0;
 
-  // If the db is shared then remove it from the map.
-  if (is_finished && db->is_shared) {
-    sharedDBs.erase(db->path);
+  if (is_finished) {
+    // If the db is shared then remove it from the map, so that it is not
+    // handed out again, and have later opens of the path wait for the close.
+    if (db->is_shared) {
+      sharedDBs.erase(db->path);
+    }
+    closingDBs[db->path].push_back(db);
+    if (waiter != NULL) {
+      db->close_waiters.push_back(waiter);
+    }
+    // If the open has not finished, the close runs right after it.
+    is_open = db->open_status <= 0;
+    db->is_close_pending = !is_open;
   }
 
   pthread_mutex_unlock(&db->mutex);
+  pthread_mutex_unlock(&shared_mutex);
 
-  if (is_finished) {
-    // It is possible that unreferenceDB is called before db->thread is
-    // initialized if a 2nd thread quickly takes a reference to a shared db and
-    // then drops it. However the initializing thread still has a reference so
-    // it is safe to call pthread_join() if the refcount was 0
-    pthread_join(db->thread, NULL);
-
-    // The actual closing of the db and its file descriptors must be run whilst
-    // the shared lock is taken so that any threads attempting to open the same
-    // file will succeed.
-    delete db->path;
-    delete db->db;
-    delete db;
+  if (is_finished && is_open) {
+    submitLifecycle(runClose, db);
   }
+  return is_finished;
+}
 
-  pthread_mutex_unlock(&shared_mutex);
+/// Take an additional reference to a db that is already referenced by the
+/// caller, such as for the duration of an asynchronous operation. The
+/// reference is dropped with unreferenceDB().
+void retainDB(DB *db) {
+  pthread_mutex_lock(&db->mutex);
+  assert(db->refcount > 0);
+  db->refcount += 1;
+  pthread_mutex_unlock(&db->mutex);
+}
+
+// A value read from the database that is handed to Dart as external typed data
+// without being copied. The slice either pins the block cache entry holding the
+// value or owns a copy of it, such as when the value is in a memtable.
+struct PinnedValue {
+  rocksdb::PinnableSlice slice;
+  // Keeps the block cache alive until the pin is released, even if the db has
+  // been closed by then.
+  std::shared_ptr<rocksdb::TableFactory> table_factory;
+
+  PinnedValue(DB *db, size_t column_family)
+      : table_factory(db->table_factories[column_family]) {}
+};
+
+static void PinnedValueFinalizer(void *isolate_callback_data,
+                                 Dart_WeakPersistentHandle handle, void *peer) {
+  delete (PinnedValue *)peer;
 }
 
 struct NativeIterator;
+struct NativeSnapshot;
+struct NativeTransaction;
+struct NativeStream;
 
 struct NativeDB {
   // Reference to the DB. NULL if closed.
   DB *db;
   std::list<NativeIterator *> *iterators;
+  std::list<NativeSnapshot *> *snapshots;
+  std::list<NativeTransaction *> *transactions;
+  std::list<NativeStream *> *streams;
+  // Native memory that the Dart side copies keys and values through when it
+  // calls the C ABI with dart:ffi. Freed when the RocksDB object is.
+  uint8_t *ffi_buffer;
+  int64_t ffi_buffer_size;
 };
 
-struct NativeIterator {
+struct NativeSnapshot {
   NativeDB *native_db;
+  // The rocksdb snapshot. NULL once released, which happens at the latest
+  // when the db is closed.
+  const rocksdb::Snapshot *snapshot;
+};
 
-  rocksdb::Iterator *iterator;
-  bool is_finalized;
+struct NativeTransaction {
+  NativeDB *native_db;
+  // The rocksdb transaction. NULL once committed or rolled back, which
+  // happens at the latest when the db is closed.
+  rocksdb::Transaction *transaction;
+};
+
+// A table file being built by a RocksSstWriter.
+struct NativeSstWriter {
+  // The writer, NULL once the file is finished.
+  rocksdb::SstFileWriter *writer;
+  // The index of the column family whose options the file is built with.
+  size_t column_family;
+};
 
-  // Iterator params
+// Bounds and options of an iteration, copied from the Dart arguments so that
+// they may outlive the native call.
+struct IteratorParams {
   int64_t limit;
+  bool is_fill_cache;
+  // Start and end keys. An empty key leaves that end of the range unbounded.
+  std::string gt;
   bool is_gt_closed;
+  std::string lt;
   bool is_lt_closed;
-  uint8_t *gt;
-  int64_t gt_len;
-  uint8_t *lt;
-  int64_t lt_len;
-  bool is_fill_cache;
+  // If not empty, only keys starting with the prefix are iterated.
+  std::string prefix;
+  // Iterate from the last key in the range to the first.
+  bool is_reverse;
+
+  // Inclusive lower and exclusive upper bounds given to rocksdb, which must
+  // outlive the iterator. An empty bound leaves that end unbounded.
+  std::string lower_bound;
+  rocksdb::Slice lower_bound_slice;
+  std::string upper_bound;
+  rocksdb::Slice upper_bound_slice;
+
+  // Snapshot to read from, or NULL to read the latest state.
+  const rocksdb::Snapshot *snapshot;
+  // Transaction whose view is iterated, including its own uncommitted writes,
+  // or NULL to iterate the db.
+  rocksdb::Transaction *transaction;
+  // Index of the column family to iterate.
+  size_t column_family;
+  // Bytes to read ahead of the iterator, or 0 for rocksdb's own readahead.
+  size_t readahead_size;
+  // Prefetch the next blocks in the background while the iterator reads.
+  bool is_async_io;
+  // Only the keys are read, and the values are left empty.
+  bool is_keys_only;
+};
+
+struct NativeIterator {
+  NativeDB *native_db;
+
+  rocksdb::Iterator *iterator;
+  bool is_finalized;
+
+  IteratorParams params;
 
   // Iterator state
   int64_t count;
+  // Scratch buffer for the entries returned by each batch.
+  std::string batch;
+};
+
+// An iteration run by a producer thread of its own, which posts the entries
+// in batches to a port. The thread may post a batch for each credit it is
+// given and waits for more once they run out, so that a consumer that stops
+// granting credits stops the thread. The stream is shared by the thread and
+// the Dart RocksDB.stream() object, and freed by the last of them to drop it.
+//
+// A change feed, from RocksDB.changesSince(), is a stream whose thread reads
+// the write ahead log rather than iterating.
+struct NativeStream {
+  NativeDB *native_db;
+  // Reference to the db held by the thread while it runs.
+  DB *db;
+  Dart_Port port;
+  IteratorParams params;
+  // The rocksdb iterator, created by the thread unless reading from a
+  // snapshot, and deleted by the thread once it is done.
+  rocksdb::Iterator *iterator;
+  int64_t max_count;
+  int64_t max_bytes;
+  // For a change feed, the sequence number of the next change to post, and
+  // whether to wait for more writes once the end of the log is reached.
+  rocksdb::SequenceNumber sequence;
+  bool is_tailing;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t changed;
+  // Number of batches the thread may post before it waits.
+  int64_t credits;
+  // Set to stop the thread, before the end of the iteration.
+  bool is_cancelled;
+  // Number of references, by the thread and by the Dart object.
+  int refcount;
 };
 
+// Drop a reference to the stream, freeing it if it was the last.
+static void streamUnreference(NativeStream *stream) {
+  pthread_mutex_lock(&stream->mutex);
+  bool is_last = --stream->refcount == 0;
+  pthread_mutex_unlock(&stream->mutex);
+  if (is_last) {
+    pthread_cond_destroy(&stream->changed);
+    pthread_mutex_destroy(&stream->mutex);
+    delete stream;
+  }
+}
+
+// Wait until the stream has a credit and take it, returning false if the
+// stream is cancelled first.
+static bool streamTakeCredit(NativeStream *stream) {
+  pthread_mutex_lock(&stream->mutex);
+  while (stream->credits == 0 && !stream->is_cancelled) {
+    pthread_cond_wait(&stream->changed, &stream->mutex);
+  }
+  bool is_cancelled = stream->is_cancelled;
+  if (!is_cancelled) {
+    stream->credits -= 1;
+  }
+  pthread_mutex_unlock(&stream->mutex);
+  return !is_cancelled;
+}
+
+/**
+ * Stop the producer thread of the stream, if it is running. The thread drops
+ * its reference to the db once it is stopped.
+ */
+static void streamStop(NativeStream *stream) {
+  if (stream->native_db == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&stream->mutex);
+  stream->is_cancelled = true;
+  pthread_cond_signal(&stream->changed);
+  pthread_mutex_unlock(&stream->mutex);
+  stream->native_db->streams->remove(stream);
+  stream->native_db = NULL;
+}
+
 /**
  * Finalize the iterator.
  */
@@ -251,9 +779,42 @@ static void iteratorFinalize(NativeIterator *it_ref) {
     delete it_ref->iterator;
     it_ref->iterator = NULL;
   }
+}
+
+/**
+ * Release the snapshot.
+ */
+static void snapshotFinalize(NativeSnapshot *snapshot_ref) {
+  if (snapshot_ref->snapshot == NULL) {
+    return;
+  }
+  NativeDB *native_db = snapshot_ref->native_db;
+  native_db->db->db->ReleaseSnapshot(snapshot_ref->snapshot);
+  snapshot_ref->snapshot = NULL;
+  native_db->snapshots->remove(snapshot_ref);
+}
 
-  delete it_ref->gt;
-  delete it_ref->lt;
+/**
+ * End the transaction, rolling it back unless it has been committed, after
+ * finalizing the iterators over its view.
+ */
+static void transactionFinalize(NativeTransaction *transaction_ref) {
+  rocksdb::Transaction *transaction = transaction_ref->transaction;
+  if (transaction == NULL) {
+    return;
+  }
+  NativeDB *native_db = transaction_ref->native_db;
+  std::list<NativeIterator *>::iterator it = native_db->iterators->begin();
+  while (it != native_db->iterators->end()) {
+    // Finalizing the iterator removes it from the list.
+    NativeIterator *it_ref = *it++;
+    if (it_ref->params.transaction == transaction) {
+      iteratorFinalize(it_ref);
+    }
+  }
+  delete transaction;
+  transaction_ref->transaction = NULL;
+  native_db->transactions->remove(transaction_ref);
 }
 
 /**
@@ -263,6 +824,26 @@ static void NativeDBFinalizer(void *isolate_callback_data,
                               Dart_WeakPersistentHandle handle, void *peer) {
   NativeDB *native_db = (NativeDB *)peer;
 
+  // Finalize every iterator, release every snapshot, roll back every
+  // transaction and stop every stream while the db is still open. They
+  // remove themselves from the lists.
+  while (!native_db->iterators->empty()) {
+    iteratorFinalize(native_db->iterators->front());
+  }
+  delete native_db->iterators;
+  while (!native_db->snapshots->empty()) {
+    snapshotFinalize(native_db->snapshots->front());
+  }
+  delete native_db->snapshots;
+  while (!native_db->transactions->empty()) {
+    transactionFinalize(native_db->transactions->front());
+  }
+  delete native_db->transactions;
+  while (!native_db->streams->empty()) {
+    streamStop(native_db->streams->front());
+  }
+  delete native_db->streams;
+
   // If the db reference is not NULL then the user did not call close on the db
   // before it went out of scope. We unreference it now.
   if (native_db->db != NULL) {
@@ -270,12 +851,7 @@ static void NativeDBFinalizer(void *isolate_callback_data,
     native_db->db = NULL;
   }
 
-  // Finalize every iterator. The iterators remove themselves from the array.
-  while (!native_db->iterators->empty()) {
-    iteratorFinalize(native_db->iterators->front());
-  }
-  delete native_db->iterators;
-
+  free(native_db->ffi_buffer);
   delete native_db;
 }
 
@@ -297,352 +873,3156 @@ static void NativeIteratorFinalizer(void *isolate_callback_data,
   delete it_ref;
 }
 
-void dbOpen(
-    Dart_NativeArguments
-        arguments) { // (bool shared, SendPort port, String path, int blockSize,
-                     // bool create_if_missing, bool error_if_exists)
-  Dart_EnterScope();
+/**
+ * Finalizer called when the dart RocksSnapshot instance is not reachable.
+ * */
+static void NativeSnapshotFinalizer(void *isolate_callback_data,
+                                    Dart_WeakPersistentHandle handle,
+                                    void *peer) {
+  NativeSnapshot *snapshot_ref = (NativeSnapshot *)peer;
+  snapshotFinalize(snapshot_ref);
+  delete snapshot_ref;
+}
 
-  NativeDB *native_db = new NativeDB();
+/**
+ * Finalizer called when the dart RocksTransaction instance is not reachable.
+ * */
+static void NativeTransactionFinalizer(void *isolate_callback_data,
+                                       Dart_WeakPersistentHandle handle,
+                                       void *peer) {
+  NativeTransaction *transaction_ref = (NativeTransaction *)peer;
+  transactionFinalize(transaction_ref);
+  delete transaction_ref;
+}
 
-  const char *path;
-  Dart_Handle arg2 = Dart_GetNativeArgument(arguments, 3);
-  Dart_StringToCString(arg2, &path);
+/**
+ * Finalizer called when the dart stream of RocksDB.stream() is not reachable.
+ * */
+static void NativeStreamFinalizer(void *isolate_callback_data,
+                                  Dart_WeakPersistentHandle handle,
+                                  void *peer) {
+  NativeStream *stream = (NativeStream *)peer;
+  streamStop(stream);
+  streamUnreference(stream);
+}
 
-  Dart_Port port_id;
-  Dart_Handle arg1 = Dart_GetNativeArgument(arguments, 2);
-  Dart_SendPortGetId(arg1, &port_id);
+/**
+ * Finalizer called when the dart RocksSstWriter instance is not reachable.
+ * */
+static void NativeSstWriterFinalizer(void *isolate_callback_data,
+                                     Dart_WeakPersistentHandle handle,
+                                     void *peer) {
+  NativeSstWriter *writer_ref = (NativeSstWriter *)peer;
+  // An unfinished file is abandoned.
+  delete writer_ref->writer;
+  delete writer_ref;
+}
 
-  bool is_shared;
-  bool create_if_missing;
-  bool error_if_exists;
-  int64_t block_size;
+// Read a public field of a Dart object, such as the fields of RocksOptions.
+static Dart_Handle getField(Dart_Handle object, const char *name) {
+  return HandleError(Dart_GetField(object, Dart_NewStringFromCString(name)));
+}
 
-  Dart_GetNativeBooleanArgument(arguments, 1, &is_shared);
-  Dart_GetNativeIntegerArgument(arguments, 4, &block_size);
-  Dart_GetNativeBooleanArgument(arguments, 5, &create_if_missing);
-  Dart_GetNativeBooleanArgument(arguments, 6, &error_if_exists);
+static int64_t getIntField(Dart_Handle object, const char *name) {
+  int64_t value;
+  HandleError(Dart_IntegerToInt64(getField(object, name), &value));
+  return value;
+}
 
-  native_db->db = referenceDB(path, is_shared, port_id, create_if_missing,
-                              error_if_exists, 1024);
-  native_db->iterators = new std::list<NativeIterator *>();
+static double getDoubleField(Dart_Handle object, const char *name) {
+  double value;
+  HandleError(Dart_DoubleValue(getField(object, name), &value));
+  return value;
+}
 
-  Dart_Handle arg0 = Dart_GetNativeArgument(arguments, 0);
-  Dart_SetNativeInstanceField(arg0, 0, (intptr_t)native_db);
+static bool getBoolField(Dart_Handle object, const char *name) {
+  bool value;
+  HandleError(Dart_BooleanValue(getField(object, name), &value));
+  return value;
+}
 
-  Dart_NewWeakPersistentHandle(arg0, (void *)native_db,
-                               sizeof(NativeDB) /* external_allocation_size */,
-                               NativeDBFinalizer);
+// Read a String field, returning false if it is null.
+static bool getStringField(Dart_Handle object, const char *name,
+                           std::string *value) {
+  Dart_Handle field = getField(object, name);
+  if (Dart_IsNull(field)) {
+    return false;
+  }
+  const char *cstr;
+  HandleError(Dart_StringToCString(field, &cstr));
+  value->assign(cstr);
+  return true;
+}
 
-  Dart_SetReturnValue(arguments, Dart_Null());
-  Dart_ExitScope();
+// Read an int field, returning false if it is null.
+static bool getOptionalIntField(Dart_Handle object, const char *name,
+                                int64_t *value) {
+  Dart_Handle field = getField(object, name);
+  if (Dart_IsNull(field)) {
+    return false;
+  }
+  HandleError(Dart_IntegerToInt64(field, value));
+  return true;
 }
 
-// SYNC API
+void maybeThrowStatus(rocksdb::Status status);
 
-// Throw a RocksClosedError. This function does not return.
-void throwClosedException() {
-  Dart_Handle klass =
-      Dart_GetType(Dart_LookupLibrary(Dart_NewStringFromCString(
-                       "package:rocksdb/rocksdb.dart")),
-                   Dart_NewStringFromCString("RocksClosedError"), 0, NULL);
-  Dart_Handle exception =
-      Dart_New(klass, Dart_NewStringFromCString("_internal"), 0, NULL);
-  Dart_ThrowException(exception);
+// Read the index of an enum value, throwing an invalid argument error if it is
+// null or not less than count.
+static int64_t getEnumIndex(Dart_Handle value, const char *name,
+                            int64_t count) {
+  if (Dart_IsNull(value)) {
+    maybeThrowStatus(rocksdb::Status::InvalidArgument(name));
+  }
+  int64_t index = getIntField(value, "index");
+  if (index < 0 || index >= count) {
+    maybeThrowStatus(rocksdb::Status::InvalidArgument(name));
+  }
+  return index;
 }
 
-// If status is not ok then throw an error. This function does not return.
-void maybeThrowStatus(rocksdb::Status status) {
-  if (status.ok()) {
-    return;
-  }
-  Dart_Handle library = Dart_LookupLibrary(
-      Dart_NewStringFromCString("package:rocksdb/rocksdb.dart"));
-  Dart_Handle klass;
-  if (status.IsCorruption()) {
-    klass = Dart_GetType(
-        library, Dart_NewStringFromCString("RocksCorruptionError"), 0, NULL);
-  } else {
-    klass = Dart_GetType(library, Dart_NewStringFromCString("RocksIOError"), 0,
-                         NULL);
+// Read an enum field as the index of its value, returning -1 if it is null.
+static int64_t getEnumField(Dart_Handle object, const char *name,
+                            int64_t count) {
+  Dart_Handle field = getField(object, name);
+  if (Dart_IsNull(field)) {
+    return -1;
   }
-  Dart_Handle exception =
-      Dart_New(klass, Dart_NewStringFromCString("_internal"), 0, NULL);
-  Dart_ThrowException(exception);
+  return getEnumIndex(field, name, count);
 }
 
-void syncNew(
-    Dart_NativeArguments arguments) { // (this, db, limit, fillCache, gt,
-                                      // is_gt_closed, lt, is_lt_closed)
-  Dart_EnterScope();
+// The compression types in the order of the Dart RocksCompression values.
+const rocksdb::CompressionType compressionTypes[] = {
+    rocksdb::kNoCompression,  rocksdb::kSnappyCompression,
+    rocksdb::kZlibCompression, rocksdb::kLZ4Compression,
+    rocksdb::kLZ4HCCompression, rocksdb::kZSTD};
+const int64_t compressionTypeCount =
+    sizeof(compressionTypes) / sizeof(compressionTypes[0]);
+
+// The compaction styles in the order of the Dart RocksCompactionStyle values.
+const rocksdb::CompactionStyle compactionStyles[] = {
+    rocksdb::kCompactionStyleLevel, rocksdb::kCompactionStyleUniversal,
+    rocksdb::kCompactionStyleFIFO};
+const int64_t compactionStyleCount =
+    sizeof(compactionStyles) / sizeof(compactionStyles[0]);
+
+// Prefix extractor whose prefix is everything up to and including the count'th
+// occurrence of the delimiter. Keys with fewer delimiters have no prefix.
+class DelimiterPrefixTransform : public rocksdb::SliceTransform {
+public:
+  DelimiterPrefixTransform(char delimiter, int count)
+      : delimiter_(delimiter), count_(count) {
+    // The name is recorded in the table files and must identify the
+    // transform exactly.
+    char name[64];
+    snprintf(name, sizeof(name), "dart-rocksdb.DelimiterPrefix.%02x.%d",
+             (unsigned char)delimiter, count);
+    name_ = name;
+  }
 
-  NativeDB *native_db;
-  Dart_Handle arg1 = Dart_GetNativeArgument(arguments, 1);
-  Dart_GetNativeInstanceField(arg1, 0, (intptr_t *)&native_db);
+  const char *Name() const override { return name_.c_str(); }
 
-  if (native_db->db == NULL) {
-    throwClosedException();
-    assert(false); // Not reached
+  rocksdb::Slice Transform(const rocksdb::Slice &key) const override {
+    return rocksdb::Slice(key.data(), prefixLength(key));
   }
 
-  NativeIterator *it_ref = new NativeIterator();
-  it_ref->native_db = native_db;
-  it_ref->is_finalized = false;
-  it_ref->iterator = NULL;
-  it_ref->count = 0;
+  bool InDomain(const rocksdb::Slice &key) const override {
+    return prefixLength(key) > 0;
+  }
 
-  Dart_Handle arg0 = Dart_GetNativeArgument(arguments, 0);
-  Dart_SetNativeInstanceField(arg0, 0, (intptr_t)it_ref);
+private:
+  // Returns the length of the prefix of the key, or 0 if it has none.
+  size_t prefixLength(const rocksdb::Slice &key) const {
+    int seen = 0;
+    for (size_t i = 0; i < key.size(); i++) {
+      if (key[i] == delimiter_ && ++seen == count_) {
+        return i + 1;
+      }
+    }
+    return 0;
+  }
 
-  Dart_GetNativeIntegerArgument(arguments, 2, &it_ref->limit);
-  Dart_GetNativeBooleanArgument(arguments, 3, &it_ref->is_fill_cache);
+  char delimiter_;
+  int count_;
+  std::string name_;
+};
+
+// Merge operator for values that are 64-bit unsigned little-endian integers,
+// which adds, or keeps the larger or the smaller of, the existing value and
+// each operand. A value or operand that is not 8 bytes fails the merge, and
+// reads of the key then report corruption.
+class UInt64MergeOperator : public rocksdb::AssociativeMergeOperator {
+public:
+  enum Kind { kAdd, kMax, kMin };
+
+  explicit UInt64MergeOperator(Kind kind) : kind_(kind) {}
+
+  const char *Name() const override {
+    static const char *names[] = {"dart-rocksdb.UInt64Add",
+                                  "dart-rocksdb.UInt64Max",
+                                  "dart-rocksdb.UInt64Min"};
+    return names[kind_];
+  }
+
+  bool Merge(const rocksdb::Slice &key, const rocksdb::Slice *existing_value,
+             const rocksdb::Slice &value, std::string *new_value,
+             rocksdb::Logger *logger) const override {
+    uint64_t result;
+    if (!decode(value, &result)) {
+      return false;
+    }
+    if (existing_value != NULL) {
+      uint64_t existing;
+      if (!decode(*existing_value, &existing)) {
+        return false;
+      }
+      switch (kind_) {
+      case kAdd:
+        // Wraps around, so that adding the two's complement of n subtracts n.
+        result += existing;
+        break;
+      case kMax:
+        result = existing > result ? existing : result;
+        break;
+      case kMin:
+        result = existing < result ? existing : result;
+        break;
+      }
+    }
+    char bytes[8];
+    for (int i = 0; i < 8; i++) {
+      bytes[i] = (result >> (8 * i)) & 0xFF;
+    }
+    new_value->assign(bytes, 8);
+    return true;
+  }
+
+private:
+  static bool decode(const rocksdb::Slice &slice, uint64_t *value) {
+    if (slice.size() != 8) {
+      return false;
+    }
+    *value = 0;
+    for (int i = 7; i >= 0; i--) {
+      *value = (*value << 8) | (uint8_t)slice[i];
+    }
+    return true;
+  }
+
+  Kind kind_;
+};
+
+// Merge operator that appends each operand to the existing value, separated
+// by the delimiter.
+class AppendMergeOperator : public rocksdb::AssociativeMergeOperator {
+public:
+  explicit AppendMergeOperator(const std::string &delimiter)
+      : delimiter_(delimiter) {}
+
+  const char *Name() const override { return "dart-rocksdb.Append"; }
+
+  bool Merge(const rocksdb::Slice &key, const rocksdb::Slice *existing_value,
+             const rocksdb::Slice &value, std::string *new_value,
+             rocksdb::Logger *logger) const override {
+    new_value->clear();
+    if (existing_value != NULL) {
+      new_value->reserve(existing_value->size() + delimiter_.size() +
+                         value.size());
+      new_value->append(existing_value->data(), existing_value->size());
+      new_value->append(delimiter_);
+    }
+    new_value->append(value.data(), value.size());
+    return true;
+  }
+
+private:
+  std::string delimiter_;
+};
+
+// The number of Dart RocksMergeOperator values.
+const int64_t mergeOperatorCount = 4;
+
+// Returns the merge operator for the index of a Dart RocksMergeOperator
+// value, or NULL if the index is -1.
+static rocksdb::MergeOperator *newMergeOperator(int64_t index,
+                                                const std::string &delimiter) {
+  switch (index) {
+  case 0:
+    return new UInt64MergeOperator(UInt64MergeOperator::kAdd);
+  case 1:
+    return new UInt64MergeOperator(UInt64MergeOperator::kMax);
+  case 2:
+    return new UInt64MergeOperator(UInt64MergeOperator::kMin);
+  case 3:
+    return new AppendMergeOperator(delimiter);
+  }
+  return NULL;
+}
+
+pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+std::shared_ptr<rocksdb::Cache> sharedBlockCache;
+
+// Returns the block cache that is shared by all databases that ask for it,
+// growing it to hold at least capacity bytes.
+static std::shared_ptr<rocksdb::Cache> getSharedBlockCache(size_t capacity) {
+  pthread_mutex_lock(&cache_mutex);
+  if (!sharedBlockCache) {
+    sharedBlockCache = rocksdb::NewLRUCache(capacity);
+  } else if (sharedBlockCache->GetCapacity() < capacity) {
+    sharedBlockCache->SetCapacity(capacity);
+  }
+  std::shared_ptr<rocksdb::Cache> cache = sharedBlockCache;
+  pthread_mutex_unlock(&cache_mutex);
+  return cache;
+}
+
+// Set up the options from the fields of a Dart RocksOptions object.
+static void getOptions(Dart_Handle dart_options, rocksdb::Options *options) {
+  rocksdb::BlockBasedTableOptions table_options;
+  table_options.block_size = getIntField(dart_options, "blockSize");
+
+  double bits_per_key = getDoubleField(dart_options, "bitsPerKey");
+  if (bits_per_key > 0) {
+    if (getBoolField(dart_options, "ribbonFilter")) {
+#if ROCKSDB_MAJOR >= 7
+      table_options.filter_policy.reset(
+          rocksdb::NewRibbonFilterPolicy(bits_per_key));
+#else
+      maybeThrowStatus(rocksdb::Status::InvalidArgument(
+          "ribbonFilter requires RocksDB 7 or later"));
+#endif
+    } else {
+      table_options.filter_policy.reset(
+          rocksdb::NewBloomFilterPolicy(bits_per_key, false));
+    }
+  }
+
+  int64_t block_cache_size = getIntField(dart_options, "blockCacheSize");
+  if (block_cache_size <= 0) {
+    table_options.no_block_cache = true;
+  } else if (getBoolField(dart_options, "sharedBlockCache")) {
+    table_options.block_cache = getSharedBlockCache(block_cache_size);
+  } else {
+    table_options.block_cache = rocksdb::NewLRUCache(block_cache_size);
+  }
+
+  if (getBoolField(dart_options, "cacheIndexAndFilterBlocks")) {
+    table_options.cache_index_and_filter_blocks = true;
+    table_options.pin_l0_filter_and_index_blocks_in_cache = true;
+  }
+  if (getBoolField(dart_options, "partitionFilters")) {
+    // Partitioned filters require the partitioned (two level) index.
+    table_options.partition_filters = true;
+    table_options.index_type =
+        rocksdb::BlockBasedTableOptions::kTwoLevelIndexSearch;
+  }
+
+  options->table_factory.reset(
+      rocksdb::NewBlockBasedTableFactory(table_options));
+
+  // With a prefix extractor the filters also record the prefix of each key,
+  // so that prefix scans can skip files and memtables without the prefix.
+  int64_t prefix_length = getIntField(dart_options, "prefixLength");
+  std::string prefix_delimiter;
+  if (prefix_length > 0) {
+    options->prefix_extractor.reset(
+        rocksdb::NewFixedPrefixTransform(prefix_length));
+  } else if (getStringField(dart_options, "prefixDelimiter",
+                            &prefix_delimiter)) {
+    options->prefix_extractor.reset(new DelimiterPrefixTransform(
+        prefix_delimiter[0],
+        getIntField(dart_options, "prefixDelimiterCount")));
+  }
+  if (options->prefix_extractor) {
+    options->memtable_prefix_bloom_size_ratio =
+        getDoubleField(dart_options, "memtablePrefixBloomRatio");
+  }
+
+  // A null compression keeps the rocksdb default, which is snappy if it is
+  // available.
+  int64_t compression =
+      getEnumField(dart_options, "compression", compressionTypeCount);
+  if (compression >= 0) {
+    options->compression = compressionTypes[compression];
+  }
+  // Levels past the end of the list use its last compression.
+  Dart_Handle per_level = getField(dart_options, "compressionPerLevel");
+  if (!Dart_IsNull(per_level)) {
+    intptr_t level_count;
+    HandleError(Dart_ListLength(per_level, &level_count));
+    for (intptr_t i = 0; i < level_count; i++) {
+      Dart_Handle level = HandleError(Dart_ListGetAt(per_level, i));
+      options->compression_per_level.push_back(compressionTypes[getEnumIndex(
+          level, "compressionPerLevel", compressionTypeCount)]);
+    }
+  }
+  // Dictionaries are sampled from the blocks of each table file as it is
+  // written, which helps most with small values that share their structure.
+  int64_t compression_level;
+  if (getOptionalIntField(dart_options, "compressionLevel",
+                          &compression_level)) {
+    options->compression_opts.level = compression_level;
+  }
+  options->compression_opts.max_dict_bytes =
+      getIntField(dart_options, "compressionDictBytes");
+  options->compression_opts.zstd_max_train_bytes =
+      getIntField(dart_options, "compressionTrainBytes");
+  // The bottommost level holds most of the data and is rewritten least
+  // often, so it is worth compressing harder.
+  int64_t bottommost = getEnumField(dart_options, "bottommostCompression",
+                                    compressionTypeCount);
+  if (bottommost >= 0) {
+    options->bottommost_compression = compressionTypes[bottommost];
+    options->bottommost_compression_opts = options->compression_opts;
+    options->bottommost_compression_opts.enabled = true;
+    if (getOptionalIntField(dart_options, "bottommostCompressionLevel",
+                            &compression_level)) {
+      options->bottommost_compression_opts.level = compression_level;
+    }
+  }
+  // A null compaction style keeps the rocksdb default, level compaction.
+  int64_t compaction_style =
+      getEnumField(dart_options, "compactionStyle", compactionStyleCount);
+  if (compaction_style >= 0) {
+    options->compaction_style = compactionStyles[compaction_style];
+  }
+
+  // Only used in the options of the db. Keeps the log files for
+  // RocksDB.changesSince() after their writes are flushed.
+  options->WAL_ttl_seconds = getIntField(dart_options, "walTtlSeconds");
+
+  std::string merge_delimiter;
+  getStringField(dart_options, "mergeDelimiter", &merge_delimiter);
+  options->merge_operator.reset(newMergeOperator(
+      getEnumField(dart_options, "mergeOperator", mergeOperatorCount),
+      merge_delimiter));
+}
+
+void dbOpen(Dart_NativeArguments
+                arguments) { // (bool shared, SendPort port, String path,
+                             // RocksOptions options, bool create_if_missing,
+                             // bool error_if_exists,
+                             // List<String> column_family_names,
+                             // List<RocksOptions> column_family_options,
+                             // int transaction_mode, int open_mode,
+                             // String secondary_path, int catch_up_millis)
+  Dart_EnterScope();
+
+  rocksdb::Options options;
+  getOptions(Dart_GetNativeArgument(arguments, 4), &options);
+
+  // The default column family uses the options of the db, and is followed by
+  // the other column families in the order given.
+  std::vector<rocksdb::ColumnFamilyDescriptor> column_families;
+  column_families.push_back(rocksdb::ColumnFamilyDescriptor(
+      rocksdb::kDefaultColumnFamilyName, options));
+  Dart_Handle names = Dart_GetNativeArgument(arguments, 7);
+  Dart_Handle family_options = Dart_GetNativeArgument(arguments, 8);
+  intptr_t family_count;
+  HandleError(Dart_ListLength(names, &family_count));
+  for (intptr_t i = 0; i < family_count; i++) {
+    const char *name;
+    HandleError(Dart_StringToCString(Dart_ListGetAt(names, i), &name));
+    rocksdb::Options cf_options;
+    getOptions(HandleError(Dart_ListGetAt(family_options, i)), &cf_options);
+    column_families.push_back(
+        rocksdb::ColumnFamilyDescriptor(name, cf_options));
+  }
+
+  NativeDB *native_db = new NativeDB();
+
+  const char *path;
+  Dart_Handle arg2 = Dart_GetNativeArgument(arguments, 3);
+  Dart_StringToCString(arg2, &path);
+
+  Dart_Port port_id;
+  Dart_Handle arg1 = Dart_GetNativeArgument(arguments, 2);
+  Dart_SendPortGetId(arg1, &port_id);
+
+  bool is_shared;
+  Dart_GetNativeBooleanArgument(arguments, 1, &is_shared);
+  Dart_GetNativeBooleanArgument(arguments, 5, &options.create_if_missing);
+  Dart_GetNativeBooleanArgument(arguments, 6, &options.error_if_exists);
+  options.create_missing_column_families = options.create_if_missing;
+  if (getBoolField(Dart_GetNativeArgument(arguments, 4), "statistics")) {
+    options.statistics = rocksdb::CreateDBStatistics();
+  }
+  OpenParams params;
+  int64_t mode;
+  Dart_GetNativeIntegerArgument(arguments, 9, &mode);
+  params.transaction_mode = (TransactionMode)mode;
+  Dart_GetNativeIntegerArgument(arguments, 10, &mode);
+  params.open_mode = (OpenMode)mode;
+  if (!Dart_IsNull(Dart_GetNativeArgument(arguments, 11))) {
+    const char *secondary_path;
+    Dart_StringToCString(Dart_GetNativeArgument(arguments, 11),
+                         &secondary_path);
+    params.secondary_path = secondary_path;
+  }
+  Dart_GetNativeIntegerArgument(arguments, 12, &params.catch_up_millis);
+  if (params.open_mode == kOpenSecondary) {
+    // A secondary keeps every table file open, since the primary may delete
+    // them once they are compacted.
+    options.max_open_files = -1;
+  }
+  Dart_Handle dart_options = Dart_GetNativeArgument(arguments, 4);
+  params.is_wal_disabled = getBoolField(dart_options, "disableWal");
+  params.commit_delay_micros =
+      getIntField(dart_options, "groupCommitDelayMicros");
+  params.commit_max_bytes = getIntField(dart_options, "groupCommitBytes");
+
+  native_db->db = referenceDB(path, is_shared, port_id, options,
+                              column_families, params);
+  native_db->iterators = new std::list<NativeIterator *>();
+  native_db->snapshots = new std::list<NativeSnapshot *>();
+  native_db->transactions = new std::list<NativeTransaction *>();
+  native_db->streams = new std::list<NativeStream *>();
+  native_db->ffi_buffer = NULL;
+  native_db->ffi_buffer_size = 0;
+
+  Dart_Handle arg0 = Dart_GetNativeArgument(arguments, 0);
+  Dart_SetNativeInstanceField(arg0, 0, (intptr_t)native_db);
+
+  Dart_NewWeakPersistentHandle(arg0, (void *)native_db,
+                               sizeof(NativeDB) /* external_allocation_size */,
+                               NativeDBFinalizer);
+
+  // The db is the handle passed to the C ABI.
+  Dart_SetReturnValue(arguments, Dart_NewInteger((intptr_t)native_db->db));
+  Dart_ExitScope();
+}
+
+// SYNC API
+
+// Throw a RocksClosedError. This function does not return.
+void throwClosedException() {
+  Dart_Handle klass =
+      Dart_GetType(Dart_LookupLibrary(Dart_NewStringFromCString(
+                       "package:rocksdb/rocksdb.dart")),
+                   Dart_NewStringFromCString("RocksClosedError"), 0, NULL);
+  Dart_Handle exception =
+      Dart_New(klass, Dart_NewStringFromCString("_internal"), 0, NULL);
+  Dart_ThrowException(exception);
+}
+
+// If status is not ok then throw an error. This function does not return.
+void maybeThrowStatus(rocksdb::Status status) {
+  if (status.ok()) {
+    return;
+  }
+  Dart_Handle library = Dart_LookupLibrary(
+      Dart_NewStringFromCString("package:rocksdb/rocksdb.dart"));
+  Dart_Handle klass;
+  if (status.IsCorruption()) {
+    klass = Dart_GetType(
+        library, Dart_NewStringFromCString("RocksCorruptionError"), 0, NULL);
+  } else if (status.IsInvalidArgument()) {
+    klass = Dart_GetType(
+        library, Dart_NewStringFromCString("RocksInvalidArgumentError"), 0,
+        NULL);
+  } else {
+    klass = Dart_GetType(library, Dart_NewStringFromCString("RocksIOError"), 0,
+                         NULL);
+  }
+  Dart_Handle exception =
+      Dart_New(klass, Dart_NewStringFromCString("_internal"), 0, NULL);
+  Dart_ThrowException(exception);
+}
+
+// Copy the String argument into the string as UTF-8.
+static void getStringArgument(Dart_NativeArguments arguments, int index,
+                              std::string *value) {
+  const char *cstr;
+  HandleError(
+      Dart_StringToCString(Dart_GetNativeArgument(arguments, index), &cstr));
+  value->assign(cstr);
+}
+
+// Copy the Uint8List argument into the string. A null argument results in an
+// empty string.
+static void getBytesArgument(Dart_NativeArguments arguments, int index,
+                             std::string *bytes) {
+  Dart_Handle arg = Dart_GetNativeArgument(arguments, index);
+  if (Dart_IsNull(arg)) {
+    bytes->clear();
+    return;
+  }
+  Dart_TypedData_Type typed_data_type = Dart_GetTypeOfTypedData(arg);
+  assert(typed_data_type == Dart_TypedData_kUint8);
+
+  char *data;
+  intptr_t len;
+  Dart_TypedDataAcquireData(arg, &typed_data_type, (void **)&data, &len);
+  bytes->assign(data, len);
+  Dart_TypedDataReleaseData(arg);
+}
+
+// Returns the rocksdb snapshot of the RocksSnapshot argument, or NULL if the
+// argument is null. Throws an error if the snapshot has been released or was
+// taken from a different database.
+static const rocksdb::Snapshot *getSnapshotArgument(
+    Dart_NativeArguments arguments, int index, NativeDB *native_db) {
+  Dart_Handle arg = Dart_GetNativeArgument(arguments, index);
+  if (Dart_IsNull(arg)) {
+    return NULL;
+  }
+  NativeSnapshot *snapshot_ref;
+  Dart_GetNativeInstanceField(arg, 0, (intptr_t *)&snapshot_ref);
+  if (snapshot_ref->snapshot == NULL) {
+    // Snapshots are only released natively when their db is closed.
+    throwClosedException();
+    assert(false); // Not reached
+  }
+  if (snapshot_ref->native_db->db != native_db->db) {
+    maybeThrowStatus(rocksdb::Status::InvalidArgument(
+        "snapshot belongs to another database"));
+    assert(false); // Not reached
+  }
+  return snapshot_ref->snapshot;
+}
+
+// Returns the rocksdb transaction of the RocksTransaction argument, or NULL if
+// the argument is null. Throws an error if the transaction has ended.
+static rocksdb::Transaction *getTransactionArgument(
+    Dart_NativeArguments arguments, int index) {
+  Dart_Handle arg = Dart_GetNativeArgument(arguments, index);
+  if (Dart_IsNull(arg)) {
+    return NULL;
+  }
+  NativeTransaction *transaction_ref;
+  Dart_GetNativeInstanceField(arg, 0, (intptr_t *)&transaction_ref);
+  if (transaction_ref->transaction == NULL) {
+    throwClosedException();
+    assert(false); // Not reached
+  }
+  return transaction_ref->transaction;
+}
+
+// Returns the column family index argument after checking that the db has
+// that column family.
+static size_t getColumnFamilyArgument(Dart_NativeArguments arguments,
+                                      int index, NativeDB *native_db) {
+  int64_t column_family;
+  Dart_GetNativeIntegerArgument(arguments, index, &column_family);
+  if (column_family < 0 ||
+      (size_t)column_family >= native_db->db->column_families.size()) {
+    maybeThrowStatus(
+        rocksdb::Status::InvalidArgument("unknown column family"));
+    assert(false); // Not reached
+  }
+  return column_family;
+}
+
+// Number of counters in a RocksPerfContext.
+const int PERF_COUNTER_COUNT = 14;
+
+// Captures the perf and IO stats context of the calling thread for the
+// duration of an operation, when a RocksPerfContext is given.
+struct PerfCapture {
+  // The Int64List counters of the RocksPerfContext, or null.
+  Dart_Handle counters;
+  rocksdb::PerfLevel previous_level;
+};
+
+// Start capturing if the argument at index is not null.
+static void perfCaptureStart(Dart_NativeArguments arguments, int index,
+                             PerfCapture *capture) {
+  capture->counters = Dart_GetNativeArgument(arguments, index);
+  if (Dart_IsNull(capture->counters)) {
+    return;
+  }
+  capture->previous_level = rocksdb::GetPerfLevel();
+  rocksdb::SetPerfLevel(rocksdb::kEnableTimeExceptForMutex);
+  rocksdb::get_perf_context()->Reset();
+  rocksdb::get_iostats_context()->Reset();
+}
+
+// Stop capturing and add the counts to the RocksPerfContext, in the order of
+// its getters.
+static void perfCaptureEnd(PerfCapture *capture) {
+  if (Dart_IsNull(capture->counters)) {
+    return;
+  }
+  rocksdb::SetPerfLevel(capture->previous_level);
+  const rocksdb::PerfContext *perf = rocksdb::get_perf_context();
+  const rocksdb::IOStatsContext *iostats = rocksdb::get_iostats_context();
+  uint64_t counts[PERF_COUNTER_COUNT] = {
+      perf->user_key_comparison_count,
+      perf->block_cache_hit_count,
+      perf->block_read_count,
+      perf->block_read_byte,
+      perf->block_read_time,
+      perf->internal_key_skipped_count,
+      perf->internal_delete_skipped_count,
+      perf->get_from_memtable_time,
+      perf->get_from_output_files_time,
+      perf->bloom_memtable_hit_count,
+      perf->bloom_sst_hit_count,
+      perf->bloom_sst_miss_count,
+      iostats->bytes_read,
+      iostats->read_nanos,
+  };
+
+  Dart_TypedData_Type type;
+  int64_t *data;
+  intptr_t len;
+  Dart_TypedDataAcquireData(capture->counters, &type, (void **)&data, &len);
+  assert(type == Dart_TypedData_kInt64 && len == PERF_COUNTER_COUNT);
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    data[i] += counts[i];
+  }
+  Dart_TypedDataReleaseData(capture->counters);
+}
+
+// Read the iterator params from consecutive arguments starting at index, in
+// the order (limit, fillCache, gt, is_gt_closed, lt, is_lt_closed, prefix,
+// reverse).
+static void getIteratorParams(Dart_NativeArguments arguments, int index,
+                              IteratorParams *params) {
+  Dart_GetNativeIntegerArgument(arguments, index, &params->limit);
+  Dart_GetNativeBooleanArgument(arguments, index + 1, &params->is_fill_cache);
+  getBytesArgument(arguments, index + 2, &params->gt);
+  Dart_GetNativeBooleanArgument(arguments, index + 3, &params->is_gt_closed);
+  getBytesArgument(arguments, index + 4, &params->lt);
+  Dart_GetNativeBooleanArgument(arguments, index + 5, &params->is_lt_closed);
+  getBytesArgument(arguments, index + 6, &params->prefix);
+  Dart_GetNativeBooleanArgument(arguments, index + 7, &params->is_reverse);
+  params->snapshot = NULL;
+  params->transaction = NULL;
+  params->column_family = 0;
+  params->readahead_size = 0;
+  params->is_async_io = false;
+  params->is_keys_only = false;
+}
+
+static void iteratorStart(NativeIterator *native_iterator);
+
+void syncNew(
+    Dart_NativeArguments arguments) { // (this, db, limit, fillCache, gt,
+                                      // is_gt_closed, lt, is_lt_closed,
+                                      // prefix, reverse, snapshot,
+                                      // column_family, perf_counters,
+                                      // transaction, keys_only)
+  Dart_EnterScope();
+
+  NativeDB *native_db;
+  Dart_Handle arg1 = Dart_GetNativeArgument(arguments, 1);
+  Dart_GetNativeInstanceField(arg1, 0, (intptr_t *)&native_db);
+
+  if (native_db->db == NULL) {
+    throwClosedException();
+    assert(false); // Not reached
+  }
+  const rocksdb::Snapshot *snapshot =
+      getSnapshotArgument(arguments, 10, native_db);
+  size_t column_family = getColumnFamilyArgument(arguments, 11, native_db);
+  rocksdb::Transaction *transaction = getTransactionArgument(arguments, 13);
+
+  NativeIterator *it_ref = new NativeIterator();
+  it_ref->native_db = native_db;
+  it_ref->is_finalized = false;
+  it_ref->iterator = NULL;
+  it_ref->count = 0;
+
+  Dart_Handle arg0 = Dart_GetNativeArgument(arguments, 0);
+  Dart_SetNativeInstanceField(arg0, 0, (intptr_t)it_ref);
+
+  getIteratorParams(arguments, 2, &it_ref->params);
+  it_ref->params.snapshot = snapshot;
+  it_ref->params.column_family = column_family;
+  it_ref->params.transaction = transaction;
+  Dart_GetNativeBooleanArgument(arguments, 14, &it_ref->params.is_keys_only);
+  if (transaction != NULL) {
+    // Reads in a transaction see its snapshot, if it has one.
+    it_ref->params.snapshot = transaction->GetSnapshot();
+  }
+  if (snapshot != NULL || transaction != NULL) {
+    // The snapshot may be released before the first batch is read, so create
+    // the rocksdb iterator now. It keeps reading from the snapshot's view.
+    // The iterator of a transaction is created now so that it is on the list
+    // of iterators finalized when the transaction ends.
+    PerfCapture perf;
+    perfCaptureStart(arguments, 12, &perf);
+    iteratorStart(it_ref);
+    perfCaptureEnd(&perf);
+  }
+
+  // We just pass the directly allocated size of the iterator here. The iterator
+  // holds a lot of other data in memory when it mmaps the files but I'm not
+  // sure how to account for it. Because the GC is not seeing all of the
+  // allocated memory it is important to manually call finalize() on the
+  // iterator when we are done with it (for example when the iterator reaches
+  // the end of its range).
+  Dart_NewWeakPersistentHandle(
+      arg0, (void *)it_ref,
+      /* external_allocation_size */ sizeof(NativeIterator),
+      NativeIteratorFinalizer);
+
+  // The iterator is the handle passed to the C ABI.
+  Dart_SetReturnValue(arguments, Dart_NewInteger((intptr_t)it_ref));
+  Dart_ExitScope();
+}
+
+// Values at least this large are returned by get as external typed data that
+// refers to the pinned value, rather than being copied into the Dart heap.
+const size_t PINNED_VALUE_THRESHOLD = 16 * 1024;
+
+// http://stackoverflow.com/questions/2022179/c-quick-calculation-of-next-multiple-of-4
+uint32_t increaseToMultipleOf4(uint32_t v) { return (v + 3) & ~0x03; }
+
+// Append a 32-bit value to the buffer in little-endian byte order.
+static void appendUint32(std::string *buffer, uint32_t v) {
+  char bytes[4];
+  bytes[0] = v & 0xFF;
+  bytes[1] = (v >> 8) & 0xFF;
+  bytes[2] = (v >> 16) & 0xFF;
+  bytes[3] = (v >> 24) & 0xFF;
+  buffer->append(bytes, 4);
+}
+
+// Read a 32-bit little-endian value from the buffer.
+static uint32_t readUint32(const uint8_t *data) {
+  return (uint32_t)data[0] | ((uint32_t)data[1] << 8) |
+         ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+// Append the slice to the buffer, padded with zeros to a multiple of 4 bytes.
+static void appendPadded(std::string *buffer, const rocksdb::Slice &slice) {
+  buffer->append(slice.data(), slice.size());
+  buffer->append(increaseToMultipleOf4(slice.size()) - slice.size(), '\0');
+}
+
+// Append a key/value entry to a batch buffer. Each entry is the key length and
+// the value length (32-bit little-endian) followed by the key and the value,
+// each padded to a multiple of 4 bytes so that every entry starts aligned.
+static void appendEntry(std::string *buffer, const rocksdb::Slice &key,
+                        const rocksdb::Slice &value) {
+  appendUint32(buffer, key.size());
+  appendUint32(buffer, value.size());
+  appendPadded(buffer, key);
+  appendPadded(buffer, value);
+}
+
+// Copy the contents of the buffer into a new Uint8List.
+static Dart_Handle newUint8List(const std::string &buffer) {
+  Dart_Handle result = Dart_NewTypedData(Dart_TypedData_kUint8, buffer.size());
+  uint8_t *data;
+  intptr_t len;
+  Dart_TypedData_Type t;
+  Dart_TypedDataAcquireData(result, &t, (void **)&data, &len);
+  memcpy(data, buffer.data(), buffer.size());
+  Dart_TypedDataReleaseData(result);
+  return result;
+}
+
+// Returns the smallest key that is greater than every key starting with the
+// prefix, or an empty string if there is no such key.
+static std::string prefixSuccessor(const std::string &prefix) {
+  std::string successor = prefix;
+  while (!successor.empty()) {
+    unsigned char last = successor[successor.size() - 1];
+    if (last != 0xFF) {
+      successor[successor.size() - 1] = last + 1;
+      break;
+    }
+    successor.resize(successor.size() - 1);
+  }
+  return successor;
+}
+
+// Work out the [lower_bound, upper_bound) range of the keys to iterate from the
+// gt/lt keys and the prefix. Every key that starts with the start key is
+// greater than it, so appending a zero byte gives the smallest key that is
+// strictly greater.
+static void setIteratorBounds(IteratorParams *params) {
+  params->lower_bound = params->gt;
+  if (!params->gt.empty() && !params->is_gt_closed) {
+    params->lower_bound.push_back('\0');
+  }
+  params->upper_bound = params->lt;
+  if (!params->lt.empty() && params->is_lt_closed) {
+    params->upper_bound.push_back('\0');
+  }
+
+  if (!params->prefix.empty()) {
+    if (params->lower_bound.compare(params->prefix) < 0) {
+      params->lower_bound = params->prefix;
+    }
+    // A prefix of only 0xFF bytes has no successor, but then every key that
+    // is not less than the prefix starts with it.
+    std::string successor = prefixSuccessor(params->prefix);
+    if (!successor.empty() && (params->upper_bound.empty() ||
+                               successor.compare(params->upper_bound) < 0)) {
+      params->upper_bound = successor;
+    }
+  }
+}
+
+// Create a rocksdb iterator positioned at the first entry of the range, or the
+// last if iterating in reverse.
+static rocksdb::Iterator *newIterator(DB *db, IteratorParams *params) {
+  rocksdb::ReadOptions options;
+  options.fill_cache = params->is_fill_cache;
+  options.snapshot = params->snapshot;
+  options.readahead_size = params->readahead_size;
+#if ROCKSDB_MAJOR >= 7
+  options.async_io = params->is_async_io;
+#endif
+#if ROCKSDB_MAJOR >= 9
+  // The values are never looked at, so they need not be loaded. Values in
+  // blob files are then not read at all.
+  options.allow_unprepared_value = params->is_keys_only;
+#endif
+
+  // Give the bounds to rocksdb so that it stops at the end of the range on
+  // its own, without reading the blocks or skipping the tombstones beyond it.
+  setIteratorBounds(params);
+  if (!params->lower_bound.empty()) {
+    params->lower_bound_slice = rocksdb::Slice(params->lower_bound);
+    options.iterate_lower_bound = &params->lower_bound_slice;
+  }
+  if (!params->upper_bound.empty()) {
+    params->upper_bound_slice = rocksdb::Slice(params->upper_bound);
+    options.iterate_upper_bound = &params->upper_bound_slice;
+  }
+
+  // If every key starting with the prefix has the same extracted prefix then
+  // the prefix filters can be used, otherwise seek in total order. A reverse
+  // seek targets the end of the range, which is outside the prefix, so it
+  // always seeks in total order. Ranges may span many prefixes.
+  const rocksdb::SliceTransform *extractor =
+      db->column_families[params->column_family]
+          .options.prefix_extractor.get();
+  if (!params->prefix.empty() && !params->is_reverse && extractor != NULL &&
+      extractor->InDomain(params->prefix)) {
+    options.prefix_same_as_start = true;
+  } else {
+    options.total_order_seek = true;
+  }
+  rocksdb::ColumnFamilyHandle *handle = db->handles[params->column_family];
+  rocksdb::Iterator *it =
+      params->transaction != NULL
+          ? params->transaction->GetIterator(options, handle)
+          : db->db->NewIterator(options, handle);
+
+  if (params->is_reverse) {
+    if (params->upper_bound.empty()) {
+      it->SeekToLast();
+    } else {
+      rocksdb::Slice end_slice = rocksdb::Slice(params->upper_bound);
+      it->SeekForPrev(end_slice);
+      if (it->Valid() && it->key().compare(end_slice) == 0) {
+        it->Prev();
+      }
+    }
+  } else if (!params->lower_bound.empty()) {
+    it->Seek(rocksdb::Slice(params->lower_bound));
+  } else {
+    it->SeekToFirst();
+  }
+  return it;
+}
+
+// Move the iterator to the next entry in the direction of iteration.
+static void iteratorAdvance(rocksdb::Iterator *it,
+                            const IteratorParams &params) {
+  if (params.is_reverse) {
+    it->Prev();
+  } else {
+    it->Next();
+  }
+}
+
+// Returns true if the iterator is positioned on an entry that is within the
+// range and count entries have not yet reached the limit. The bounds are
+// enforced by rocksdb, so the iterator is no longer valid past them.
+static bool isInRange(rocksdb::Iterator *it, const IteratorParams &params,
+                      int64_t count) {
+  if (params.limit >= 0 && count >= params.limit) {
+    return false;
+  }
+  return it->Valid();
+}
+
+// Create the rocksdb iterator and perform the initial seek, if that has not
+// been done already.
+static void iteratorStart(NativeIterator *native_iterator) {
+  if (native_iterator->is_finalized || native_iterator->iterator != NULL) {
+    return;
+  }
+  NativeDB *native_db = native_iterator->native_db;
+  native_iterator->iterator =
+      newIterator(native_db->db, &native_iterator->params);
+  // Add the iterator to the db list. This is so we know to finalize it before
+  // finalizing the db.
+  native_db->iterators->push_back(native_iterator);
+}
+
+// Returns true if the iterator is positioned on an entry that is within the
+// query range and the limit has not been reached.
+static bool iteratorHasCurrent(NativeIterator *native_iterator) {
+  if (native_iterator->is_finalized) {
+    return false;
+  }
+  return isInRange(native_iterator->iterator, native_iterator->params,
+                   native_iterator->count);
+}
+
+// Read the next entries into the batch buffer of the iterator, returning the
+// number of entries read.
+static int64_t iteratorNextBatch(NativeIterator *native_iterator,
+                                 int64_t max_count, int64_t max_bytes) {
+  iteratorStart(native_iterator);
+
+  // Copy as many entries as the count and byte budget allow into the scratch
+  // buffer, which is reused from one call to the next. At least one entry is
+  // always returned, no matter how large it is.
+  std::string *batch = &native_iterator->batch;
+  batch->clear();
+  int64_t entries = 0;
+  while (entries < max_count && (int64_t)batch->size() < max_bytes &&
+         iteratorHasCurrent(native_iterator)) {
+    rocksdb::Iterator *it = native_iterator->iterator;
+    appendEntry(batch, it->key(),
+                native_iterator->params.is_keys_only ? rocksdb::Slice()
+                                                     : it->value());
+    native_iterator->count += 1;
+    entries += 1;
+    iteratorAdvance(it, native_iterator->params);
+  }
+
+  if (!iteratorHasCurrent(native_iterator)) {
+    // Iteration is finished. Any subsequent calls will return null so we can
+    // finalize the iterator here.
+    iteratorFinalize(native_iterator);
+  }
+  return entries;
+}
+
+void syncNextBatch(
+    Dart_NativeArguments
+        arguments) { // (this, max_count, max_bytes, perf_counters)
+  Dart_EnterScope();
+
+  NativeIterator *native_iterator;
+  Dart_Handle arg0 = Dart_GetNativeArgument(arguments, 0);
+  Dart_GetNativeInstanceField(arg0, 0, (intptr_t *)&native_iterator);
+
+  if (native_iterator->native_db->db == NULL) {
+    throwClosedException();
+    assert(false); // Not reached
+  }
+
+  int64_t max_count;
+  int64_t max_bytes;
+  Dart_GetNativeIntegerArgument(arguments, 1, &max_count);
+  Dart_GetNativeIntegerArgument(arguments, 2, &max_bytes);
+
+  PerfCapture perf;
+  perfCaptureStart(arguments, 3, &perf);
+  int64_t entries = iteratorNextBatch(native_iterator, max_count, max_bytes);
+  perfCaptureEnd(&perf);
+
+  Dart_Handle result = Dart_Null();
+  if (entries > 0) {
+    result = newUint8List(native_iterator->batch);
+  }
+
+  Dart_SetReturnValue(arguments, result);
+  Dart_ExitScope();
+}
+
+void syncGet(
+    Dart_NativeArguments
+        arguments) { // (this, key, snapshot, column_family, perf_counters)
+  Dart_EnterScope();
+
+  NativeDB *native_db;
+  Dart_Handle arg0 = Dart_GetNativeArgument(arguments, 0);
+  Dart_GetNativeInstanceField(arg0, 0, (intptr_t *)&native_db);
+
+  if (native_db->db == NULL) {
+    throwClosedException();
+    assert(false); // Not reached
+  }
+  rocksdb::ReadOptions options;
+  options.snapshot = getSnapshotArgument(arguments, 2, native_db);
+  size_t column_family = getColumnFamilyArgument(arguments, 3, native_db);
+  PerfCapture perf;
+  perfCaptureStart(arguments, 4, &perf);
+
+  Dart_Handle arg1 = Dart_GetNativeArgument(arguments, 1);
+  Dart_TypedData_Type typed_data_type = Dart_GetTypeOfTypedData(arg1);
+  assert(typed_data_type == Dart_TypedData_kUint8);
+
+  char *data;
+  intptr_t len;
+  Dart_TypedDataAcquireData(arg1, &typed_data_type, (void **)&data, &len);
+
+  rocksdb::Slice key = rocksdb::Slice(data, len);
+
+  PinnedValue *value = new PinnedValue(native_db->db, column_family);
+  rocksdb::Status status =
+      native_db->db->db->Get(options, native_db->db->handles[column_family],
+                             key, &value->slice);
+  perfCaptureEnd(&perf);
+  Dart_TypedDataReleaseData(arg1);
+
+  Dart_Handle result;
+  if (status.IsNotFound()) {
+    delete value;
+    result = Dart_Null();
+  } else if (status.ok() && value->slice.size() >= PINNED_VALUE_THRESHOLD) {
+    // Hand the value over without copying it. The finalizer releases the pin.
+    result = Dart_NewExternalTypedDataWithFinalizer(
+        Dart_TypedData_kUint8, (void *)value->slice.data(),
+        value->slice.size(), value,
+        /* external_allocation_size */ value->slice.size(),
+        PinnedValueFinalizer);
+  } else if (status.ok()) {
+    result = Dart_NewTypedData(Dart_TypedData_kUint8, value->slice.size());
+    Dart_TypedData_Type t;
+    Dart_TypedDataAcquireData(result, &t, (void **)&data, &len);
+    memcpy(data, value->slice.data(), value->slice.size());
+    Dart_TypedDataReleaseData(result);
+    delete value;
+  } else {
+    delete value;
+    maybeThrowStatus(status);
+    assert(false); // Not reached
+  }
+
+  Dart_SetReturnValue(arguments, result);
+  Dart_ExitScope();
+}
+
+// Length written in place of a value that was not found.
+const uint32_t MISSING_VALUE_LENGTH = 0xFFFFFFFF;
+
+// Decode count length-prefixed keys from the packed buffer built by
+// RocksDB.getMany(). Each key is its length (32-bit little-endian) followed by
+// the key bytes padded to a multiple of 4 bytes.
+static bool decodeKeys(const uint8_t *data, size_t len, int64_t count,
+                       std::vector<rocksdb::Slice> *keys) {
+  size_t offset = 0;
+  for (int64_t i = 0; i < count; i++) {
+    if (len - offset < 4) {
+      return false;
+    }
+    uint32_t key_len = readUint32(data + offset);
+    size_t key_offset = offset + 4;
+    offset = key_offset + increaseToMultipleOf4(key_len);
+    if (offset > len) {
+      return false;
+    }
+    keys->push_back(rocksdb::Slice((const char *)data + key_offset, key_len));
+  }
+  return true;
+}
+
+void syncGetMany(
+    Dart_NativeArguments arguments) { // (this, keys, length, count, snapshot,
+                                      // column_family, perf_counters)
+  Dart_EnterScope();
+
+  NativeDB *native_db;
+  Dart_Handle arg0 = Dart_GetNativeArgument(arguments, 0);
+  Dart_GetNativeInstanceField(arg0, 0, (intptr_t *)&native_db);
+
+  if (native_db->db == NULL) {
+    throwClosedException();
+    assert(false); // Not reached
+  }
+  const rocksdb::Snapshot *snapshot =
+      getSnapshotArgument(arguments, 4, native_db);
+  size_t column_family = getColumnFamilyArgument(arguments, 5, native_db);
+  PerfCapture perf;
+  perfCaptureStart(arguments, 6, &perf);
+
+  Dart_Handle arg1 = Dart_GetNativeArgument(arguments, 1);
+  Dart_TypedData_Type typed_data_type = Dart_GetTypeOfTypedData(arg1);
+  assert(typed_data_type == Dart_TypedData_kUint8);
+
+  int64_t length;
+  int64_t count;
+  Dart_GetNativeIntegerArgument(arguments, 2, &length);
+  Dart_GetNativeIntegerArgument(arguments, 3, &count);
+
+  Dart_Handle result = Dart_Null();
+  rocksdb::Status error;
+  {
+    std::vector<rocksdb::Slice> keys;
+    std::vector<rocksdb::PinnableSlice> values(count);
+    std::vector<rocksdb::Status> statuses(count);
+
+    char *data;
+    intptr_t len;
+    Dart_TypedDataAcquireData(arg1, &typed_data_type, (void **)&data, &len);
+    assert(length <= len);
+    if (decodeKeys((const uint8_t *)data, length, count, &keys)) {
+      // The keys may arrive in any order, so let MultiGet sort them.
+      rocksdb::ReadOptions options;
+      options.snapshot = snapshot;
+      DB *db = native_db->db;
+      db->db->MultiGet(options, db->handles[column_family], count, keys.data(),
+                       values.data(), statuses.data());
+    } else {
+      error = rocksdb::Status::InvalidArgument("malformed key list");
+    }
+    perfCaptureEnd(&perf);
+    // The values are pinned or copied, so the keys are no longer needed.
+    Dart_TypedDataReleaseData(arg1);
+
+    // Pack the values in key order as their length followed by the value bytes
+    // padded to a multiple of 4 bytes, using a length of MISSING_VALUE_LENGTH
+    // for keys that were not found.
+    size_t size = 0;
+    for (int64_t i = 0; error.ok() && i < count; i++) {
+      if (statuses[i].ok()) {
+        size += 4 + increaseToMultipleOf4(values[i].size());
+      } else if (statuses[i].IsNotFound()) {
+        size += 4;
+      } else {
+        error = statuses[i];
+      }
+    }
+
+    if (error.ok()) {
+      result = Dart_NewTypedData(Dart_TypedData_kUint8, size);
+      uint8_t *out;
+      Dart_TypedData_Type t;
+      Dart_TypedDataAcquireData(result, &t, (void **)&out, &len);
+      memset(out, 0, size);
+      size_t offset = 0;
+      for (int64_t i = 0; i < count; i++) {
+        uint32_t value_len =
+            statuses[i].ok() ? values[i].size() : MISSING_VALUE_LENGTH;
+        out[offset] = value_len & 0xFF;
+        out[offset + 1] = (value_len >> 8) & 0xFF;
+        out[offset + 2] = (value_len >> 16) & 0xFF;
+        out[offset + 3] = (value_len >> 24) & 0xFF;
+        offset += 4;
+        if (statuses[i].ok()) {
+          memcpy(out + offset, values[i].data(), values[i].size());
+          offset += increaseToMultipleOf4(values[i].size());
+        }
+      }
+      Dart_TypedDataReleaseData(result);
+    }
+  }
+
+  maybeThrowStatus(error);
+
+  Dart_SetReturnValue(arguments, result);
+  Dart_ExitScope();
+}
+
+// Returns an error unless the column family has a merge operator, without
+// which rocksdb fails merges as not supported.
+static rocksdb::Status checkMergeOperator(DB *db, size_t column_family) {
+  if (!db->column_families[column_family].options.merge_operator) {
+    return rocksdb::Status::InvalidArgument("no merge operator");
+  }
+  return rocksdb::Status::OK();
+}
+
+// Put or merge the value of a key, as the body of syncPut and syncMerge.
+static void syncPutOrMerge(Dart_NativeArguments arguments, bool is_merge) {
+  Dart_EnterScope();
+
+  NativeDB *native_db;
+  Dart_Handle arg0 = Dart_GetNativeArgument(arguments, 0);
+  Dart_GetNativeInstanceField(arg0, 0, (intptr_t *)&native_db);
+
+  if (native_db->db == NULL) {
+    throwClosedException();
+    assert(false); // Not reached
+  }
+
+  Dart_Handle arg1 = Dart_GetNativeArgument(arguments, 1);
+  Dart_TypedData_Type typed_data_type1;
+
+  Dart_Handle arg2 = Dart_GetNativeArgument(arguments, 2);
+  Dart_TypedData_Type typed_data_type2;
+
+  bool is_sync;
+  Dart_GetNativeBooleanArgument(arguments, 3, &is_sync);
+  size_t column_family = getColumnFamilyArgument(arguments, 4, native_db);
+  if (is_merge) {
+    maybeThrowStatus(checkMergeOperator(native_db->db, column_family));
+  }
+
+  char *data1, *data2;
+  intptr_t len1, len2;
+  Dart_TypedDataAcquireData(arg1, &typed_data_type1, (void **)&data1, &len1);
+  Dart_TypedDataAcquireData(arg2, &typed_data_type2, (void **)&data2, &len2);
+
+  assert(typed_data_type1 == Dart_TypedData_kUint8);
+  assert(typed_data_type2 == Dart_TypedData_kUint8);
+
+  rocksdb::Slice key = rocksdb::Slice(data1, len1);
+  rocksdb::Slice value = rocksdb::Slice(data2, len2);
+
+  rocksdb::WriteOptions options = writeOptions(native_db->db, is_sync);
+
+  rocksdb::ColumnFamilyHandle *handle = native_db->db->handles[column_family];
+  rocksdb::Status status =
+      is_merge ? native_db->db->db->Merge(options, handle, key, value)
+               : native_db->db->db->Put(options, handle, key, value);
+
+  Dart_TypedDataReleaseData(arg1);
+  Dart_TypedDataReleaseData(arg2);
+
+  maybeThrowStatus(status);
+
+  Dart_SetReturnValue(arguments, Dart_Null());
+  Dart_ExitScope();
+}
+
+void syncPut(Dart_NativeArguments
+                 arguments) { // (this, key, value, sync, column_family)
+  syncPutOrMerge(arguments, false);
+}
+
+void syncMerge(Dart_NativeArguments
+                   arguments) { // (this, key, operand, sync, column_family)
+  syncPutOrMerge(arguments, true);
+}
+
+void syncDelete(
+    Dart_NativeArguments arguments) { // (this, key, column_family)
+  Dart_EnterScope();
+
+  NativeDB *native_db;
+  Dart_Handle arg0 = Dart_GetNativeArgument(arguments, 0);
+  Dart_GetNativeInstanceField(arg0, 0, (intptr_t *)&native_db);
+
+  if (native_db->db == NULL) {
+    throwClosedException();
+    assert(false); // Not reached
+  }
+
+  size_t column_family = getColumnFamilyArgument(arguments, 2, native_db);
+
+  Dart_Handle arg1 = Dart_GetNativeArgument(arguments, 1);
+  Dart_TypedData_Type typed_data_type = Dart_GetTypeOfTypedData(arg1);
+  assert(typed_data_type == Dart_TypedData_kUint8);
+
+  char *data;
+  intptr_t len;
+  Dart_TypedDataAcquireData(arg1, &typed_data_type, (void **)&data, &len);
+
+  rocksdb::Slice key = rocksdb::Slice(data, len);
+  rocksdb::Status status =
+      native_db->db->db->Delete(writeOptions(native_db->db, false),
+                                native_db->db->handles[column_family], key);
+  Dart_TypedDataReleaseData(arg1);
+
+  maybeThrowStatus(status);
+
+  Dart_SetReturnValue(arguments, Dart_Null());
+  Dart_ExitScope();
+}
+
+void syncDeleteRange(Dart_NativeArguments
+                         arguments) { // (this, start, end, column_family)
+  Dart_EnterScope();
+
+  NativeDB *native_db;
+  Dart_Handle arg0 = Dart_GetNativeArgument(arguments, 0);
+  Dart_GetNativeInstanceField(arg0, 0, (intptr_t *)&native_db);
+
+  if (native_db->db == NULL) {
+    throwClosedException();
+    assert(false); // Not reached
+  }
+
+  size_t column_family = getColumnFamilyArgument(arguments, 3, native_db);
+
+  rocksdb::Status status;
+  {
+    std::string start, end;
+    getBytesArgument(arguments, 1, &start);
+    getBytesArgument(arguments, 2, &end);
+    // A single range tombstone replaces a delete of every key in the range.
+    status = native_db->db->db->DeleteRange(
+        writeOptions(native_db->db, false),
+        native_db->db->handles[column_family], start, end);
+  }
+
+  maybeThrowStatus(status);
+
+  Dart_SetReturnValue(arguments, Dart_Null());
+  Dart_ExitScope();
+}
+
+// Operation codes used in the packed buffer built by RocksWriteBatch.
+enum BatchOp {
+  kBatchPut = 1,
+  kBatchDelete = 2,
+  kBatchDeleteRange = 3,
+  kBatchMerge = 4
+};
+
+// Decode the packed operations in the buffer, calling apply(op,
+// column_family, key, value) for each and stopping at the first error. Each
+// operation is a tag, the key length and the value length (32-bit
+// little-endian) followed by the key and the value, each padded to a multiple
+// of 4 bytes. The low byte of the tag is the op code and the rest is the index
+// of the column family. For a range delete the key and value are the start and
+// end keys, and for a merge the value is the operand.
+template <typename Apply>
+static rocksdb::Status decodeBatchOps(const uint8_t *data, size_t len,
+                                      Apply apply) {
+  size_t offset = 0;
+  while (offset < len) {
+    if (len - offset < 12) {
+      return rocksdb::Status::InvalidArgument("truncated write batch");
+    }
+    uint32_t tag = readUint32(data + offset);
+    uint32_t key_len = readUint32(data + offset + 4);
+    uint32_t value_len = readUint32(data + offset + 8);
+    size_t key_offset = offset + 12;
+    size_t value_offset = key_offset + increaseToMultipleOf4(key_len);
+    size_t end_offset = value_offset + increaseToMultipleOf4(value_len);
+    if (end_offset > len) {
+      return rocksdb::Status::InvalidArgument("truncated write batch");
+    }
+    rocksdb::Slice key((const char *)data + key_offset, key_len);
+    rocksdb::Slice value((const char *)data + value_offset, value_len);
+    rocksdb::Status status = apply(tag & 0xFF, tag >> 8, key, value);
+    if (!status.ok()) {
+      return status;
+    }
+    offset = end_offset;
+  }
+  return rocksdb::Status::OK();
+}
+
+// Decode the packed operations in the buffer into the write batch.
+static rocksdb::Status decodeWriteBatch(DB *db, const uint8_t *data,
+                                        size_t len,
+                                        rocksdb::WriteBatch *batch) {
+  auto apply = [db, batch](uint32_t op, uint32_t column_family,
+                           const rocksdb::Slice &key,
+                           const rocksdb::Slice &value) -> rocksdb::Status {
+    if (column_family >= db->handles.size()) {
+      return rocksdb::Status::InvalidArgument("unknown column family");
+    }
+    rocksdb::ColumnFamilyHandle *handle = db->handles[column_family];
+    switch (op) {
+    case kBatchPut:
+      return batch->Put(handle, key, value);
+    case kBatchDelete:
+      return batch->Delete(handle, key);
+    case kBatchDeleteRange:
+      return batch->DeleteRange(handle, key, value);
+    case kBatchMerge: {
+      rocksdb::Status status = checkMergeOperator(db, column_family);
+      return status.ok() ? batch->Merge(handle, key, value) : status;
+    }
+    }
+    return rocksdb::Status::InvalidArgument("unknown write batch op");
+  };
+  return decodeBatchOps(data, len, apply);
+}
+
+void syncWrite(Dart_NativeArguments arguments) { // (this, ops, length, sync)
+  Dart_EnterScope();
+
+  NativeDB *native_db;
+  Dart_Handle arg0 = Dart_GetNativeArgument(arguments, 0);
+  Dart_GetNativeInstanceField(arg0, 0, (intptr_t *)&native_db);
+
+  if (native_db->db == NULL) {
+    throwClosedException();
+    assert(false); // Not reached
+  }
+
+  Dart_Handle arg1 = Dart_GetNativeArgument(arguments, 1);
+  Dart_TypedData_Type typed_data_type = Dart_GetTypeOfTypedData(arg1);
+  assert(typed_data_type == Dart_TypedData_kUint8);
+
+  int64_t length;
+  bool is_sync;
+  Dart_GetNativeIntegerArgument(arguments, 2, &length);
+  Dart_GetNativeBooleanArgument(arguments, 3, &is_sync);
+
+  rocksdb::Status status;
+  {
+    char *data;
+    intptr_t len;
+    Dart_TypedDataAcquireData(arg1, &typed_data_type, (void **)&data, &len);
+    assert(length <= len);
+
+    rocksdb::WriteBatch batch;
+    status = decodeWriteBatch(native_db->db, (const uint8_t *)data, length,
+                              &batch);
+    Dart_TypedDataReleaseData(arg1);
+
+    if (status.ok()) {
+      status = native_db->db->db->Write(writeOptions(native_db->db, is_sync),
+                                        &batch);
+    }
+  }
+
+  maybeThrowStatus(status);
+
+  Dart_SetReturnValue(arguments, Dart_Null());
+  Dart_ExitScope();
+}
+
+// Finalize the iterators, snapshots and transactions of the db, stop its
+// streams and drop its reference, returning true if the db is being closed,
+// in which case the waiter is woken up once it is. A stream holds its own
+// reference to the db until its thread has stopped.
+static bool closeNativeDB(NativeDB *native_db, CloseWaiter *waiter) {
+  // Finalize all iterators, release all snapshots, roll back all
+  // transactions and stop all streams
+  while (!native_db->iterators->empty()) {
+    iteratorFinalize(native_db->iterators->front());
+  }
+  while (!native_db->snapshots->empty()) {
+    snapshotFinalize(native_db->snapshots->front());
+  }
+  while (!native_db->transactions->empty()) {
+    transactionFinalize(native_db->transactions->front());
+  }
+  while (!native_db->streams->empty()) {
+    streamStop(native_db->streams->front());
+  }
+
+  bool is_finished = unreferenceDB(native_db->db, waiter);
+  native_db->db = NULL;
+  return is_finished;
+}
+
+void syncClose(Dart_NativeArguments arguments) { // (this)
+  Dart_EnterScope();
+
+  NativeDB *native_db;
+  Dart_Handle arg0 = Dart_GetNativeArgument(arguments, 0);
+  Dart_GetNativeInstanceField(arg0, 0, (intptr_t *)&native_db);
+
+  if (native_db->db == NULL) {
+    // DB has already been closed
+    throwClosedException();
+    assert(false); // Not reached
+  }
+
+  // Wait for the db to be closed, if this was the last reference, but without
+  // holding up the opening and closing of other dbs.
+  CloseWaiter waiter;
+  waiter.port = ILLEGAL_PORT;
+  pthread_mutex_init(&waiter.mutex, NULL);
+  pthread_cond_init(&waiter.closed, NULL);
+  waiter.is_closed = false;
+  if (closeNativeDB(native_db, &waiter)) {
+    pthread_mutex_lock(&waiter.mutex);
+    while (!waiter.is_closed) {
+      pthread_cond_wait(&waiter.closed, &waiter.mutex);
+    }
+    pthread_mutex_unlock(&waiter.mutex);
+  }
+  pthread_cond_destroy(&waiter.closed);
+  pthread_mutex_destroy(&waiter.mutex);
+
+  Dart_SetReturnValue(arguments, Dart_Null());
+  Dart_ExitScope();
+}
+
+// Like syncClose, except that the port is sent 0 once the db is closed rather
+// than the caller waiting for it.
+void dbCloseAsync(Dart_NativeArguments arguments) { // (this, port)
+  Dart_EnterScope();
+
+  NativeDB *native_db;
+  Dart_Handle arg0 = Dart_GetNativeArgument(arguments, 0);
+  Dart_GetNativeInstanceField(arg0, 0, (intptr_t *)&native_db);
+
+  if (native_db->db == NULL) {
+    // DB has already been closed
+    throwClosedException();
+    assert(false); // Not reached
+  }
+
+  CloseWaiter *waiter = new CloseWaiter();
+  Dart_SendPortGetId(Dart_GetNativeArgument(arguments, 1), &waiter->port);
+  if (!closeNativeDB(native_db, waiter)) {
+    // The db is still referenced by another isolate or a pending operation.
+    Dart_PostInteger(waiter->port, 0);
+    delete waiter;
+  }
+
+  Dart_SetReturnValue(arguments, Dart_Null());
+  Dart_ExitScope();
+}
+
+// ASYNC API
+
+// Number of threads in the pool that runs asynchronous operations. The pool is
+// shared by all databases in the process.
+const int ASYNC_POOL_THREADS = 4;
+// Maximum number of operations waiting for a thread. Callers block once the
+// queue is full.
+const size_t ASYNC_QUEUE_CAPACITY = 1024;
+
+// An operation to be performed on a pool thread, or on a thread of its own if
+// it is long running. The operation holds a reference to the db until it is
+// finished.
+struct AsyncOp {
+  DB *db;
+  Dart_Port port;
+  int64_t id;
+  // Result of the operation, if any, to be posted to the port.
+  PinnedValue *result;
+
+  AsyncOp() : db(NULL), port(0), id(0), result(NULL) {}
+  virtual ~AsyncOp() {}
+  virtual rocksdb::Status run() = 0;
+};
+
+struct AsyncGetOp : AsyncOp {
+  std::string key;
+  size_t column_family;
+
+  rocksdb::Status run() {
+    result = new PinnedValue(db, column_family);
+    rocksdb::Status status =
+        db->db->Get(rocksdb::ReadOptions(), db->handles[column_family], key,
+                    &result->slice);
+    if (!status.ok()) {
+      delete result;
+      result = NULL;
+    }
+    return status;
+  }
+};
+
+// A write, which is run by the pool like any other operation unless it is
+// durable, in which case it is committed together with the other durable
+// writes to the db by its commit thread, see startAsyncUpdate().
+struct AsyncUpdateOp : AsyncOp {
+  bool is_sync;
+
+  // Add the updates of the write to the batch.
+  virtual rocksdb::Status addTo(rocksdb::WriteBatch *batch) = 0;
+  // Returns the size of the updates.
+  virtual size_t size() const = 0;
+
+  rocksdb::Status run() {
+    rocksdb::WriteBatch batch;
+    rocksdb::Status status = addTo(&batch);
+    if (status.ok()) {
+      status = db->db->Write(writeOptions(db, is_sync), &batch);
+    }
+    return status;
+  }
+};
+
+struct AsyncPutOp : AsyncUpdateOp {
+  std::string key;
+  std::string value;
+  size_t column_family;
+
+  rocksdb::Status addTo(rocksdb::WriteBatch *batch) {
+    return batch->Put(db->handles[column_family], key, value);
+  }
+
+  size_t size() const { return key.size() + value.size(); }
+};
+
+struct AsyncWriteOp : AsyncUpdateOp {
+  std::string ops;
+
+  rocksdb::Status addTo(rocksdb::WriteBatch *batch) {
+    return decodeWriteBatch(db, (const uint8_t *)ops.data(), ops.size(),
+                            batch);
+  }
+
+  size_t size() const { return ops.size(); }
+};
+
+struct AsyncScanOp : AsyncOp {
+  IteratorParams params;
+
+  rocksdb::Status run() {
+    rocksdb::Iterator *it = newIterator(db, &params);
+    result = new PinnedValue(db, params.column_family);
+    std::string *entries = result->slice.GetSelf();
+    int64_t count = 0;
+    while (isInRange(it, params, count)) {
+      appendEntry(entries, it->key(), it->value());
+      count += 1;
+      iteratorAdvance(it, params);
+    }
+    result->slice.PinSelf();
+    rocksdb::Status status = it->status();
+    delete it;
+    if (!status.ok()) {
+      delete result;
+      result = NULL;
+    }
+    return status;
+  }
+};
+
+struct AsyncCompactOp : AsyncOp {
+  // The range is compacted from the first key if start is empty, since no key
+  // sorts before the empty key, and to the last key if has_end is false.
+  std::string start;
+  std::string end;
+  bool has_end;
+  bool is_bottommost_forced;
+  size_t column_family;
+
+  rocksdb::Status run() {
+    rocksdb::CompactRangeOptions options;
+    // Let automatic compactions and writes carry on meanwhile.
+    options.exclusive_manual_compaction = false;
+    options.bottommost_level_compaction =
+        is_bottommost_forced
+            ? rocksdb::BottommostLevelCompaction::kForce
+            : rocksdb::BottommostLevelCompaction::kIfHaveCompactionFilter;
+    rocksdb::Slice begin_slice(start);
+    rocksdb::Slice end_slice(end);
+    return db->db->CompactRange(options, db->handles[column_family],
+                                &begin_slice, has_end ? &end_slice : NULL);
+  }
+};
+
+struct AsyncIngestOp : AsyncOp {
+  std::vector<std::string> files;
+  bool is_move;
+  size_t column_family;
+
+  rocksdb::Status run() {
+    rocksdb::IngestExternalFileOptions options;
+    // Hard link the files into the db, which falls back to copying them if
+    // they are on another file system.
+    options.move_files = is_move;
+    return db->db->IngestExternalFile(db->handles[column_family], files,
+                                      options);
+  }
+};
+
+struct AsyncCatchUpOp : AsyncOp {
+  rocksdb::Status run() { return db->db->TryCatchUpWithPrimary(); }
+};
+
+struct AsyncCheckpointOp : AsyncOp {
+  std::string dir;
+
+  rocksdb::Status run() {
+    // The table files are hard linked into the checkpoint, which takes
+    // moments, rather than copied.
+    rocksdb::Checkpoint *checkpoint;
+    rocksdb::Status status = rocksdb::Checkpoint::Create(db->db, &checkpoint);
+    if (status.ok()) {
+      status = checkpoint->CreateCheckpoint(dir);
+      delete checkpoint;
+    }
+    return status;
+  }
+};
+
+static rocksdb::Status openBackupEngine(const std::string &backup_dir,
+                                        rocksdb::BackupEngine **engine) {
+  return rocksdb::BackupEngine::Open(rocksdb::Env::Default(),
+                                     rocksdb::BackupEngineOptions(backup_dir),
+                                     engine);
+}
+
+struct AsyncBackupOp : AsyncOp {
+  std::string backup_dir;
+  // Number of backups to keep once the new one is made, or 0 to keep all.
+  int64_t keep_latest;
+
+  rocksdb::Status run() {
+    // The backup engine only copies the table files that are not already in
+    // an earlier backup.
+    rocksdb::BackupEngine *engine;
+    rocksdb::Status status = openBackupEngine(backup_dir, &engine);
+    if (!status.ok()) {
+      return status;
+    }
+    status = engine->CreateNewBackup(db->db, true);
+    if (status.ok() && keep_latest > 0) {
+      status = engine->PurgeOldBackups(keep_latest);
+    }
+    delete engine;
+    return status;
+  }
+};
+
+// Restores the latest backup. Unlike the other operations it has no db, since
+// the db at the path must not be open.
+struct AsyncRestoreOp : AsyncOp {
+  std::string backup_dir;
+  std::string path;
+
+  rocksdb::Status run() {
+    // Hold the lock of the db while it is restored. This fails if the db is
+    // open, in this process or another. The restore deletes the LOCK file, so
+    // the lock then only keeps the db from being opened in this process, by
+    // the locked files the env tracks, until the restore is complete.
+    rocksdb::Env *env = rocksdb::Env::Default();
+    rocksdb::FileLock *lock;
+    rocksdb::Status status = env->CreateDirIfMissing(path);
+    if (status.ok()) {
+      status = env->LockFile(path + "/LOCK", &lock);
+    }
+    if (!status.ok()) {
+      return status;
+    }
+    rocksdb::BackupEngine *engine;
+    status = openBackupEngine(backup_dir, &engine);
+    if (status.ok()) {
+      status = engine->RestoreDBFromLatestBackup(path, path);
+      delete engine;
+    }
+    env->UnlockFile(lock);
+    return status;
+  }
+};
+
+pthread_mutex_t async_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t async_not_empty = PTHREAD_COND_INITIALIZER;
+pthread_cond_t async_not_full = PTHREAD_COND_INITIALIZER;
+std::deque<AsyncOp *> asyncQueue;
+bool isAsyncPoolStarted = false;
+
+// Post the outcome of an operation to the port as the list [id, status,
+// result], where result is either null or an external Uint8List that takes
+// ownership of the value.
+static void postAsyncResult(Dart_Port port, int64_t id, int64_t status,
+                            PinnedValue *result) {
+  Dart_CObject c_id;
+  c_id.type = Dart_CObject_kInt64;
+  c_id.value.as_int64 = id;
+
+  Dart_CObject c_status;
+  c_status.type = Dart_CObject_kInt64;
+  c_status.value.as_int64 = status;
+
+  Dart_CObject c_result;
+  if (result == NULL) {
+    c_result.type = Dart_CObject_kNull;
+  } else {
+    c_result.type = Dart_CObject_kExternalTypedData;
+    c_result.value.as_external_typed_data.type = Dart_TypedData_kUint8;
+    c_result.value.as_external_typed_data.length = result->slice.size();
+    c_result.value.as_external_typed_data.data =
+        (uint8_t *)result->slice.data();
+    c_result.value.as_external_typed_data.peer = result;
+    c_result.value.as_external_typed_data.callback = PinnedValueFinalizer;
+  }
+
+  Dart_CObject *elements[3] = {&c_id, &c_status, &c_result};
+  Dart_CObject message;
+  message.type = Dart_CObject_kArray;
+  message.value.as_array.length = 3;
+  message.value.as_array.values = elements;
+  if (!Dart_PostCObject(port, &message)) {
+    // The port is closed and the result was not handed over.
+    delete result;
+  }
+}
+
+// Run the operation, reply with its outcome and dispose of it.
+static void runAsyncOp(AsyncOp *op) {
+  rocksdb::Status status = op->run();
+  // Release the db before replying so that when the last reference is held
+  // by the operation the db is closed by the time the caller hears back.
+  if (op->db != NULL) {
+    unreferenceDB(op->db);
+  }
+  postAsyncResult(op->port, op->id, statusToError(status), op->result);
+  delete op;
+}
+
+void *runAsyncWorker(void *ptr) {
+  while (true) {
+    pthread_mutex_lock(&async_mutex);
+    while (asyncQueue.empty()) {
+      pthread_cond_wait(&async_not_empty, &async_mutex);
+    }
+    AsyncOp *op = asyncQueue.front();
+    asyncQueue.pop_front();
+    pthread_cond_signal(&async_not_full);
+    pthread_mutex_unlock(&async_mutex);
+
+    runAsyncOp(op);
+  }
+  return NULL;
+}
+
+// Run a long operation, such as a compaction, on a thread of its own rather
+// than tie up a pool thread for its duration.
+void *runAsyncThread(void *ptr) {
+  runAsyncOp((AsyncOp *)ptr);
+  return NULL;
+}
+
+// Queue the operation to be run by the pool, starting the pool threads if this
+// is the first operation.
+static void submitAsync(AsyncOp *op) {
+  pthread_mutex_lock(&async_mutex);
+  if (!isAsyncPoolStarted) {
+    isAsyncPoolStarted = true;
+    for (int i = 0; i < ASYNC_POOL_THREADS; i++) {
+      pthread_t thread;
+      pthread_attr_t attr;
+      pthread_attr_init(&attr);
+      pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+      int rc = pthread_create(&thread, &attr, runAsyncWorker, NULL);
+      assert(rc == 0);
+      pthread_attr_destroy(&attr);
+    }
+  }
+  while (asyncQueue.size() >= ASYNC_QUEUE_CAPACITY) {
+    pthread_cond_wait(&async_not_full, &async_mutex);
+  }
+  asyncQueue.push_back(op);
+  pthread_cond_signal(&async_not_empty);
+  pthread_mutex_unlock(&async_mutex);
+}
+
+// Run the operation on a new thread.
+static void startAsyncThread(AsyncOp *op) {
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int rc = pthread_create(&thread, &attr, runAsyncThread, op);
+  assert(rc == 0);
+  pthread_attr_destroy(&attr);
+}
+
+// Returns the NativeDB of the first argument, throwing if it is closed.
+static NativeDB *getOpenNativeDB(Dart_NativeArguments arguments) {
+  NativeDB *native_db;
+  Dart_Handle arg0 = Dart_GetNativeArgument(arguments, 0);
+  Dart_GetNativeInstanceField(arg0, 0, (intptr_t *)&native_db);
+
+  if (native_db->db == NULL) {
+    throwClosedException();
+    assert(false); // Not reached
+  }
+  return native_db;
+}
+
+// Commit a group of durable writes as one write batch with one sync of the
+// log, then reply to each. A write whose updates cannot be added to the batch
+// fails on its own without holding back the others.
+static void commitGroup(DB *db, const std::vector<AsyncUpdateOp *> &group) {
+  rocksdb::WriteBatch batch;
+  std::vector<rocksdb::Status> statuses(group.size());
+  for (size_t i = 0; i < group.size(); i++) {
+    batch.SetSavePoint();
+    statuses[i] = group[i]->addTo(&batch);
+    if (statuses[i].ok()) {
+      batch.PopSavePoint();
+    } else {
+      batch.RollbackToSavePoint();
+    }
+  }
+  rocksdb::Status status = db->db->Write(writeOptions(db, true), &batch);
+
+  for (size_t i = 0; i < group.size(); i++) {
+    AsyncUpdateOp *op = group[i];
+    // Release the db before replying, as for the other operations.
+    unreferenceDB(db);
+    postAsyncResult(op->port, op->id,
+                    statusToError(statuses[i].ok() ? status : statuses[i]),
+                    NULL);
+    delete op;
+  }
+}
+
+// Commit the durable writes queued on the db in groups until the db is
+// closed. Once a write is queued the thread waits up to commit_delay_micros
+// for more to join it, unless commit_max_bytes of updates are already
+// queued. Writes that arrive while a group is being synced form the next
+// group, so that concurrent writers share the syncs even without a delay.
+void *runCommitThread(void *ptr) {
+  DB *db = (DB *)ptr;
+  std::vector<AsyncUpdateOp *> group;
+  pthread_mutex_lock(&db->mutex);
+  while (true) {
+    while (db->commit_queue.empty() && !db->is_commit_stopped) {
+      pthread_cond_wait(&db->commit_changed, &db->mutex);
+    }
+    if (db->is_commit_stopped) {
+      break;
+    }
+    if (db->commit_delay_micros > 0) {
+      struct timespec deadline;
+      deadlineAfter(db->commit_delay_micros, &deadline);
+      int rc = 0;
+      while (db->commit_queue_bytes < db->commit_max_bytes &&
+             rc != ETIMEDOUT) {
+        rc = pthread_cond_timedwait(&db->commit_changed, &db->mutex,
+                                    &deadline);
+      }
+    }
+
+    // Take at least one write, and then as many as fit in commit_max_bytes.
+    int64_t bytes = 0;
+    while (!db->commit_queue.empty()) {
+      AsyncUpdateOp *op = db->commit_queue.front();
+      if (!group.empty() &&
+          bytes + (int64_t)op->size() > db->commit_max_bytes) {
+        break;
+      }
+      bytes += op->size();
+      group.push_back(op);
+      db->commit_queue.pop_front();
+    }
+    db->commit_queue_bytes -= bytes;
+    pthread_mutex_unlock(&db->mutex);
+
+    commitGroup(db, group);
+    group.clear();
+    pthread_mutex_lock(&db->mutex);
+  }
+  pthread_mutex_unlock(&db->mutex);
+  return NULL;
+}
+
+// Fill in the db and reply port of the operation from the common arguments
+// (this, port, id) and submit it to the pool, or run it on a new thread if it
+// is long running.
+static void startAsync(Dart_NativeArguments arguments, NativeDB *native_db,
+                       AsyncOp *op, bool is_long_running = false) {
+  Dart_Handle arg1 = Dart_GetNativeArgument(arguments, 1);
+  Dart_SendPortGetId(arg1, &op->port);
+  Dart_GetNativeIntegerArgument(arguments, 2, &op->id);
+
+  retainDB(native_db->db);
+  op->db = native_db->db;
+  if (is_long_running) {
+    startAsyncThread(op);
+  } else {
+    submitAsync(op);
+  }
+}
+
+// Start a write like startAsync(), except that a durable write is queued for
+// the commit thread of the db, which is started by the first one.
+static void startAsyncUpdate(Dart_NativeArguments arguments,
+                             NativeDB *native_db, AsyncUpdateOp *op) {
+  DB *db = native_db->db;
+  if (!op->is_sync || db->is_wal_disabled) {
+    startAsync(arguments, native_db, op);
+    return;
+  }
+  Dart_Handle arg1 = Dart_GetNativeArgument(arguments, 1);
+  Dart_SendPortGetId(arg1, &op->port);
+  Dart_GetNativeIntegerArgument(arguments, 2, &op->id);
+
+  retainDB(db);
+  op->db = db;
+  pthread_mutex_lock(&db->mutex);
+  if (!db->is_committing) {
+    db->is_committing = true;
+    int rc = pthread_create(&db->commit_thread, NULL, runCommitThread, db);
+    assert(rc == 0);
+  }
+  db->commit_queue.push_back(op);
+  db->commit_queue_bytes += op->size();
+  pthread_cond_signal(&db->commit_changed);
+  pthread_mutex_unlock(&db->mutex);
+}
+
+void asyncGet(
+    Dart_NativeArguments arguments) { // (this, port, id, key, column_family)
+  Dart_EnterScope();
+
+  NativeDB *native_db = getOpenNativeDB(arguments);
+  size_t column_family = getColumnFamilyArgument(arguments, 4, native_db);
+  AsyncGetOp *op = new AsyncGetOp();
+  op->column_family = column_family;
+  getBytesArgument(arguments, 3, &op->key);
+  startAsync(arguments, native_db, op);
+
+  Dart_SetReturnValue(arguments, Dart_Null());
+  Dart_ExitScope();
+}
+
+void asyncPut(
+    Dart_NativeArguments arguments) { // (this, port, id, key, value, sync,
+                                      // column_family)
+  Dart_EnterScope();
+
+  NativeDB *native_db = getOpenNativeDB(arguments);
+  size_t column_family = getColumnFamilyArgument(arguments, 6, native_db);
+  AsyncPutOp *op = new AsyncPutOp();
+  op->column_family = column_family;
+  getBytesArgument(arguments, 3, &op->key);
+  getBytesArgument(arguments, 4, &op->value);
+  Dart_GetNativeBooleanArgument(arguments, 5, &op->is_sync);
+  startAsyncUpdate(arguments, native_db, op);
+
+  Dart_SetReturnValue(arguments, Dart_Null());
+  Dart_ExitScope();
+}
+
+void asyncWrite(Dart_NativeArguments
+                    arguments) { // (this, port, id, ops, length, sync)
+  Dart_EnterScope();
+
+  NativeDB *native_db = getOpenNativeDB(arguments);
+  AsyncWriteOp *op = new AsyncWriteOp();
+  int64_t length;
+  getBytesArgument(arguments, 3, &op->ops);
+  Dart_GetNativeIntegerArgument(arguments, 4, &length);
+  Dart_GetNativeBooleanArgument(arguments, 5, &op->is_sync);
+  op->ops.resize(length);
+  startAsyncUpdate(arguments, native_db, op);
+
+  Dart_SetReturnValue(arguments, Dart_Null());
+  Dart_ExitScope();
+}
+
+void asyncScan(Dart_NativeArguments
+                   arguments) { // (this, port, id, limit, fillCache, gt,
+                                // is_gt_closed, lt, is_lt_closed, prefix,
+                                // reverse, column_family)
+  Dart_EnterScope();
+
+  NativeDB *native_db = getOpenNativeDB(arguments);
+  size_t column_family = getColumnFamilyArgument(arguments, 11, native_db);
+  AsyncScanOp *op = new AsyncScanOp();
+  getIteratorParams(arguments, 3, &op->params);
+  op->params.column_family = column_family;
+  startAsync(arguments, native_db, op);
+
+  Dart_SetReturnValue(arguments, Dart_Null());
+  Dart_ExitScope();
+}
+
+void asyncCompactRange(Dart_NativeArguments
+                           arguments) { // (this, port, id, start, end,
+                                        // bottommost_force, column_family)
+  Dart_EnterScope();
+
+  NativeDB *native_db = getOpenNativeDB(arguments);
+  size_t column_family = getColumnFamilyArgument(arguments, 6, native_db);
+  AsyncCompactOp *op = new AsyncCompactOp();
+  op->column_family = column_family;
+  getBytesArgument(arguments, 3, &op->start);
+  op->has_end = !Dart_IsNull(Dart_GetNativeArgument(arguments, 4));
+  getBytesArgument(arguments, 4, &op->end);
+  Dart_GetNativeBooleanArgument(arguments, 5, &op->is_bottommost_forced);
+  startAsync(arguments, native_db, op, true);
+
+  Dart_SetReturnValue(arguments, Dart_Null());
+  Dart_ExitScope();
+}
+
+void asyncIngest(Dart_NativeArguments
+                     arguments) { // (this, port, id, files, move,
+                                  // column_family)
+  Dart_EnterScope();
+
+  NativeDB *native_db = getOpenNativeDB(arguments);
+  size_t column_family = getColumnFamilyArgument(arguments, 5, native_db);
+  Dart_Handle files = Dart_GetNativeArgument(arguments, 3);
+  intptr_t file_count;
+  HandleError(Dart_ListLength(files, &file_count));
+  AsyncIngestOp *op = new AsyncIngestOp();
+  op->column_family = column_family;
+  for (intptr_t i = 0; i < file_count; i++) {
+    const char *file;
+    Dart_StringToCString(Dart_ListGetAt(files, i), &file);
+    op->files.push_back(file);
+  }
+  Dart_GetNativeBooleanArgument(arguments, 4, &op->is_move);
+  startAsync(arguments, native_db, op, true);
+
+  Dart_SetReturnValue(arguments, Dart_Null());
+  Dart_ExitScope();
+}
+
+void asyncCatchUp(Dart_NativeArguments arguments) { // (this, port, id)
+  Dart_EnterScope();
+
+  NativeDB *native_db = getOpenNativeDB(arguments);
+  startAsync(arguments, native_db, new AsyncCatchUpOp(), true);
+
+  Dart_SetReturnValue(arguments, Dart_Null());
+  Dart_ExitScope();
+}
+
+void asyncCheckpoint(
+    Dart_NativeArguments arguments) { // (this, port, id, dir)
+  Dart_EnterScope();
+
+  NativeDB *native_db = getOpenNativeDB(arguments);
+  AsyncCheckpointOp *op = new AsyncCheckpointOp();
+  getStringArgument(arguments, 3, &op->dir);
+  startAsync(arguments, native_db, op, true);
+
+  Dart_SetReturnValue(arguments, Dart_Null());
+  Dart_ExitScope();
+}
+
+void asyncBackup(Dart_NativeArguments
+                     arguments) { // (this, port, id, backup_dir, keep_latest)
+  Dart_EnterScope();
+
+  NativeDB *native_db = getOpenNativeDB(arguments);
+  AsyncBackupOp *op = new AsyncBackupOp();
+  getStringArgument(arguments, 3, &op->backup_dir);
+  Dart_GetNativeIntegerArgument(arguments, 4, &op->keep_latest);
+  startAsync(arguments, native_db, op, true);
+
+  Dart_SetReturnValue(arguments, Dart_Null());
+  Dart_ExitScope();
+}
+
+void asyncRestore(
+    Dart_NativeArguments arguments) { // (port, id, backup_dir, path)
+  Dart_EnterScope();
+
+  AsyncRestoreOp *op = new AsyncRestoreOp();
+  Dart_SendPortGetId(Dart_GetNativeArgument(arguments, 0), &op->port);
+  Dart_GetNativeIntegerArgument(arguments, 1, &op->id);
+  getStringArgument(arguments, 2, &op->backup_dir);
+  getStringArgument(arguments, 3, &op->path);
+  startAsyncThread(op);
+
+  Dart_SetReturnValue(arguments, Dart_Null());
+  Dart_ExitScope();
+}
+
+// Streams
+
+// Post the batches of the stream to its port as they are read, each as the
+// list [0, 0, entries] where the entries are packed as for syncNextBatch. The
+// last message is [0, status, null], with a status of 0 at the end of the
+// iteration and -1 if the stream was stopped by closing the db.
+void *runStream(void *ptr) {
+  NativeStream *stream = (NativeStream *)ptr;
+  DB *db = stream->db;
+  IteratorParams *params = &stream->params;
+  if (stream->iterator == NULL) {
+    stream->iterator = newIterator(db, params);
+  }
+  rocksdb::Iterator *it = stream->iterator;
+
+  int64_t count = 0;
+  bool is_cancelled = false;
+  while (isInRange(it, *params, count)) {
+    if (!streamTakeCredit(stream)) {
+      is_cancelled = true;
+      break;
+    }
+
+    PinnedValue *batch = new PinnedValue(db, params->column_family);
+    std::string *entries = batch->slice.GetSelf();
+    int64_t batch_count = 0;
+    while (batch_count < stream->max_count &&
+           (int64_t)entries->size() < stream->max_bytes &&
+           isInRange(it, *params, count)) {
+      appendEntry(entries, it->key(), it->value());
+      count += 1;
+      batch_count += 1;
+      iteratorAdvance(it, *params);
+    }
+    batch->slice.PinSelf();
+    postAsyncResult(stream->port, 0, 0, batch);
+  }
+
+  rocksdb::Status status = it->status();
+  delete it;
+  stream->iterator = NULL;
+  // Release the db before replying, as for the asynchronous operations.
+  unreferenceDB(db);
+  postAsyncResult(stream->port, 0,
+                  is_cancelled ? -1 : statusToError(status), NULL);
+  streamUnreference(stream);
+  return NULL;
+}
+
+void streamStart(Dart_NativeArguments
+                     arguments) { // (this, db, port, limit, fillCache, gt,
+                                  // is_gt_closed, lt, is_lt_closed, prefix,
+                                  // reverse, snapshot, column_family,
+                                  // max_count, max_bytes, readahead_size,
+                                  // credits)
+  Dart_EnterScope();
+
+  NativeDB *native_db;
+  Dart_Handle arg1 = Dart_GetNativeArgument(arguments, 1);
+  Dart_GetNativeInstanceField(arg1, 0, (intptr_t *)&native_db);
+
+  if (native_db->db == NULL) {
+    throwClosedException();
+    assert(false); // Not reached
+  }
+  const rocksdb::Snapshot *snapshot =
+      getSnapshotArgument(arguments, 11, native_db);
+  size_t column_family = getColumnFamilyArgument(arguments, 12, native_db);
+
+  NativeStream *stream = new NativeStream();
+  stream->native_db = native_db;
+  Dart_SendPortGetId(Dart_GetNativeArgument(arguments, 2), &stream->port);
+  getIteratorParams(arguments, 3, &stream->params);
+  stream->params.snapshot = snapshot;
+  stream->params.column_family = column_family;
+  Dart_GetNativeIntegerArgument(arguments, 13, &stream->max_count);
+  Dart_GetNativeIntegerArgument(arguments, 14, &stream->max_bytes);
+  int64_t readahead_size;
+  Dart_GetNativeIntegerArgument(arguments, 15, &readahead_size);
+  stream->params.readahead_size = readahead_size;
+  // A scan reads the blocks in order, so fetching the next ones while the
+  // current ones are read hides the latency of the reads.
+  stream->params.is_async_io = true;
+  Dart_GetNativeIntegerArgument(arguments, 16, &stream->credits);
+  stream->is_cancelled = false;
+  stream->refcount = 2;
+  pthread_mutex_init(&stream->mutex, NULL);
+  pthread_cond_init(&stream->changed, NULL);
+
+  // The snapshot may be released before the thread starts reading, so create
+  // the iterator now. It keeps reading from the snapshot's view.
+  stream->iterator = NULL;
+  if (snapshot != NULL) {
+    stream->iterator = newIterator(native_db->db, &stream->params);
+  }
+
+  // Add the stream to the db list so that it is stopped when the db is
+  // closed, rather than keep the db open while it waits for credits.
+  native_db->streams->push_back(stream);
+  retainDB(native_db->db);
+  stream->db = native_db->db;
+
+  Dart_Handle arg0 = Dart_GetNativeArgument(arguments, 0);
+  Dart_SetNativeInstanceField(arg0, 0, (intptr_t)stream);
+  Dart_NewWeakPersistentHandle(arg0, (void *)stream,
+                               /* external_allocation_size */
+                               sizeof(NativeStream), NativeStreamFinalizer);
+
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int rc = pthread_create(&thread, &attr, runStream, stream);
+  assert(rc == 0);
+  pthread_attr_destroy(&attr);
+
+  Dart_SetReturnValue(arguments, Dart_Null());
+  Dart_ExitScope();
+}
+
+// Allow the thread of the stream to post more batches.
+void streamRequest(Dart_NativeArguments arguments) { // (this, batches)
+  Dart_EnterScope();
+
+  NativeStream *stream;
+  Dart_Handle arg0 = Dart_GetNativeArgument(arguments, 0);
+  Dart_GetNativeInstanceField(arg0, 0, (intptr_t *)&stream);
+  int64_t batches;
+  Dart_GetNativeIntegerArgument(arguments, 1, &batches);
+
+  pthread_mutex_lock(&stream->mutex);
+  stream->credits += batches;
+  pthread_cond_signal(&stream->changed);
+  pthread_mutex_unlock(&stream->mutex);
+
+  Dart_SetReturnValue(arguments, Dart_Null());
+  Dart_ExitScope();
+}
+
+void streamCancel(Dart_NativeArguments arguments) { // (this)
+  Dart_EnterScope();
+
+  NativeStream *stream;
+  Dart_Handle arg0 = Dart_GetNativeArgument(arguments, 0);
+  Dart_GetNativeInstanceField(arg0, 0, (intptr_t *)&stream);
+  streamStop(stream);
+
+  Dart_SetReturnValue(arguments, Dart_Null());
+  Dart_ExitScope();
+}
+
+// Change feeds
+
+// How long a tailing change feed waits before reading the log again, once it
+// has posted every change.
+const int64_t CHANGE_FEED_POLL_MILLIS = 100;
+
+// Wait for up to millis, returning false if the stream is cancelled first.
+static bool streamWait(NativeStream *stream, int64_t millis) {
+  struct timespec deadline;
+  deadlineAfter(millis * 1000, &deadline);
+  pthread_mutex_lock(&stream->mutex);
+  int rc = 0;
+  while (!stream->is_cancelled && rc != ETIMEDOUT) {
+    rc = pthread_cond_timedwait(&stream->changed, &stream->mutex, &deadline);
+  }
+  bool is_cancelled = stream->is_cancelled;
+  pthread_mutex_unlock(&stream->mutex);
+  return !is_cancelled;
+}
+
+// Packs the updates of the write batches read from the log as changes. Each
+// change is the sequence number of the update (64-bit little-endian) followed
+// by the update packed as for RocksWriteBatch. Only the updates to the column
+// family of the stream from its next sequence number on are packed, and the
+// next sequence number is moved past every update that is seen.
+class ChangePacker : public rocksdb::WriteBatch::Handler {
+public:
+  ChangePacker(NativeStream *stream, std::string *changes)
+      : sequence(0), count(0), stream_(stream), changes_(changes) {
+    DB *db = stream->db;
+    column_family_ = stream->params.column_family;
+    column_family_id_ = db->handles[column_family_]->GetID();
+  }
+
+  rocksdb::Status PutCF(uint32_t column_family_id, const rocksdb::Slice &key,
+                        const rocksdb::Slice &value) override {
+    append(kBatchPut, column_family_id, key, value);
+    return rocksdb::Status::OK();
+  }
+
+  rocksdb::Status DeleteCF(uint32_t column_family_id,
+                           const rocksdb::Slice &key) override {
+    append(kBatchDelete, column_family_id, key, rocksdb::Slice());
+    return rocksdb::Status::OK();
+  }
+
+  rocksdb::Status SingleDeleteCF(uint32_t column_family_id,
+                                 const rocksdb::Slice &key) override {
+    append(kBatchDelete, column_family_id, key, rocksdb::Slice());
+    return rocksdb::Status::OK();
+  }
+
+  rocksdb::Status DeleteRangeCF(uint32_t column_family_id,
+                                const rocksdb::Slice &begin_key,
+                                const rocksdb::Slice &end_key) override {
+    append(kBatchDeleteRange, column_family_id, begin_key, end_key);
+    return rocksdb::Status::OK();
+  }
+
+  rocksdb::Status MergeCF(uint32_t column_family_id, const rocksdb::Slice &key,
+                          const rocksdb::Slice &value) override {
+    append(kBatchMerge, column_family_id, key, value);
+    return rocksdb::Status::OK();
+  }
+
+  // Returns the number of bytes packed.
+  size_t size() const { return changes_->size(); }
+
+  // Sequence number of the next update of the write batch being read.
+  rocksdb::SequenceNumber sequence;
+  // Number of changes packed.
+  int64_t count;
+
+private:
+  void append(BatchOp op, uint32_t column_family_id, const rocksdb::Slice &key,
+              const rocksdb::Slice &value) {
+    rocksdb::SequenceNumber update_sequence = sequence++;
+    if (update_sequence < stream_->sequence) {
+      return;
+    }
+    stream_->sequence = update_sequence + 1;
+    if (column_family_id != column_family_id_) {
+      return;
+    }
+    appendUint32(changes_, update_sequence & 0xFFFFFFFF);
+    appendUint32(changes_, update_sequence >> 32);
+    appendUint32(changes_, op | (column_family_ << 8));
+    appendUint32(changes_, key.size());
+    appendUint32(changes_, value.size());
+    appendPadded(changes_, key);
+    appendPadded(changes_, value);
+    count += 1;
+  }
+
+  NativeStream *stream_;
+  std::string *changes_;
+  size_t column_family_;
+  uint32_t column_family_id_;
+};
+
+// Read whole write batches from the log into the packer until it holds a
+// batch of the stream or every write has been read. The log iterator is kept
+// between calls and opened again at the next sequence number once it runs
+// out, since it does not see the writes made after it was opened.
+static rocksdb::Status
+readChanges(NativeStream *stream,
+            std::unique_ptr<rocksdb::TransactionLogIterator> *log,
+            ChangePacker *packer) {
+  rocksdb::DB *db = stream->db->db;
+  while (packer->count < stream->max_count &&
+         (int64_t)packer->size() < stream->max_bytes) {
+    if (*log == nullptr || !(*log)->Valid()) {
+      log->reset();
+      if (stream->sequence > db->GetLatestSequenceNumber()) {
+        return rocksdb::Status::OK();
+      }
+      rocksdb::Status status = db->GetUpdatesSince(stream->sequence, log);
+      if (status.IsNotFound()) {
+        // The log files holding the sequence number have been deleted.
+        return rocksdb::Status::InvalidArgument(
+            "sequence number is no longer in the write ahead log");
+      }
+      if (!status.ok()) {
+        return status;
+      }
+      if (!(*log)->Valid()) {
+        // A write that is still in progress is read once it completes.
+        status = (*log)->status();
+        log->reset();
+        return status.IsTryAgain() ? rocksdb::Status::OK() : status;
+      }
+    }
+    rocksdb::BatchResult result = (*log)->GetBatch();
+    packer->sequence = result.sequence;
+    rocksdb::Status status = result.writeBatchPtr->Iterate(packer);
+    if (!status.ok()) {
+      return status;
+    }
+    (*log)->Next();
+  }
+  return rocksdb::Status::OK();
+}
+
+// Post the changes read from the log to the port of the stream, in batches as
+// for runStream() with the changes packed by ChangePacker. Once every change
+// has been posted, a tailing feed reads the log again every
+// CHANGE_FEED_POLL_MILLIS and any other feed ends.
+void *runChangeFeed(void *ptr) {
+  NativeStream *stream = (NativeStream *)ptr;
+  DB *db = stream->db;
+  std::unique_ptr<rocksdb::TransactionLogIterator> log;
+
+  rocksdb::Status status;
+  bool is_cancelled = false;
+  while (true) {
+    if (!streamTakeCredit(stream)) {
+      is_cancelled = true;
+      break;
+    }
+    PinnedValue *batch = new PinnedValue(db, stream->params.column_family);
+    ChangePacker packer(stream, batch->slice.GetSelf());
+    status = readChanges(stream, &log, &packer);
+    if (status.ok() && packer.count > 0) {
+      batch->slice.PinSelf();
+      postAsyncResult(stream->port, 0, 0, batch);
+      continue;
+    }
+
+    // Nothing to post, so the credit is handed back.
+    delete batch;
+    pthread_mutex_lock(&stream->mutex);
+    stream->credits += 1;
+    pthread_mutex_unlock(&stream->mutex);
+    if (!status.ok() || !stream->is_tailing) {
+      break;
+    }
+    if (!streamWait(stream, CHANGE_FEED_POLL_MILLIS)) {
+      is_cancelled = true;
+      break;
+    }
+  }
+
+  log.reset();
+  unreferenceDB(db);
+  postAsyncResult(stream->port, 0,
+                  is_cancelled ? -1 : statusToError(status), NULL);
+  streamUnreference(stream);
+  return NULL;
+}
+
+void streamStartChanges(Dart_NativeArguments
+                            arguments) { // (this, db, port, sequence,
+                                         // column_family, is_tailing,
+                                         // max_count, max_bytes, credits)
+  Dart_EnterScope();
+
+  NativeDB *native_db;
+  Dart_Handle arg1 = Dart_GetNativeArgument(arguments, 1);
+  Dart_GetNativeInstanceField(arg1, 0, (intptr_t *)&native_db);
+
+  if (native_db->db == NULL) {
+    throwClosedException();
+    assert(false); // Not reached
+  }
+  size_t column_family = getColumnFamilyArgument(arguments, 4, native_db);
+
+  NativeStream *stream = new NativeStream();
+  stream->native_db = native_db;
+  Dart_SendPortGetId(Dart_GetNativeArgument(arguments, 2), &stream->port);
+  stream->params.column_family = column_family;
+  stream->iterator = NULL;
+  int64_t sequence;
+  Dart_GetNativeIntegerArgument(arguments, 3, &sequence);
+  stream->sequence = sequence;
+  Dart_GetNativeBooleanArgument(arguments, 5, &stream->is_tailing);
+  Dart_GetNativeIntegerArgument(arguments, 6, &stream->max_count);
+  Dart_GetNativeIntegerArgument(arguments, 7, &stream->max_bytes);
+  Dart_GetNativeIntegerArgument(arguments, 8, &stream->credits);
+  stream->is_cancelled = false;
+  stream->refcount = 2;
+  pthread_mutex_init(&stream->mutex, NULL);
+  pthread_cond_init(&stream->changed, NULL);
+
+  native_db->streams->push_back(stream);
+  retainDB(native_db->db);
+  stream->db = native_db->db;
+
+  Dart_Handle arg0 = Dart_GetNativeArgument(arguments, 0);
+  Dart_SetNativeInstanceField(arg0, 0, (intptr_t)stream);
+  Dart_NewWeakPersistentHandle(arg0, (void *)stream,
+                               /* external_allocation_size */
+                               sizeof(NativeStream), NativeStreamFinalizer);
+
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int rc = pthread_create(&thread, &attr, runChangeFeed, stream);
+  assert(rc == 0);
+  pthread_attr_destroy(&attr);
+
+  Dart_SetReturnValue(arguments, Dart_Null());
+  Dart_ExitScope();
+}
+
+// Returns the sequence number of the last write to the db.
+void dbLatestSequenceNumber(Dart_NativeArguments arguments) { // (this)
+  Dart_EnterScope();
+
+  NativeDB *native_db = getOpenNativeDB(arguments);
+  rocksdb::SequenceNumber sequence =
+      native_db->db->db->GetLatestSequenceNumber();
+
+  Dart_SetReturnValue(arguments, Dart_NewInteger(sequence));
+  Dart_ExitScope();
+}
+
+// Returns the index of the named column family, or -1 if the db does not have
+// it.
+void dbColumnFamilyIndex(Dart_NativeArguments arguments) { // (this, name)
+  Dart_EnterScope();
+
+  NativeDB *native_db = getOpenNativeDB(arguments);
+  const char *name;
+  Dart_StringToCString(Dart_GetNativeArgument(arguments, 1), &name);
+
+  const std::vector<rocksdb::ColumnFamilyDescriptor> &column_families =
+      native_db->db->column_families;
+  int64_t index = -1;
+  for (size_t i = 0; i < column_families.size(); i++) {
+    if (column_families[i].name == name) {
+      index = i;
+      break;
+    }
+  }
+
+  Dart_SetReturnValue(arguments, Dart_NewInteger(index));
+  Dart_ExitScope();
+}
+
+// Statistics
+
+// Returns the statistics of the db as the list [tickers, histograms], or null
+// if statistics are not enabled. Tickers is a list of alternating names and
+// counts. Histograms is a list of the name, median, 95th percentile, 99th
+// percentile, average, maximum, count and sum of each histogram.
+void dbStatistics(Dart_NativeArguments arguments) { // (this, reset)
+  Dart_EnterScope();
+
+  NativeDB *native_db = getOpenNativeDB(arguments);
+  bool is_reset;
+  Dart_GetNativeBooleanArgument(arguments, 1, &is_reset);
+
+  rocksdb::Statistics *statistics = native_db->db->options.statistics.get();
+  Dart_Handle result = Dart_Null();
+  if (statistics != NULL) {
+    const std::vector<std::pair<rocksdb::Tickers, std::string> > &tickers =
+        rocksdb::TickersNameMap;
+    Dart_Handle ticker_list = Dart_NewList(tickers.size() * 2);
+    for (size_t i = 0; i < tickers.size(); i++) {
+      Dart_ListSetAt(ticker_list, i * 2,
+                     Dart_NewStringFromCString(tickers[i].second.c_str()));
+      Dart_ListSetAt(
+          ticker_list, i * 2 + 1,
+          Dart_NewInteger(statistics->getTickerCount(tickers[i].first)));
+    }
+
+    const std::vector<std::pair<rocksdb::Histograms, std::string> >
+        &histograms = rocksdb::HistogramsNameMap;
+    Dart_Handle histogram_list = Dart_NewList(histograms.size() * 8);
+    for (size_t i = 0; i < histograms.size(); i++) {
+      rocksdb::HistogramData data;
+      statistics->histogramData(histograms[i].first, &data);
+      intptr_t at = i * 8;
+      Dart_ListSetAt(histogram_list, at,
+                     Dart_NewStringFromCString(histograms[i].second.c_str()));
+      Dart_ListSetAt(histogram_list, at + 1, Dart_NewDouble(data.median));
+      Dart_ListSetAt(histogram_list, at + 2, Dart_NewDouble(data.percentile95));
+      Dart_ListSetAt(histogram_list, at + 3, Dart_NewDouble(data.percentile99));
+      Dart_ListSetAt(histogram_list, at + 4, Dart_NewDouble(data.average));
+      Dart_ListSetAt(histogram_list, at + 5, Dart_NewDouble(data.max));
+      Dart_ListSetAt(histogram_list, at + 6, Dart_NewInteger(data.count));
+      Dart_ListSetAt(histogram_list, at + 7, Dart_NewInteger(data.sum));
+    }
+
+    result = Dart_NewList(2);
+    Dart_ListSetAt(result, 0, ticker_list);
+    Dart_ListSetAt(result, 1, histogram_list);
+    if (is_reset) {
+      statistics->Reset();
+    }
+  }
+
+  Dart_SetReturnValue(arguments, result);
+  Dart_ExitScope();
+}
+
+// Returns the value of a db property, or null if the property is not known.
+void dbProperty(Dart_NativeArguments
+                    arguments) { // (this, name, column_family, is_int)
+  Dart_EnterScope();
+
+  NativeDB *native_db = getOpenNativeDB(arguments);
+  size_t column_family = getColumnFamilyArgument(arguments, 2, native_db);
+  const char *name;
+  Dart_StringToCString(Dart_GetNativeArgument(arguments, 1), &name);
+  bool is_int;
+  Dart_GetNativeBooleanArgument(arguments, 3, &is_int);
 
-  Dart_Handle arg5 = Dart_GetNativeArgument(arguments, 4);
-  if (Dart_IsNull(arg5)) {
-    it_ref->gt = NULL;
-    it_ref->gt_len = 0;
+  rocksdb::ColumnFamilyHandle *handle = native_db->db->handles[column_family];
+  Dart_Handle result = Dart_Null();
+  if (is_int) {
+    uint64_t value;
+    if (native_db->db->db->GetIntProperty(handle, name, &value)) {
+      result = Dart_NewInteger(value);
+    }
   } else {
-    Dart_TypedData_Type typed_data_type = Dart_GetTypeOfTypedData(arg5);
-    assert(typed_data_type == Dart_TypedData_kUint8);
+    std::string value;
+    if (native_db->db->db->GetProperty(handle, name, &value)) {
+      result = Dart_NewStringFromCString(value.c_str());
+    }
+  }
+
+  Dart_SetReturnValue(arguments, result);
+  Dart_ExitScope();
+}
+
+// Returns the number of keys in a range, counted by a key-only iterator
+// without copying anything out of the db.
+void dbCount(Dart_NativeArguments
+                 arguments) { // (this, limit, fillCache, gt, is_gt_closed, lt,
+                              // is_lt_closed, prefix, reverse, snapshot,
+                              // column_family)
+  Dart_EnterScope();
+
+  NativeDB *native_db = getOpenNativeDB(arguments);
+  const rocksdb::Snapshot *snapshot =
+      getSnapshotArgument(arguments, 9, native_db);
+  size_t column_family = getColumnFamilyArgument(arguments, 10, native_db);
+
+  int64_t count = 0;
+  rocksdb::Status status;
+  {
+    IteratorParams params;
+    getIteratorParams(arguments, 1, &params);
+    params.snapshot = snapshot;
+    params.column_family = column_family;
+    params.is_keys_only = true;
+    rocksdb::Iterator *it = newIterator(native_db->db, &params);
+    while (isInRange(it, params, count)) {
+      count += 1;
+      iteratorAdvance(it, params);
+    }
+    status = it->status();
+    delete it;
+  }
+
+  maybeThrowStatus(status);
+
+  Dart_SetReturnValue(arguments, Dart_NewInteger(count));
+  Dart_ExitScope();
+}
+
+// Returns the approximate number of bytes used by a range of keys, in the
+// table files and in the memtables, without reading the range.
+void dbApproximateSize(Dart_NativeArguments
+                           arguments) { // (this, start, end, column_family)
+  Dart_EnterScope();
+
+  NativeDB *native_db = getOpenNativeDB(arguments);
+  size_t column_family = getColumnFamilyArgument(arguments, 3, native_db);
+
+  uint64_t size = 0;
+  rocksdb::Status status;
+  {
+    std::string start, end;
+    getBytesArgument(arguments, 1, &start);
+    getBytesArgument(arguments, 2, &end);
+    rocksdb::Range range(start, end);
+    rocksdb::ColumnFamilyHandle *handle =
+        native_db->db->handles[column_family];
+    // The size in the table files is estimated from their indexes, and the
+    // size in the memtables from a sample of their entries.
+    rocksdb::SizeApproximationOptions options;
+    options.include_files = true;
+    status = native_db->db->db->GetApproximateSizes(options, handle, &range, 1,
+                                                    &size);
+    if (status.ok()) {
+      uint64_t memtable_count;
+      uint64_t memtable_size;
+      native_db->db->db->GetApproximateMemTableStats(
+          handle, range, &memtable_count, &memtable_size);
+      size += memtable_size;
+    }
+  }
+
+  maybeThrowStatus(status);
+
+  Dart_SetReturnValue(arguments, Dart_NewInteger(size));
+  Dart_ExitScope();
+}
+
+// Snapshots
 
-    char *data;
-    intptr_t len;
-    Dart_TypedDataAcquireData(arg5, &typed_data_type, (void **)&data, &len);
-    it_ref->gt_len = len;
-    it_ref->gt = (uint8_t *)malloc(len);
-    memcpy(it_ref->gt, data, len);
-    Dart_TypedDataReleaseData(arg5);
-  }
+void snapshotNew(Dart_NativeArguments arguments) { // (this, db)
+  Dart_EnterScope();
 
-  Dart_Handle arg6 = Dart_GetNativeArgument(arguments, 6);
-  if (Dart_IsNull(arg6)) {
-    it_ref->lt = NULL;
-    it_ref->lt_len = 0;
-  } else {
-    Dart_TypedData_Type typed_data_type = Dart_GetTypeOfTypedData(arg6);
-    assert(typed_data_type != Dart_TypedData_kInvalid);
+  NativeDB *native_db;
+  Dart_Handle arg1 = Dart_GetNativeArgument(arguments, 1);
+  Dart_GetNativeInstanceField(arg1, 0, (intptr_t *)&native_db);
 
-    char *data;
-    intptr_t len;
-    Dart_TypedDataAcquireData(arg6, &typed_data_type, (void **)&data, &len);
-    it_ref->lt_len = len;
-    it_ref->lt = (uint8_t *)malloc(len);
-    memcpy(it_ref->lt, data, len);
-    Dart_TypedDataReleaseData(arg6);
+  if (native_db->db == NULL) {
+    throwClosedException();
+    assert(false); // Not reached
   }
 
-  Dart_GetNativeBooleanArgument(arguments, 5, &it_ref->is_gt_closed);
-  Dart_GetNativeBooleanArgument(arguments, 7, &it_ref->is_lt_closed);
+  NativeSnapshot *snapshot_ref = new NativeSnapshot();
+  snapshot_ref->native_db = native_db;
+  snapshot_ref->snapshot = native_db->db->db->GetSnapshot();
+  // Add the snapshot to the db list so that it is released before the db is
+  // closed.
+  native_db->snapshots->push_back(snapshot_ref);
 
-  // We just pass the directly allocated size of the iterator here. The iterator
-  // holds a lot of other data in memory when it mmaps the files but I'm not
-  // sure how to account for it. Because the GC is not seeing all of the
-  // allocated memory it is important to manually call finalize() on the
-  // iterator when we are done with it (for example when the iterator reaches
-  // the end of its range).
+  Dart_Handle arg0 = Dart_GetNativeArgument(arguments, 0);
+  Dart_SetNativeInstanceField(arg0, 0, (intptr_t)snapshot_ref);
+
+  // A snapshot holds back the removal of overwritten and deleted entries, so
+  // it should be released as soon as it is no longer needed rather than left
+  // to the GC.
   Dart_NewWeakPersistentHandle(
-      arg0, (void *)it_ref,
-      /* external_allocation_size */ sizeof(NativeIterator),
-      NativeIteratorFinalizer);
+      arg0, (void *)snapshot_ref,
+      /* external_allocation_size */ sizeof(NativeSnapshot),
+      NativeSnapshotFinalizer);
 
   Dart_SetReturnValue(arguments, Dart_Null());
   Dart_ExitScope();
 }
 
-// http://stackoverflow.com/questions/2022179/c-quick-calculation-of-next-multiple-of-4
-uint32_t increaseToMultipleOf4(uint32_t v) { return (v + 3) & ~0x03; }
-
-void syncNext(Dart_NativeArguments arguments) { // (this)
+void snapshotRelease(Dart_NativeArguments arguments) { // (this)
   Dart_EnterScope();
 
-  NativeIterator *native_iterator;
+  NativeSnapshot *snapshot_ref;
   Dart_Handle arg0 = Dart_GetNativeArgument(arguments, 0);
-  Dart_GetNativeInstanceField(arg0, 0, (intptr_t *)&native_iterator);
+  Dart_GetNativeInstanceField(arg0, 0, (intptr_t *)&snapshot_ref);
+  snapshotFinalize(snapshot_ref);
 
-  NativeDB *native_db = native_iterator->native_db;
-  rocksdb::Iterator *it = native_iterator->iterator;
+  Dart_SetReturnValue(arguments, Dart_Null());
+  Dart_ExitScope();
+}
+
+// Transactions
+
+// If status reports a transaction conflict, a write conflict found on commit
+// or against the transaction's snapshot or a lock that could not be taken in
+// time, throw a RocksBusyError. Otherwise as maybeThrowStatus().
+static void maybeThrowTransactionStatus(rocksdb::Status status) {
+  if (status.IsBusy() || status.IsTimedOut() || status.IsTryAgain()) {
+    Dart_Handle library = Dart_LookupLibrary(
+        Dart_NewStringFromCString("package:rocksdb/rocksdb.dart"));
+    Dart_Handle klass = Dart_GetType(
+        library, Dart_NewStringFromCString("RocksBusyError"), 0, NULL);
+    Dart_ThrowException(
+        Dart_New(klass, Dart_NewStringFromCString("_internal"), 0, NULL));
+  }
+  maybeThrowStatus(status);
+}
+
+// Returns the transaction of the RocksTransaction this argument, throwing an
+// error if it has ended or its db is closed.
+static NativeTransaction *getOpenTransaction(Dart_NativeArguments arguments) {
+  NativeTransaction *transaction_ref;
+  Dart_Handle arg0 = Dart_GetNativeArgument(arguments, 0);
+  Dart_GetNativeInstanceField(arg0, 0, (intptr_t *)&transaction_ref);
+  if (transaction_ref->native_db->db == NULL ||
+      transaction_ref->transaction == NULL) {
+    throwClosedException();
+    assert(false); // Not reached
+  }
+  return transaction_ref;
+}
+
+void transactionBegin(
+    Dart_NativeArguments
+        arguments) { // (this, db, sync, set_snapshot, lock_timeout)
+  Dart_EnterScope();
+
+  NativeDB *native_db;
+  Dart_Handle arg1 = Dart_GetNativeArgument(arguments, 1);
+  Dart_GetNativeInstanceField(arg1, 0, (intptr_t *)&native_db);
 
   if (native_db->db == NULL) {
     throwClosedException();
     assert(false); // Not reached
   }
+  DB *db = native_db->db;
+  if (db->transaction_mode == kTransactionNone) {
+    maybeThrowStatus(
+        rocksdb::Status::InvalidArgument("transactions are not enabled"));
+    assert(false); // Not reached
+  }
 
-  // If it is NULL we need to create the iterator and perform the initial seek.
-  if (!native_iterator->is_finalized && it == NULL) {
-    rocksdb::ReadOptions options;
-    options.fill_cache = native_iterator->is_fill_cache;
-    it = native_db->db->db->NewIterator(options);
-
-    native_iterator->iterator = it;
-    // Add the iterator to the db list. This is so we know to finalize it before
-    // finalizing the db.
-    native_db->iterators->push_back(native_iterator);
-
-    if (native_iterator->gt_len > 0) {
-      rocksdb::Slice start_slice =
-          rocksdb::Slice((char *)native_iterator->gt, native_iterator->gt_len);
-      it->Seek(start_slice);
-
-      if (!native_iterator->is_gt_closed && it->Valid()) {
-        // If we are pointing at start_slice and not inclusive then we need to
-        // advance by 1
-        rocksdb::Slice key = it->key();
-        if (key.compare(start_slice) == 0) {
-          it->Next();
-        }
-      }
-    } else {
-      it->SeekToFirst();
-    }
+  bool set_snapshot;
+  int64_t lock_timeout;
+  bool is_sync;
+  Dart_GetNativeBooleanArgument(arguments, 2, &is_sync);
+  rocksdb::WriteOptions write_options = writeOptions(db, is_sync);
+  Dart_GetNativeBooleanArgument(arguments, 3, &set_snapshot);
+  Dart_GetNativeIntegerArgument(arguments, 4, &lock_timeout);
+
+  rocksdb::Transaction *transaction;
+  if (db->transaction_mode == kTransactionPessimistic) {
+    // Writers wait at most lock_timeout milliseconds for the lock on a key,
+    // so that conflicting writers fail rather than queue up.
+    rocksdb::TransactionOptions options;
+    options.set_snapshot = set_snapshot;
+    options.lock_timeout = lock_timeout;
+    transaction = db->transaction_db->BeginTransaction(write_options, options);
+  } else {
+    // Conflicts are only looked for on commit, without taking any locks.
+    rocksdb::OptimisticTransactionOptions options;
+    options.set_snapshot = set_snapshot;
+    transaction = db->optimistic_db->BeginTransaction(write_options, options);
   }
 
-  rocksdb::Slice end_slice =
-      rocksdb::Slice((char *)native_iterator->lt, native_iterator->lt_len);
-  bool is_valid = false;
-  bool is_limit_reached = native_iterator->limit >= 0 &&
-                          native_iterator->count >= native_iterator->limit;
-  bool is_query_limit_reached = false;
+  NativeTransaction *transaction_ref = new NativeTransaction();
+  transaction_ref->native_db = native_db;
+  transaction_ref->transaction = transaction;
+  // Add the transaction to the db list so that it is rolled back before the
+  // db is closed.
+  native_db->transactions->push_back(transaction_ref);
 
-  rocksdb::Slice key;
-  rocksdb::Slice value;
-  if (!native_iterator->is_finalized) {
-    is_valid = it->Valid();
-  }
+  Dart_Handle arg0 = Dart_GetNativeArgument(arguments, 0);
+  Dart_SetNativeInstanceField(arg0, 0, (intptr_t)transaction_ref);
 
-  if (is_valid) {
-    key = it->key();
-    value = it->value();
+  // A pessimistic transaction holds the locks on the keys it has written
+  // until it ends, so it should be committed or rolled back rather than left
+  // to the GC.
+  Dart_NewWeakPersistentHandle(
+      arg0, (void *)transaction_ref,
+      /* external_allocation_size */ sizeof(NativeTransaction),
+      NativeTransactionFinalizer);
 
-    // Check if key is equal to end slice
-    if (native_iterator->lt_len > 0) {
-      int cmp = key.compare(end_slice);
-      if (cmp == 0 &&
-          !native_iterator->is_lt_closed) { // key == end_slice and not closed
-        is_query_limit_reached = true;
-      }
-      if (cmp > 0) { // key > end_slice
-        is_query_limit_reached = true;
-      }
-    }
-  }
+  Dart_SetReturnValue(arguments, Dart_Null());
+  Dart_ExitScope();
+}
 
-  Dart_Handle result = Dart_Null();
+void transactionGet(
+    Dart_NativeArguments
+        arguments) { // (this, key, column_family, for_update, exclusive)
+  Dart_EnterScope();
 
-  if (!is_valid || is_query_limit_reached || is_limit_reached) {
-    // Iteration is finished. Any subsequent calls to syncNext() will return
-    // null so we can finalize the iterator here.
-    iteratorFinalize(native_iterator);
-  } else {
-    // Copy key and value into same buffer.
-    // Align the value array to a multiple of 4 bytes so the offset of the view
-    // in dart is a multiple of 4.
-    uint32_t key_size_mult_4 = increaseToMultipleOf4(key.size());
-    result = Dart_NewTypedData(Dart_TypedData_kUint8,
-                               key_size_mult_4 + value.size() + 4);
-    uint8_t *data;
-    intptr_t len;
-    Dart_TypedData_Type t;
-    Dart_TypedDataAcquireData(result, &t, (void **)&data, &len);
-    data[0] = key.size() & 0xFF;
-    data[1] = (key.size() >> 8) & 0xFF;
-    data[2] = key_size_mult_4 & 0xFF;
-    data[3] = (key_size_mult_4 >> 8) & 0xFF;
-    memcpy(data + 4, key.data(), key.size());
-    memcpy(data + 4 + key_size_mult_4, value.data(), value.size());
-    Dart_TypedDataReleaseData(result);
+  NativeTransaction *transaction_ref = getOpenTransaction(arguments);
+  NativeDB *native_db = transaction_ref->native_db;
+  rocksdb::Transaction *transaction = transaction_ref->transaction;
+  size_t column_family = getColumnFamilyArgument(arguments, 2, native_db);
+  bool for_update;
+  bool exclusive;
+  Dart_GetNativeBooleanArgument(arguments, 3, &for_update);
+  Dart_GetNativeBooleanArgument(arguments, 4, &exclusive);
 
-    native_iterator->count += 1;
-    it->Next();
+  rocksdb::Status status;
+  Dart_Handle result = Dart_Null();
+  {
+    std::string key, value;
+    getBytesArgument(arguments, 1, &key);
+    rocksdb::ReadOptions options;
+    options.snapshot = transaction->GetSnapshot();
+    rocksdb::ColumnFamilyHandle *handle =
+        native_db->db->handles[column_family];
+    // Reading for update has the commit fail if the key is written by anyone
+    // else in the meantime, or locks the key in a pessimistic transaction.
+    if (for_update) {
+      status =
+          transaction->GetForUpdate(options, handle, key, &value, exclusive);
+    } else {
+      status = transaction->Get(options, handle, key, &value);
+    }
+    if (status.ok()) {
+      result = newUint8List(value);
+    }
+  }
+
+  if (!status.IsNotFound()) {
+    maybeThrowTransactionStatus(status);
   }
 
   Dart_SetReturnValue(arguments, result);
   Dart_ExitScope();
 }
 
-void syncGet(Dart_NativeArguments arguments) { // (this, key)
+static void transactionPutOrDelete(Dart_NativeArguments arguments,
+                                   bool is_delete) {
+  NativeTransaction *transaction_ref = getOpenTransaction(arguments);
+  NativeDB *native_db = transaction_ref->native_db;
+  size_t column_family =
+      getColumnFamilyArgument(arguments, is_delete ? 2 : 3, native_db);
+
+  rocksdb::Status status;
+  {
+    std::string key, value;
+    getBytesArgument(arguments, 1, &key);
+    rocksdb::ColumnFamilyHandle *handle =
+        native_db->db->handles[column_family];
+    if (is_delete) {
+      status = transaction_ref->transaction->Delete(handle, key);
+    } else {
+      getBytesArgument(arguments, 2, &value);
+      status = transaction_ref->transaction->Put(handle, key, value);
+    }
+  }
+
+  maybeThrowTransactionStatus(status);
+}
+
+void transactionPut(Dart_NativeArguments
+                        arguments) { // (this, key, value, column_family)
   Dart_EnterScope();
+  transactionPutOrDelete(arguments, false);
+  Dart_SetReturnValue(arguments, Dart_Null());
+  Dart_ExitScope();
+}
 
-  NativeDB *native_db;
-  Dart_Handle arg0 = Dart_GetNativeArgument(arguments, 0);
-  Dart_GetNativeInstanceField(arg0, 0, (intptr_t *)&native_db);
+void transactionDelete(
+    Dart_NativeArguments arguments) { // (this, key, column_family)
+  Dart_EnterScope();
+  transactionPutOrDelete(arguments, true);
+  Dart_SetReturnValue(arguments, Dart_Null());
+  Dart_ExitScope();
+}
 
-  if (native_db->db == NULL) {
-    throwClosedException();
-    assert(false); // Not reached
-  }
+// Commit the transaction. It ends whether or not the commit succeeds, so a
+// transaction that fails with a conflict is retried by beginning a new one.
+void transactionCommit(Dart_NativeArguments arguments) { // (this)
+  Dart_EnterScope();
 
-  Dart_Handle arg1 = Dart_GetNativeArgument(arguments, 1);
-  Dart_TypedData_Type typed_data_type = Dart_GetTypeOfTypedData(arg1);
-  assert(typed_data_type == Dart_TypedData_kUint8);
+  NativeTransaction *transaction_ref = getOpenTransaction(arguments);
+  rocksdb::Status status = transaction_ref->transaction->Commit();
+  transactionFinalize(transaction_ref);
 
-  char *data;
-  intptr_t len;
-  Dart_TypedDataAcquireData(arg1, &typed_data_type, (void **)&data, &len);
+  maybeThrowTransactionStatus(status);
 
-  rocksdb::Slice key = rocksdb::Slice(data, len);
+  Dart_SetReturnValue(arguments, Dart_Null());
+  Dart_ExitScope();
+}
 
-  std::string value;
-  rocksdb::Status status =
-      native_db->db->db->Get(rocksdb::ReadOptions(), key, &value);
-  Dart_TypedDataReleaseData(arg1);
+void transactionRollback(Dart_NativeArguments arguments) { // (this)
+  Dart_EnterScope();
 
-  Dart_Handle result;
-  if (status.IsNotFound()) {
-    result = Dart_Null();
-  } else if (status.ok()) {
-    result = Dart_NewTypedData(Dart_TypedData_kUint8, value.size());
-    Dart_TypedData_Type t;
-    Dart_TypedDataAcquireData(result, &t, (void **)&data, &len);
-    memcpy(data, value.data(), value.size());
-    Dart_TypedDataReleaseData(result);
-  } else {
-    maybeThrowStatus(status);
-    assert(false); // Not reached
-  }
+  NativeTransaction *transaction_ref;
+  Dart_Handle arg0 = Dart_GetNativeArgument(arguments, 0);
+  Dart_GetNativeInstanceField(arg0, 0, (intptr_t *)&transaction_ref);
+  // Deleting the transaction rolls it back.
+  transactionFinalize(transaction_ref);
 
-  Dart_SetReturnValue(arguments, result);
+  Dart_SetReturnValue(arguments, Dart_Null());
   Dart_ExitScope();
 }
 
-void syncPut(Dart_NativeArguments arguments) { // (this, key, value, sync)
+// Table file writer
+
+void sstWriterOpen(Dart_NativeArguments
+                       arguments) { // (this, db, path, column_family)
   Dart_EnterScope();
 
   NativeDB *native_db;
-  Dart_Handle arg0 = Dart_GetNativeArgument(arguments, 0);
-  Dart_GetNativeInstanceField(arg0, 0, (intptr_t *)&native_db);
+  Dart_Handle arg1 = Dart_GetNativeArgument(arguments, 1);
+  Dart_GetNativeInstanceField(arg1, 0, (intptr_t *)&native_db);
 
   if (native_db->db == NULL) {
     throwClosedException();
     assert(false); // Not reached
   }
 
-  Dart_Handle arg1 = Dart_GetNativeArgument(arguments, 1);
-  Dart_TypedData_Type typed_data_type1;
-
-  Dart_Handle arg2 = Dart_GetNativeArgument(arguments, 2);
-  Dart_TypedData_Type typed_data_type2;
+  size_t column_family = getColumnFamilyArgument(arguments, 3, native_db);
+  const char *path;
+  Dart_StringToCString(Dart_GetNativeArgument(arguments, 2), &path);
+
+  // The file is built with the options of the column family, so that it has
+  // the same format, compression and filters as the files written by the db.
+  rocksdb::Status status;
+  NativeSstWriter *writer_ref = new NativeSstWriter();
+  {
+    DB *db = native_db->db;
+    rocksdb::Options options(db->options,
+                             db->column_families[column_family].options);
+    writer_ref->writer = new rocksdb::SstFileWriter(
+        rocksdb::EnvOptions(), options, db->handles[column_family]);
+    writer_ref->column_family = column_family;
+    status = writer_ref->writer->Open(path);
+  }
+  if (!status.ok()) {
+    delete writer_ref->writer;
+    delete writer_ref;
+    maybeThrowStatus(status);
+  }
 
-  bool is_sync;
-  Dart_GetNativeBooleanArgument(arguments, 3, &is_sync);
+  Dart_Handle arg0 = Dart_GetNativeArgument(arguments, 0);
+  Dart_SetNativeInstanceField(arg0, 0, (intptr_t)writer_ref);
+  Dart_NewWeakPersistentHandle(
+      arg0, (void *)writer_ref,
+      /* external_allocation_size */ sizeof(NativeSstWriter),
+      NativeSstWriterFinalizer);
 
-  char *data1, *data2;
-  intptr_t len1, len2;
-  Dart_TypedDataAcquireData(arg1, &typed_data_type1, (void **)&data1, &len1);
-  Dart_TypedDataAcquireData(arg2, &typed_data_type2, (void **)&data2, &len2);
+  Dart_SetReturnValue(arguments, Dart_Null());
+  Dart_ExitScope();
+}
 
-  assert(typed_data_type1 == Dart_TypedData_kUint8);
-  assert(typed_data_type2 == Dart_TypedData_kUint8);
+// Returns the writer of the first argument, throwing if it is finished.
+static rocksdb::SstFileWriter *
+getOpenSstWriter(Dart_NativeArguments arguments, size_t *column_family) {
+  NativeSstWriter *writer_ref;
+  Dart_Handle arg0 = Dart_GetNativeArgument(arguments, 0);
+  Dart_GetNativeInstanceField(arg0, 0, (intptr_t *)&writer_ref);
 
-  rocksdb::Slice key = rocksdb::Slice(data1, len1);
-  rocksdb::Slice value = rocksdb::Slice(data2, len2);
+  if (writer_ref->writer == NULL) {
+    maybeThrowStatus(rocksdb::Status::InvalidArgument("finished"));
+  }
+  if (column_family != NULL) {
+    *column_family = writer_ref->column_family;
+  }
+  return writer_ref->writer;
+}
 
-  rocksdb::WriteOptions options;
-  options.sync = is_sync;
+void sstWriterPut(Dart_NativeArguments arguments) { // (this, key, value)
+  Dart_EnterScope();
 
-  rocksdb::Status status = native_db->db->db->Put(options, key, value);
+  rocksdb::SstFileWriter *writer = getOpenSstWriter(arguments, NULL);
 
-  Dart_TypedDataReleaseData(arg1);
-  Dart_TypedDataReleaseData(arg2);
+  rocksdb::Status status;
+  {
+    std::string key, value;
+    getBytesArgument(arguments, 1, &key);
+    getBytesArgument(arguments, 2, &value);
+    status = writer->Put(key, value);
+  }
 
   maybeThrowStatus(status);
 
@@ -650,30 +4030,51 @@ void syncPut(Dart_NativeArguments arguments) { // (this, key, value, sync)
   Dart_ExitScope();
 }
 
-void syncDelete(Dart_NativeArguments arguments) { // (this, key)
+// Add the operations of a packed write batch to the file. The keys must be in
+// increasing order, across calls, and in the column family of the writer.
+void sstWriterWrite(Dart_NativeArguments arguments) { // (this, ops, length)
   Dart_EnterScope();
 
-  NativeDB *native_db;
-  Dart_Handle arg0 = Dart_GetNativeArgument(arguments, 0);
-  Dart_GetNativeInstanceField(arg0, 0, (intptr_t *)&native_db);
-
-  if (native_db->db == NULL) {
-    throwClosedException();
-    assert(false); // Not reached
-  }
+  size_t writer_column_family;
+  rocksdb::SstFileWriter *writer =
+      getOpenSstWriter(arguments, &writer_column_family);
 
   Dart_Handle arg1 = Dart_GetNativeArgument(arguments, 1);
   Dart_TypedData_Type typed_data_type = Dart_GetTypeOfTypedData(arg1);
   assert(typed_data_type == Dart_TypedData_kUint8);
 
-  char *data;
-  intptr_t len;
-  Dart_TypedDataAcquireData(arg1, &typed_data_type, (void **)&data, &len);
+  int64_t length;
+  Dart_GetNativeIntegerArgument(arguments, 2, &length);
 
-  rocksdb::Slice key = rocksdb::Slice(data, len);
-  rocksdb::Status status =
-      native_db->db->db->Delete(rocksdb::WriteOptions(), key);
-  Dart_TypedDataReleaseData(arg1);
+  rocksdb::Status status;
+  {
+    char *data;
+    intptr_t len;
+    Dart_TypedDataAcquireData(arg1, &typed_data_type, (void **)&data, &len);
+    assert(length <= len);
+
+    auto apply = [writer, writer_column_family](
+                     uint32_t op, uint32_t column_family,
+                     const rocksdb::Slice &key,
+                     const rocksdb::Slice &value) -> rocksdb::Status {
+      if (column_family != writer_column_family) {
+        return rocksdb::Status::InvalidArgument("wrong column family");
+      }
+      switch (op) {
+      case kBatchPut:
+        return writer->Put(key, value);
+      case kBatchDelete:
+        return writer->Delete(key);
+      case kBatchDeleteRange:
+        return writer->DeleteRange(key, value);
+      case kBatchMerge:
+        return writer->Merge(key, value);
+      }
+      return rocksdb::Status::InvalidArgument("unknown write batch op");
+    };
+    status = decodeBatchOps((const uint8_t *)data, length, apply);
+    Dart_TypedDataReleaseData(arg1);
+  }
 
   maybeThrowStatus(status);
 
@@ -681,28 +4082,187 @@ void syncDelete(Dart_NativeArguments arguments) { // (this, key)
   Dart_ExitScope();
 }
 
-void syncClose(Dart_NativeArguments arguments) { // (this)
+// Finish the file and return its size in bytes.
+void sstWriterFinish(Dart_NativeArguments arguments) { // (this)
+  Dart_EnterScope();
+
+  NativeSstWriter *writer_ref;
+  Dart_Handle arg0 = Dart_GetNativeArgument(arguments, 0);
+  Dart_GetNativeInstanceField(arg0, 0, (intptr_t *)&writer_ref);
+
+  rocksdb::Status status;
+  rocksdb::ExternalSstFileInfo info;
+  if (writer_ref->writer == NULL) {
+    status = rocksdb::Status::InvalidArgument("finished");
+  } else {
+    status = writer_ref->writer->Finish(&info);
+    delete writer_ref->writer;
+    writer_ref->writer = NULL;
+  }
+
+  maybeThrowStatus(status);
+
+  Dart_SetReturnValue(arguments, Dart_NewInteger(info.file_size));
+  Dart_ExitScope();
+}
+
+// C ABI
+
+// The hot paths are also exported as plain C functions that Dart calls with
+// dart:ffi, which skips the scope, argument handles and typed data acquisition
+// of a native extension call. They take the DB returned by DB_Open or the
+// NativeIterator returned by SyncIterator_New, keys and values as a pointer
+// and a length in native memory, and return a negative status code as given
+// by statusToError() on failure. The Dart side checks that the db is open
+// before calling them.
+
+// Look up the key and return the length of its value. Values smaller than
+// PINNED_VALUE_THRESHOLD are copied into the buffer, which must hold at least
+// that many bytes. Larger values stay pinned, and the address of their
+// PinnedValue is written to the start of the buffer instead as a 64-bit
+// integer, to be handed to Dart by Ffi_PinnedValue.
+DART_EXPORT int64_t rocksdb_ffi_get(DB *db, int64_t column_family,
+                                    const uint8_t *key, int64_t key_length,
+                                    uint8_t *value, int64_t capacity) {
+  if ((size_t)column_family >= db->handles.size() ||
+      capacity < (int64_t)PINNED_VALUE_THRESHOLD) {
+    return statusToError(rocksdb::Status::InvalidArgument());
+  }
+  PinnedValue *pinned = new PinnedValue(db, column_family);
+  rocksdb::Status status = db->db->Get(
+      rocksdb::ReadOptions(), db->handles[column_family],
+      rocksdb::Slice((const char *)key, key_length), &pinned->slice);
+  if (!status.ok()) {
+    delete pinned;
+    return statusToError(status);
+  }
+  int64_t length = pinned->slice.size();
+  if (pinned->slice.size() < PINNED_VALUE_THRESHOLD) {
+    memcpy(value, pinned->slice.data(), pinned->slice.size());
+    delete pinned;
+  } else {
+    // Always 8 bytes, whatever the size of a pointer, as read by Dart.
+    int64_t address = (intptr_t)pinned;
+    memcpy(value, &address, sizeof(address));
+  }
+  return length;
+}
+
+DART_EXPORT int64_t rocksdb_ffi_put(DB *db, int64_t column_family,
+                                    const uint8_t *key, int64_t key_length,
+                                    const uint8_t *value, int64_t value_length,
+                                    int64_t sync) {
+  if ((size_t)column_family >= db->handles.size()) {
+    return statusToError(rocksdb::Status::InvalidArgument());
+  }
+  return statusToError(
+      db->db->Put(writeOptions(db, sync != 0), db->handles[column_family],
+                  rocksdb::Slice((const char *)key, key_length),
+                  rocksdb::Slice((const char *)value, value_length)));
+}
+
+DART_EXPORT int64_t rocksdb_ffi_delete(DB *db, int64_t column_family,
+                                       const uint8_t *key,
+                                       int64_t key_length) {
+  if ((size_t)column_family >= db->handles.size()) {
+    return statusToError(rocksdb::Status::InvalidArgument());
+  }
+  return statusToError(
+      db->db->Delete(writeOptions(db, false), db->handles[column_family],
+                     rocksdb::Slice((const char *)key, key_length)));
+}
+
+// Apply the operations of a packed write batch, see decodeWriteBatch().
+DART_EXPORT int64_t rocksdb_ffi_write(DB *db, const uint8_t *ops,
+                                      int64_t length, int64_t sync) {
+  rocksdb::WriteBatch batch;
+  rocksdb::Status status = decodeWriteBatch(db, ops, length, &batch);
+  if (status.ok()) {
+    status = db->db->Write(writeOptions(db, sync != 0), &batch);
+  }
+  return statusToError(status);
+}
+
+// Read the next entries of the iteration into the batch buffer of the
+// iterator, see rocksdb_ffi_iterator_batch(). Returns the length of the
+// entries in bytes, which is 0 once the iteration is finished.
+DART_EXPORT int64_t rocksdb_ffi_iterator_next_batch(NativeIterator *it_ref,
+                                                    int64_t max_count,
+                                                    int64_t max_bytes) {
+  if (it_ref->native_db->db == NULL) {
+    return -1;
+  }
+  if (iteratorNextBatch(it_ref, max_count, max_bytes) == 0) {
+    return 0;
+  }
+  return it_ref->batch.size();
+}
+
+// Returns the entries read by the last rocksdb_ffi_iterator_next_batch(),
+// which remain valid until the next call.
+DART_EXPORT const uint8_t *rocksdb_ffi_iterator_batch(NativeIterator *it_ref) {
+  return (const uint8_t *)it_ref->batch.data();
+}
+
+// Returns the addresses of the C ABI functions, in the order expected by the
+// Dart side. They are looked up through the extension rather than by symbol
+// name, since the library is not loaded globally.
+void ffiFunctions(Dart_NativeArguments arguments) { // ()
+  Dart_EnterScope();
+
+  const void *functions[] = {
+      (const void *)rocksdb_ffi_get,
+      (const void *)rocksdb_ffi_put,
+      (const void *)rocksdb_ffi_delete,
+      (const void *)rocksdb_ffi_write,
+      (const void *)rocksdb_ffi_iterator_next_batch,
+      (const void *)rocksdb_ffi_iterator_batch};
+  intptr_t count = sizeof(functions) / sizeof(functions[0]);
+  Dart_Handle result = Dart_NewList(count);
+  for (intptr_t i = 0; i < count; i++) {
+    Dart_ListSetAt(result, i, Dart_NewInteger((intptr_t)functions[i]));
+  }
+
+  Dart_SetReturnValue(arguments, result);
+  Dart_ExitScope();
+}
+
+// Returns the address of the native buffer of the db, growing it to hold at
+// least capacity bytes.
+void dbFfiBuffer(Dart_NativeArguments arguments) { // (this, capacity)
   Dart_EnterScope();
 
   NativeDB *native_db;
   Dart_Handle arg0 = Dart_GetNativeArgument(arguments, 0);
   Dart_GetNativeInstanceField(arg0, 0, (intptr_t *)&native_db);
 
-  if (native_db->db == NULL) {
-    // DB has already been closed
-    throwClosedException();
-    assert(false); // Not reached
+  int64_t capacity;
+  Dart_GetNativeIntegerArgument(arguments, 1, &capacity);
+  if (capacity > native_db->ffi_buffer_size) {
+    free(native_db->ffi_buffer);
+    native_db->ffi_buffer = (uint8_t *)malloc(capacity);
+    native_db->ffi_buffer_size = capacity;
   }
 
-  // Finalize all iterators
-  while (!native_db->iterators->empty()) {
-    iteratorFinalize(native_db->iterators->front());
-  }
+  Dart_SetReturnValue(arguments,
+                      Dart_NewInteger((intptr_t)native_db->ffi_buffer));
+  Dart_ExitScope();
+}
 
-  unreferenceDB(native_db->db);
-  native_db->db = NULL;
+// Hand a value left pinned by rocksdb_ffi_get() to Dart without copying it.
+// The finalizer releases the pin.
+void ffiPinnedValue(Dart_NativeArguments arguments) { // (address)
+  Dart_EnterScope();
 
-  Dart_SetReturnValue(arguments, Dart_Null());
+  int64_t address;
+  Dart_GetNativeIntegerArgument(arguments, 0, &address);
+  PinnedValue *value = (PinnedValue *)(intptr_t)address;
+  Dart_Handle result = Dart_NewExternalTypedDataWithFinalizer(
+      Dart_TypedData_kUint8, (void *)value->slice.data(), value->slice.size(),
+      value, /* external_allocation_size */ value->slice.size(),
+      PinnedValueFinalizer);
+
+  Dart_SetReturnValue(arguments, result);
   Dart_ExitScope();
 }
 
@@ -714,15 +4274,61 @@ struct FunctionLookup {
 };
 
 FunctionLookup function_list[] = {{"DB_Open", dbOpen},
+                                  {"DB_ColumnFamilyIndex", dbColumnFamilyIndex},
+                                  {"DB_Statistics", dbStatistics},
+                                  {"DB_Property", dbProperty},
+                                  {"DB_Count", dbCount},
+                                  {"DB_ApproximateSize", dbApproximateSize},
+                                  {"DB_LatestSequenceNumber",
+                                   dbLatestSequenceNumber},
+                                  {"DB_CloseAsync", dbCloseAsync},
+                                  {"DB_FfiBuffer", dbFfiBuffer},
+                                  {"Ffi_Functions", ffiFunctions},
+                                  {"Ffi_PinnedValue", ffiPinnedValue},
 
                                   {"SyncIterator_New", syncNew},
-                                  {"SyncIterator_Next", syncNext},
+                                  {"SyncIterator_NextBatch", syncNextBatch},
+
+                                  {"Snapshot_New", snapshotNew},
+                                  {"Snapshot_Release", snapshotRelease},
+
+                                  {"Transaction_Begin", transactionBegin},
+                                  {"Transaction_Get", transactionGet},
+                                  {"Transaction_Put", transactionPut},
+                                  {"Transaction_Delete", transactionDelete},
+                                  {"Transaction_Commit", transactionCommit},
+                                  {"Transaction_Rollback", transactionRollback},
+
+                                  {"SstWriter_Open", sstWriterOpen},
+                                  {"SstWriter_Put", sstWriterPut},
+                                  {"SstWriter_Write", sstWriterWrite},
+                                  {"SstWriter_Finish", sstWriterFinish},
 
                                   {"SyncGet", syncGet},
+                                  {"SyncGetMany", syncGetMany},
                                   {"SyncPut", syncPut},
+                                  {"SyncMerge", syncMerge},
                                   {"SyncDelete", syncDelete},
+                                  {"SyncDeleteRange", syncDeleteRange},
+                                  {"SyncWrite", syncWrite},
                                   {"SyncClose", syncClose},
 
+                                  {"AsyncGet", asyncGet},
+                                  {"AsyncPut", asyncPut},
+                                  {"AsyncWrite", asyncWrite},
+                                  {"AsyncScan", asyncScan},
+                                  {"AsyncCompactRange", asyncCompactRange},
+                                  {"AsyncIngest", asyncIngest},
+                                  {"AsyncCatchUp", asyncCatchUp},
+                                  {"AsyncCheckpoint", asyncCheckpoint},
+                                  {"AsyncBackup", asyncBackup},
+                                  {"AsyncRestore", asyncRestore},
+
+                                  {"Stream_Start", streamStart},
+                                  {"Stream_Request", streamRequest},
+                                  {"Stream_Cancel", streamCancel},
+                                  {"Stream_StartChanges", streamStartChanges},
+
                                   {NULL, NULL}};
 
 FunctionLookup no_scope_function_list[] = {{NULL, NULL}};
@@ -5,9 +5,11 @@
 library rocksdb;
 
 import 'dart:convert' as convert;
-import 'dart:async' show Future, Completer;
+import 'dart:async' show Completer, Future, Stream, StreamController;
+import 'dart:ffi' as ffi;
 import 'dart:isolate' show RawReceivePort, SendPort;
-import 'dart:typed_data' show Uint8List;
+import 'dart:typed_data'
+    show ByteData, Endian, Int64List, Uint8List, UnmodifiableUint8ListView;
 import 'dart:nativewrappers' show NativeFieldWrapperClass2;
 import 'dart:collection' show IterableBase;
 
@@ -45,6 +47,15 @@ class RocksInvalidArgumentError extends RocksError {
       : super._internal('Invalid argument');
 }
 
+/// Exception thrown if a transaction conflicts with another: a key it read for
+/// update or wrote was written by someone else before it committed, or it
+/// could not lock a key held by another pessimistic transaction in time.
+///
+/// The transaction may be retried from the start.
+class RocksBusyError extends RocksError {
+  const RocksBusyError._internal() : super._internal('Busy');
+}
+
 class _Uint8ListEncoder extends convert.Converter<List<int>, Uint8List> {
   const _Uint8ListEncoder();
   @override
@@ -85,20 +96,402 @@ class _IdentityCodec extends convert.Codec<Uint8List, Uint8List> {
       const _IdentityConverter();
 }
 
+class _Uint64Encoder extends convert.Converter<int, Uint8List> {
+  const _Uint64Encoder();
+  @override
+  Uint8List convert(int input) {
+    var bytes = Uint8List(8);
+    ByteData.view(bytes.buffer).setUint64(0, input, Endian.little);
+    return bytes;
+  }
+}
+
+class _Uint64Decoder extends convert.Converter<Uint8List, int> {
+  const _Uint64Decoder();
+  @override
+  int convert(Uint8List input) {
+    if (input.length != 8) {
+      throw FormatException('Expected 8 bytes, got ${input.length}');
+    }
+    return ByteData.view(input.buffer, input.offsetInBytes, 8)
+        .getUint64(0, Endian.little);
+  }
+}
+
+class _Uint64Codec extends convert.Codec<int, Uint8List> {
+  const _Uint64Codec();
+  @override
+  convert.Converter<int, Uint8List> get encoder => const _Uint64Encoder();
+  @override
+  convert.Converter<Uint8List, int> get decoder => const _Uint64Decoder();
+}
+
+/// The compression applied to the blocks of table files.
+enum RocksCompression { none, snappy, zlib, lz4, lz4hc, zstd }
+
+/// How table files are compacted.
+enum RocksCompactionStyle {
+  /// Files are organised in levels of increasing size. Reads and space use are
+  /// efficient at the cost of rewriting data more often.
+  level,
+
+  /// Files are merged into larger sorted runs, which rewrites data less often
+  /// but uses more space and makes reads slower.
+  universal,
+
+  /// The oldest files are dropped once the total size exceeds a limit. Only
+  /// suitable for data with a limited lifetime, such as caches and logs.
+  fifo,
+}
+
+/// A merge operator, which combines the operands given to [RocksDB.merge] with
+/// the existing value of a key as the key is read or compacted.
+///
+/// The `uint64` operators work on values that are 64-bit unsigned
+/// little-endian integers, as encoded by [RocksDB.uint64]. Any other value
+/// fails the merge, and reads of the key throw [RocksCorruptionError].
+enum RocksMergeOperator {
+  /// Adds the operand to the value. The sum wraps around, so merging a
+  /// negative operand subtracts from the value.
+  uint64Add,
+
+  /// Keeps the larger of the value and the operand.
+  uint64Max,
+
+  /// Keeps the smaller of the value and the operand.
+  uint64Min,
+
+  /// Appends the operand to the value, separated by
+  /// [RocksOptions.mergeDelimiter].
+  append,
+}
+
+/// How the transactions of a database are coordinated, given to
+/// [RocksDB.open]. See [RocksDB.transaction].
+enum RocksTransactionMode {
+  /// Transactions are not supported.
+  none,
+
+  /// Transactions lock the keys they write, and the keys they read for update,
+  /// until they end. A transaction that cannot get a lock in time fails rather
+  /// than waiting behind the holder.
+  pessimistic,
+
+  /// Transactions take no locks. Instead the commit fails if a key that was
+  /// written or read for update has been written by someone else since. Best
+  /// suited to workloads where conflicts are rare.
+  optimistic,
+}
+
+/// How a database is opened by [RocksDB.open].
+enum RocksOpenMode {
+  /// Reads and writes. Only one process at a time may open a database this
+  /// way.
+  readWrite,
+
+  /// Reads only, of the database as it was when it was opened. Any number of
+  /// processes may open a database this way, including while another process
+  /// has it open for writing, but they do not see the later writes.
+  readOnly,
+
+  /// Reads only, as a secondary instance that follows a primary opened for
+  /// writing in another process. Any number of processes may open secondary
+  /// instances. The instance sees the writes of the primary up to when it was
+  /// last caught up with [RocksDB.tryCatchUpWithPrimary], or by the timer
+  /// set with the `catchUpInterval` of [RocksDB.open].
+  secondary,
+}
+
+/// Options for tuning the storage of a database, given to [RocksDB.open].
+///
+/// Each column family is tuned separately, see [RocksColumnFamilyDescriptor].
+class RocksOptions {
+  /// Approximate size in bytes of the blocks that table files are divided
+  /// into. Larger blocks compress better and make scans faster, smaller blocks
+  /// make point lookups faster.
+  final int blockSize;
+
+  /// Number of bits per key used by the filter that lets point lookups skip
+  /// table files not containing the key. Set to 0 to disable the filter.
+  final double bitsPerKey;
+
+  /// If true, use a ribbon filter instead of a bloom filter. Ribbon filters
+  /// save about 30% of the memory for the same false positive rate but take
+  /// more CPU to build. Requires RocksDB 7 or later, otherwise [RocksDB.open]
+  /// throws a [RocksInvalidArgumentError].
+  final bool ribbonFilter;
+
+  /// Capacity in bytes of the block cache holding uncompressed blocks. Set to
+  /// 0 to disable the block cache.
+  final int blockCacheSize;
+
+  /// If true, the database uses a block cache that is shared by every
+  /// database in the process that also sets this option. The shared cache
+  /// grows to the largest [blockCacheSize] requested.
+  final bool sharedBlockCache;
+
+  /// If true, index and filter blocks are held in the block cache, so their
+  /// memory is bounded by the cache capacity, instead of being held for as
+  /// long as a table file is open.
+  final bool cacheIndexAndFilterBlocks;
+
+  /// If true, filters and indexes are partitioned into blocks so that only the
+  /// parts that are used need to be in memory. Mainly useful with
+  /// [cacheIndexAndFilterBlocks] for very large databases.
+  final bool partitionFilters;
+
+  /// If greater than 0, the prefix of each key is its first [prefixLength]
+  /// bytes. Keys that are shorter have no prefix.
+  ///
+  /// With a prefix, the filters also record the prefix of each key so that
+  /// [RocksDB.getPrefix] can skip table files and memtables that do not hold
+  /// the prefix. The prefix must not change once the database is created.
+  final int prefixLength;
+
+  /// If set, and [prefixLength] is not, the prefix of each key is everything
+  /// up to and including the [prefixDelimiterCount]'th occurrence of this
+  /// single ASCII character. For example, with a delimiter of `/` and a count
+  /// of 1 the prefix of `tenant/entity/1` is `tenant/`. Keys with fewer
+  /// delimiters have no prefix.
+  final String prefixDelimiter;
+
+  /// The number of delimiters included in the prefix, see [prefixDelimiter].
+  final int prefixDelimiterCount;
+
+  /// When there is a prefix, the fraction of the memtable size used for a
+  /// bloom filter of the prefixes in the memtable. Set to 0 to disable.
+  final double memtablePrefixBloomRatio;
+
+  /// The compression of table files. If null, snappy is used if RocksDB was
+  /// built with it and otherwise there is no compression.
+  final RocksCompression compression;
+
+  /// If given, the compression of the table files of each level, starting at
+  /// level 0, in place of [compression]. Levels past the end of the list use
+  /// its last compression. The upper levels are rewritten most often by
+  /// compactions, so a cheap compression, or none, suits them best.
+  final List<RocksCompression> compressionPerLevel;
+
+  /// The level of [compression], such as 1 to 22 for zstd, where higher
+  /// levels compress better but more slowly. If null, the default level of
+  /// the compression is used.
+  final int compressionLevel;
+
+  /// If greater than 0, table files are compressed with a dictionary of up to
+  /// this many bytes, sampled from their blocks, so that values that are small
+  /// but share their structure, such as JSON documents, compress well even
+  /// though each block holds few of them. Typically 16 KB.
+  final int compressionDictBytes;
+
+  /// If greater than 0, and the compression is zstd, the dictionary is trained
+  /// on up to this many bytes of the blocks of a table file rather than being
+  /// a plain sample, which gives better dictionaries. Typically 100 times
+  /// [compressionDictBytes].
+  final int compressionTrainBytes;
+
+  /// If given, the compression of the bottommost level, which holds most of
+  /// the data and is rewritten least often, in place of [compression] or
+  /// [compressionPerLevel].
+  final RocksCompression bottommostCompression;
+
+  /// The level of [bottommostCompression]. If null, [compressionLevel] is
+  /// used.
+  final int bottommostCompressionLevel;
+
+  /// How table files are compacted.
+  final RocksCompactionStyle compactionStyle;
+
+  /// If true, the database collects the statistics returned by
+  /// [RocksDB.stats]. This costs a few percent of throughput. Only the options
+  /// given to [RocksDB.open] for the whole database can enable statistics.
+  final bool statistics;
+
+  /// The merge operator that combines the operands of [RocksDB.merge], which
+  /// may only be used if this is set. The operator must not change once
+  /// merges have been written.
+  final RocksMergeOperator mergeOperator;
+
+  /// The delimiter placed between values by [RocksMergeOperator.append],
+  /// encoded as UTF-8.
+  final String mergeDelimiter;
+
+  /// The number of seconds that the write ahead log files are kept for after
+  /// their writes have been flushed, so that [RocksDB.changesSince] can still
+  /// read them. If 0, they are deleted as soon as they are no longer needed.
+  /// Only the options given to [RocksDB.open] for the whole database are
+  /// used.
+  final int walTtlSeconds;
+
+  /// If true, writes skip the write ahead log. They are faster but only
+  /// durable once their memtable is flushed, so the writes since the last
+  /// flush are lost if the process crashes, and a `sync` write is not synced.
+  /// Suited to data that can be rebuilt. Only the options given to
+  /// [RocksDB.open] for the whole database are used.
+  final bool disableWal;
+
+  /// How long, in microseconds, the durable writes of [RocksDB.putAsync] and
+  /// [RocksDB.writeAsync] wait for others to join them, so that a group of
+  /// writes from every isolate sharing the database is committed with a
+  /// single sync of the write ahead log. Even with no delay, the writes that
+  /// arrive while a group is being synced are committed together. Only the
+  /// options given to [RocksDB.open] for the whole database are used.
+  final int groupCommitDelayMicros;
+
+  /// The size in bytes of the updates of a group of durable writes at which
+  /// the group stops waiting for more, see [groupCommitDelayMicros]. Only the
+  /// options given to [RocksDB.open] for the whole database are used.
+  final int groupCommitBytes;
+
+  /// Default constructor
+  const RocksOptions(
+      {this.blockSize = 4096,
+      this.bitsPerKey = 10,
+      this.ribbonFilter = false,
+      this.blockCacheSize = 8 * 1024 * 1024,
+      this.sharedBlockCache = true,
+      this.cacheIndexAndFilterBlocks = false,
+      this.partitionFilters = false,
+      this.prefixLength = 0,
+      this.prefixDelimiter,
+      this.prefixDelimiterCount = 1,
+      this.memtablePrefixBloomRatio = 0.1,
+      this.compression,
+      this.compressionPerLevel,
+      this.compressionLevel,
+      this.compressionDictBytes = 0,
+      this.compressionTrainBytes = 0,
+      this.bottommostCompression,
+      this.bottommostCompressionLevel,
+      this.compactionStyle = RocksCompactionStyle.level,
+      this.statistics = false,
+      this.mergeOperator,
+      this.mergeDelimiter = ',',
+      this.walTtlSeconds = 0,
+      this.disableWal = false,
+      this.groupCommitDelayMicros = 0,
+      this.groupCommitBytes = 4 * 1024 * 1024})
+      : assert(prefixDelimiter == null ||
+            (prefixDelimiter.length == 1 &&
+                prefixDelimiter.codeUnitAt(0) < 128)),
+        assert(prefixDelimiterCount > 0),
+        assert(compressionDictBytes >= 0),
+        assert(compressionTrainBytes >= 0),
+        assert(compactionStyle != null),
+        assert(mergeDelimiter != null),
+        assert(walTtlSeconds >= 0),
+        assert(groupCommitDelayMicros >= 0),
+        assert(groupCommitBytes > 0);
+}
+
+/// The name and options of a column family to open with [RocksDB.open].
+class RocksColumnFamilyDescriptor {
+  /// The name of the column family.
+  final String name;
+
+  /// The options of the column family.
+  final RocksOptions options;
+
+  /// Default constructor
+  const RocksColumnFamilyDescriptor(this.name,
+      {this.options = const RocksOptions()})
+      : assert(name != 'default');
+}
+
+/// A column family of a [RocksDB], returned by [RocksDB.columnFamily].
+///
+/// Column families are separate key spaces, each with its own options, that
+/// share the write ahead log of the database. Writes to several column
+/// families in one [RocksWriteBatch] are atomic.
+class RocksColumnFamily {
+  final RocksDB<dynamic, dynamic> _db;
+  final int _index;
+
+  /// The name of the column family.
+  final String name;
+
+  RocksColumnFamily._internal(this._db, this._index, this.name);
+}
+
 /// A key-value database created through one of the static open functions.
 class RocksDB<K, V> extends NativeFieldWrapperClass2 {
   final convert.Codec<K, Uint8List> _keyEncoding;
   final convert.Codec<V, Uint8List> _valueEncoding;
+  bool _isClosed = false;
+
+  // The native database, passed to the functions of the C ABI.
+  ffi.Pointer<ffi.Void> _handle;
+
+  // The native memory that keys and values are copied through to call the
+  // C ABI, allocated on first use.
+  ffi.Pointer<ffi.Uint8> _buffer;
+  Uint8List _bufferView;
 
   RocksDB._internal(this._keyEncoding, this._valueEncoding);
 
-  void _open(bool shared, SendPort port, String path, int blockSize,
-      bool createIfMissing, bool errorIfExists) native 'DB_Open';
+  int _open(
+      bool shared,
+      SendPort port,
+      String path,
+      RocksOptions options,
+      bool createIfMissing,
+      bool errorIfExists,
+      List<String> columnFamilyNames,
+      List<RocksOptions> columnFamilyOptions,
+      int transactionMode,
+      int openMode,
+      String secondaryPath,
+      int catchUpMillis) native 'DB_Open';
+  int _columnFamilyIndex(String name) native 'DB_ColumnFamilyIndex';
+  int _ffiBuffer(int capacity) native 'DB_FfiBuffer';
+  static List<dynamic> _ffiFunctions() native 'Ffi_Functions';
+  static Uint8List _ffiPinnedValue(int address) native 'Ffi_PinnedValue';
+  List<dynamic> _statistics(bool reset) native 'DB_Statistics';
+  dynamic _property(String name, int columnFamily, bool isInt)
+      native 'DB_Property';
+  int _count(int limit, bool fillCache, Uint8List gt, bool isGtClosed,
+      Uint8List lt, bool isLtClosed, Uint8List prefix, bool reverse,
+      RocksSnapshot snapshot, int columnFamily) native 'DB_Count';
+  int _approximateSize(Uint8List start, Uint8List end, int columnFamily)
+      native 'DB_ApproximateSize';
+  int _latestSequenceNumber() native 'DB_LatestSequenceNumber';
 
-  Uint8List _syncGet(Uint8List key) native 'SyncGet';
-  void _syncPut(Uint8List key, Uint8List value, bool sync) native 'SyncPut';
-  void _syncDelete(Uint8List key) native 'SyncDelete';
+  Uint8List _syncGet(Uint8List key, RocksSnapshot snapshot, int columnFamily,
+      Int64List perfCounters) native 'SyncGet';
+  Uint8List _syncGetMany(Uint8List keys, int length, int count,
+      RocksSnapshot snapshot, int columnFamily, Int64List perfCounters)
+      native 'SyncGetMany';
+  void _syncPut(Uint8List key, Uint8List value, bool sync, int columnFamily)
+      native 'SyncPut';
+  void _syncMerge(Uint8List key, Uint8List operand, bool sync,
+      int columnFamily) native 'SyncMerge';
+  void _syncDelete(Uint8List key, int columnFamily) native 'SyncDelete';
+  void _syncDeleteRange(Uint8List start, Uint8List end, int columnFamily)
+      native 'SyncDeleteRange';
+  void _syncWrite(Uint8List ops, int length, bool sync) native 'SyncWrite';
   void _syncClose() native 'SyncClose';
+  void _closeAsync(SendPort port) native 'DB_CloseAsync';
+
+  void _asyncGet(SendPort port, int id, Uint8List key, int columnFamily)
+      native 'AsyncGet';
+  void _asyncPut(SendPort port, int id, Uint8List key, Uint8List value,
+      bool sync, int columnFamily) native 'AsyncPut';
+  void _asyncWrite(SendPort port, int id, Uint8List ops, int length, bool sync)
+      native 'AsyncWrite';
+  void _asyncScan(SendPort port, int id, int limit, bool fillCache,
+      Uint8List gt, bool isGtClosed, Uint8List lt, bool isLtClosed,
+      Uint8List prefix, bool reverse, int columnFamily) native 'AsyncScan';
+  void _asyncCompactRange(SendPort port, int id, Uint8List start,
+      Uint8List end, bool bottommostForce, int columnFamily)
+      native 'AsyncCompactRange';
+  void _asyncIngest(SendPort port, int id, List<String> files, bool move,
+      int columnFamily) native 'AsyncIngest';
+  void _asyncCatchUp(SendPort port, int id) native 'AsyncCatchUp';
+  void _asyncCheckpoint(SendPort port, int id, String dir)
+      native 'AsyncCheckpoint';
+  void _asyncBackup(SendPort port, int id, String backupDir, int keepLatest)
+      native 'AsyncBackup';
+  static void _asyncRestore(SendPort port, int id, String backupDir,
+      String path) native 'AsyncRestore';
 
   static RocksError _getError(dynamic reply) {
     if (reply == -1) {
@@ -125,6 +518,50 @@ class RocksDB<K, V> extends NativeFieldWrapperClass2 {
     return false;
   }
 
+  // Returns a view of the native buffer of the C ABI, checking first that the
+  // database is still open since the C ABI does not.
+  Uint8List _ffiBufferView() {
+    if (_isClosed) {
+      throw const RocksClosedError._internal();
+    }
+    if (_buffer == null) {
+      _buffer =
+          ffi.Pointer<ffi.Uint8>.fromAddress(_ffiBuffer(_ffiBufferSize));
+      _bufferView = _buffer.asTypedList(_ffiBufferSize);
+    }
+    return _bufferView;
+  }
+
+  static void _checkFfiResult(int result) {
+    var e = _getError(result);
+    if (e != null) {
+      throw e;
+    }
+  }
+
+  // Look up a key through the C ABI, which copies small values into the
+  // native buffer after the key. Large values stay pinned, and the buffer
+  // holds the address of the pinned value instead, which is wrapped without
+  // copying it. The buffer after the key must hold [_pinnedValueThreshold]
+  // bytes.
+  Uint8List _ffiGet(Uint8List key, int columnFamily) {
+    var buffer = _ffiBufferView();
+    buffer.setRange(0, key.length, key);
+    var capacity = _ffiBufferSize - key.length;
+    var length = _Ffi.instance.get(_handle, columnFamily, _buffer, key.length,
+        _buffer.elementAt(key.length), capacity);
+    if (length == _notFoundError) {
+      return null;
+    }
+    _checkFfiResult(length);
+    if (length >= _pinnedValueThreshold) {
+      return _ffiPinnedValue(
+          ByteData.view(buffer.buffer, buffer.offsetInBytes + key.length, 8)
+              .getInt64(0, Endian.host));
+    }
+    return buffer.sublist(key.length, key.length + length);
+  }
+
   /// Default encoding. Expects to be passed a String and will encode/decode to
   /// UTF-8 in the database.
   static convert.Codec<String, Uint8List> get utf8 =>
@@ -142,6 +579,22 @@ class RocksDB<K, V> extends NativeFieldWrapperClass2 {
   static convert.Codec<Uint8List, Uint8List> get identity =>
       const _IdentityCodec();
 
+  /// Encodes integers as 8 byte little-endian values, as used by the `uint64`
+  /// merge operators. Integers of 2^63 or more read back as negative.
+  static convert.Codec<int, Uint8List> get uint64 => const _Uint64Codec();
+
+  /// Restore the latest backup in [backupDir], made by [backup], to a
+  /// database at [path], replacing the database there.
+  ///
+  /// The database at [path] must not be open. The restore fails with a
+  /// [RocksIOError] if it is, and the database cannot be opened in this
+  /// process until the future completes. Other processes are not kept from
+  /// opening it meanwhile.
+  static Future<void> restoreBackup(String backupDir, String path) {
+    return _AsyncReplies.start((SendPort port, int id) =>
+        _asyncRestore(port, id, backupDir, path));
+  }
+
   /// Open a database at [path] using [String] keys and values which will be
   /// encoded to utf8 in the database.
   ///
@@ -150,13 +603,25 @@ class RocksDB<K, V> extends NativeFieldWrapperClass2 {
           {bool shared = false,
           int blockSize = 4096,
           bool createIfMissing = true,
-          bool errorIfExists = false}) =>
+          bool errorIfExists = false,
+          RocksOptions options,
+          List<RocksColumnFamilyDescriptor> columnFamilies = const [],
+          RocksTransactionMode transactionMode = RocksTransactionMode.none,
+          RocksOpenMode openMode = RocksOpenMode.readWrite,
+          String secondaryPath,
+          Duration catchUpInterval}) =>
       open<String, String>(
         path,
         shared: shared,
         blockSize: blockSize,
         createIfMissing: createIfMissing,
         errorIfExists: errorIfExists,
+        options: options,
+        columnFamilies: columnFamilies,
+        transactionMode: transactionMode,
+        openMode: openMode,
+        secondaryPath: secondaryPath,
+        catchUpInterval: catchUpInterval,
         keyEncoding: utf8,
         valueEncoding: utf8,
       );
@@ -168,14 +633,26 @@ class RocksDB<K, V> extends NativeFieldWrapperClass2 {
           {bool shared = false,
           int blockSize = 4096,
           bool createIfMissing = true,
-          bool errorIfExists = false}) =>
+          bool errorIfExists = false,
+          RocksOptions options,
+          List<RocksColumnFamilyDescriptor> columnFamilies = const [],
+          RocksTransactionMode transactionMode = RocksTransactionMode.none,
+          RocksOpenMode openMode = RocksOpenMode.readWrite,
+          String secondaryPath,
+          Duration catchUpInterval}) =>
       open<Uint8List, Uint8List>(path,
           keyEncoding: identity,
           valueEncoding: identity,
           shared: shared,
           blockSize: blockSize,
           createIfMissing: createIfMissing,
-          errorIfExists: errorIfExists);
+          errorIfExists: errorIfExists,
+          options: options,
+          columnFamilies: columnFamilies,
+          transactionMode: transactionMode,
+          openMode: openMode,
+          secondaryPath: secondaryPath,
+          catchUpInterval: catchUpInterval);
 
   /// Open a database at [path]
   ///
@@ -187,15 +664,51 @@ class RocksDB<K, V> extends NativeFieldWrapperClass2 {
   /// [keyEncoding] or [valueEncoding] must be specified. The given encoding
   /// will be used to encoding and decode keys or values respectively. The
   /// encodings must match the generic type of the database.
+  ///
+  /// The database is tuned with [options], which default to a
+  /// [RocksOptions] with the given [blockSize]. When the database is shared
+  /// and already open, the options of the first caller apply.
+  ///
+  /// Besides the default column family, which uses [options], the database
+  /// has the [columnFamilies] listed, which must include every column family
+  /// that already exists in the database. Missing column families are created
+  /// if [createIfMissing] is true. Use [columnFamily] to get the column family
+  /// to read and write. When the database is shared and already open, the
+  /// column families of the first caller apply.
+  ///
+  /// Use [transaction] to begin transactions on a database opened with a
+  /// [transactionMode] other than [RocksTransactionMode.none]. As with the
+  /// options, the mode of the first caller applies to a shared database.
+  ///
+  /// Other processes, which cannot share the database, may still read it when
+  /// they open it with an [openMode] of [RocksOpenMode.readOnly] or
+  /// [RocksOpenMode.secondary]. A secondary instance keeps its info log in
+  /// [secondaryPath], which must differ from [path] and from the
+  /// [secondaryPath] of other instances. If [catchUpInterval] is given, a
+  /// native thread catches the secondary instance up with its primary that
+  /// often until it is closed. Neither mode supports writes or transactions,
+  /// and as with the options the mode of the first caller applies to a
+  /// shared database.
   static Future<RocksDB<K, V>> open<K, V>(String path,
       {bool shared = false,
       int blockSize = 4096,
       bool createIfMissing = true,
       bool errorIfExists = false,
+      RocksOptions options,
+      List<RocksColumnFamilyDescriptor> columnFamilies = const [],
+      RocksTransactionMode transactionMode = RocksTransactionMode.none,
+      RocksOpenMode openMode = RocksOpenMode.readWrite,
+      String secondaryPath,
+      Duration catchUpInterval,
       @required convert.Codec<K, Uint8List> keyEncoding,
       @required convert.Codec<V, Uint8List> valueEncoding}) {
     assert(keyEncoding != null);
     assert(valueEncoding != null);
+    assert((openMode == RocksOpenMode.secondary) == (secondaryPath != null));
+    assert(openMode == RocksOpenMode.readWrite ||
+        transactionMode == RocksTransactionMode.none);
+    assert(catchUpInterval == null || catchUpInterval > Duration.zero);
+    options ??= RocksOptions(blockSize: blockSize);
     var completer = Completer<RocksDB<K, V>>();
     var replyPort = RawReceivePort();
     var db = RocksDB<K, V>._internal(keyEncoding, valueEncoding);
@@ -206,40 +719,578 @@ class RocksDB<K, V> extends NativeFieldWrapperClass2 {
       }
       completer.complete(db);
     };
-    db._open(shared, replyPort.sendPort, path, blockSize, createIfMissing,
-        errorIfExists);
+    // Options that the native code rejects fail the future like any other
+    // open error, and the port is closed since no reply will come.
+    int handle;
+    try {
+      handle = db._open(
+          shared,
+          replyPort.sendPort,
+          path,
+          options,
+          createIfMissing,
+          errorIfExists,
+          columnFamilies.map((cf) => cf.name).toList(),
+          columnFamilies.map((cf) => cf.options).toList(),
+          transactionMode.index,
+          openMode.index,
+          secondaryPath,
+          catchUpInterval?.inMilliseconds ?? 0);
+    } catch (e) {
+      replyPort.close();
+      completer.completeError(e);
+      return completer.future;
+    }
+    db._handle = ffi.Pointer<ffi.Void>.fromAddress(handle);
     return completer.future;
   }
 
+  /// Returns the column family called [name], or null if the database does not
+  /// have it. The default column family is called `default`, and is used by
+  /// the operations that are not given a column family.
+  RocksColumnFamily columnFamily(String name) {
+    var index = _columnFamilyIndex(name);
+    return index < 0 ? null : RocksColumnFamily._internal(this, index, name);
+  }
+
+  /// Returns the statistics collected since the database was opened, or since
+  /// the last call with [reset] set to true, which starts collecting afresh.
+  /// Returns null unless [RocksOptions.statistics] was set when the database
+  /// was opened.
+  ///
+  /// Statistics are shared by every [RocksDB] that shares the database.
+  RocksStatistics stats({bool reset = false}) {
+    var result = _statistics(reset);
+    if (result == null) {
+      return null;
+    }
+    var tickerList = result[0] as List<dynamic>;
+    var tickers = <String, int>{};
+    for (var i = 0; i < tickerList.length; i += 2) {
+      tickers[tickerList[i] as String] = tickerList[i + 1] as int;
+    }
+    var histogramList = result[1] as List<dynamic>;
+    var histograms = <String, RocksHistogram>{};
+    for (var i = 0; i < histogramList.length; i += 8) {
+      histograms[histogramList[i] as String] = RocksHistogram._internal(
+          histogramList[i + 1] as double,
+          histogramList[i + 2] as double,
+          histogramList[i + 3] as double,
+          histogramList[i + 4] as double,
+          histogramList[i + 5] as double,
+          histogramList[i + 6] as int,
+          histogramList[i + 7] as int);
+    }
+    return RocksStatistics._internal(tickers, histograms);
+  }
+
+  /// Returns the value of the RocksDB property called [name], or null if there
+  /// is no such property. Properties that are specific to a column family are
+  /// read from [columnFamily] if one is given.
+  ///
+  /// For example `rocksdb.stats` describes the compactions and stalls of the
+  /// database, and `rocksdb.levelstats` the number and size of the files in
+  /// each level.
+  String property(String name, {RocksColumnFamily columnFamily}) =>
+      _property(name, _columnFamilyIndexOf(columnFamily), false) as String;
+
+  /// Returns the value of the numeric RocksDB property called [name], or null
+  /// if there is no such property. Properties that are specific to a column
+  /// family are read from [columnFamily] if one is given.
+  ///
+  /// For example `rocksdb.estimate-num-keys` is the estimated number of keys,
+  /// `rocksdb.cur-size-all-mem-tables` the size of the memtables and
+  /// `rocksdb.block-cache-usage` the memory used by the block cache.
+  int intProperty(String name, {RocksColumnFamily columnFamily}) =>
+      _property(name, _columnFamilyIndexOf(columnFamily), true) as int;
+
+  // Returns the index of a column family of this database, where null is the
+  // default column family.
+  int _columnFamilyIndexOf(RocksColumnFamily columnFamily) {
+    if (columnFamily == null) {
+      return 0;
+    }
+    if (!identical(columnFamily._db, this)) {
+      throw ArgumentError.value(columnFamily.name, 'columnFamily',
+          'Column family of another database');
+    }
+    return columnFamily._index;
+  }
+
   /// Close this database.
   ///
-  /// Any pending iteration will throw after this call.
+  /// Any pending iteration will throw after this call. If this is the last
+  /// reference to the database, in any isolate, the call waits for the
+  /// database to be closed, which involves flushing the memtables and can take
+  /// some time. Use [closeAsync] to close without blocking the isolate.
   void close() {
     _syncClose();
+    _isClosed = true;
+  }
+
+  /// Close this database without blocking the isolate.
+  ///
+  /// The database is closed on a native thread, and the future completes once
+  /// it is closed, or right away if another isolate or a pending asynchronous
+  /// operation still uses it. Opening the same path meanwhile waits for the
+  /// close to finish.
+  Future<void> closeAsync() {
+    var completer = Completer<void>();
+    var replyPort = RawReceivePort();
+    replyPort.handler = (dynamic _) {
+      replyPort.close();
+      completer.complete();
+    };
+    try {
+      _closeAsync(replyPort.sendPort);
+    } catch (_) {
+      replyPort.close();
+      rethrow;
+    }
+    _isClosed = true;
+    return completer.future;
   }
 
   /// Get a key in the database. Returns null if the key is not found.
-  V get(K key) {
+  ///
+  /// If a [snapshot] is given, the value is read as of the time the snapshot
+  /// was taken. The key is read from [columnFamily] if one is given. The work
+  /// done by the lookup is added to [perf] if one is given.
+  ///
+  /// Large values are not copied out of the database. Instead the bytes given
+  /// to the value decoder refer directly to the value held in the block cache,
+  /// which remains pinned until the bytes are garbage collected. These bytes
+  /// are read-only.
+  V get(K key,
+      {RocksSnapshot snapshot,
+      RocksColumnFamily columnFamily,
+      RocksPerfContext perf}) {
+    snapshot?._checkNotReleased();
     var keyEnc = _keyEncoding.encode(key);
-    var value = _syncGet(keyEnc);
+    var index = _columnFamilyIndexOf(columnFamily);
+    Uint8List value;
+    if (snapshot == null &&
+        perf == null &&
+        keyEnc.length + _pinnedValueThreshold <= _ffiBufferSize) {
+      value = _ffiGet(keyEnc, index);
+    } else {
+      value = _syncGet(keyEnc, snapshot, index, perf?._counters);
+    }
     V ret;
     if (value != null) {
+      if (value.length >= _pinnedValueThreshold) {
+        value = UnmodifiableUint8ListView(value);
+      }
       ret = _valueEncoding.decode(value);
     }
     return ret;
   }
 
-  /// Set a key to a value.
-  void put(K key, V value, {bool sync = false}) {
+  /// Get the values of many keys at once. The returned list has the value of
+  /// each key in [keys], in the same order, with null for any key that is not
+  /// found.
+  ///
+  /// All of the keys are looked up in a single call into the database, which
+  /// can combine the reads for keys that are stored near each other.
+  ///
+  /// If a [snapshot] is given, the values are read as of the time the snapshot
+  /// was taken. The keys are read from [columnFamily] if one is given. The
+  /// work done by the lookups is added to [perf] if one is given.
+  List<V> getMany(List<K> keys,
+      {RocksSnapshot snapshot,
+      RocksColumnFamily columnFamily,
+      RocksPerfContext perf}) {
+    snapshot?._checkNotReleased();
+    var packed = _PackedBuilder();
+    for (var key in keys) {
+      var keyEnc = _keyEncoding.encode(key);
+      packed.addUint32(keyEnc.length);
+      packed.addPadded(keyEnc);
+    }
+    var values = _syncGetMany(packed._buffer, packed.length, keys.length,
+        snapshot, _columnFamilyIndexOf(columnFamily), perf?._counters);
+    var view =
+        ByteData.view(values.buffer, values.offsetInBytes, values.length);
+    var result = List<V>(keys.length);
+    var offset = 0;
+    for (var i = 0; i < keys.length; i++) {
+      var length = view.getUint32(offset, Endian.little);
+      offset += 4;
+      if (length != _missingValueLength) {
+        result[i] = _valueEncoding.decode(
+            Uint8List.view(values.buffer, values.offsetInBytes + offset, length));
+        offset += _align4(length);
+      }
+    }
+    return result;
+  }
+
+  /// Set a key to a value, in [columnFamily] if one is given.
+  void put(K key, V value,
+      {bool sync = false, RocksColumnFamily columnFamily}) {
     var keyEnc = _keyEncoding.encode(key);
     var valueEnc = _valueEncoding.encode(value);
-    _syncPut(keyEnc, valueEnc, sync);
+    var index = _columnFamilyIndexOf(columnFamily);
+    var length = keyEnc.length + valueEnc.length;
+    if (length > _ffiBufferSize) {
+      _syncPut(keyEnc, valueEnc, sync, index);
+      return;
+    }
+    var buffer = _ffiBufferView();
+    buffer.setRange(0, keyEnc.length, keyEnc);
+    buffer.setRange(keyEnc.length, length, valueEnc);
+    _checkFfiResult(_Ffi.instance.put(_handle, index, _buffer, keyEnc.length,
+        _buffer.elementAt(keyEnc.length), valueEnc.length, sync ? 1 : 0));
+  }
+
+  /// Merge [operand] into the value of a key, in [columnFamily] if one is
+  /// given, using the [RocksOptions.mergeOperator] of the column family.
+  ///
+  /// The merge is a write without a read: the operands are combined with the
+  /// value when the key is read or compacted. Merges from several isolates
+  /// sharing the database never lose each other's updates. Throws
+  /// [RocksInvalidArgumentError] if there is no merge operator.
+  void merge(K key, V operand,
+      {bool sync = false, RocksColumnFamily columnFamily}) {
+    var keyEnc = _keyEncoding.encode(key);
+    var operandEnc = _valueEncoding.encode(operand);
+    _syncMerge(keyEnc, operandEnc, sync, _columnFamilyIndexOf(columnFamily));
+  }
+
+  /// Remove a key from the database, or from [columnFamily] if one is given.
+  void delete(K key, {RocksColumnFamily columnFamily}) {
+    var keyEnc = _keyEncoding.encode(key);
+    var index = _columnFamilyIndexOf(columnFamily);
+    if (keyEnc.length > _ffiBufferSize) {
+      _syncDelete(keyEnc, index);
+      return;
+    }
+    _ffiBufferView().setRange(0, keyEnc.length, keyEnc);
+    _checkFfiResult(
+        _Ffi.instance.delete(_handle, index, _buffer, keyEnc.length));
+  }
+
+  /// Remove all keys in the range from [start] (inclusive) to [end]
+  /// (exclusive), from [columnFamily] if one is given.
+  ///
+  /// The range is removed by writing a single range tombstone, however many
+  /// keys it holds. Scans over the range skip the removed keys until they are
+  /// dropped by compaction, see [compactRange].
+  void deleteRange(K start, K end, {RocksColumnFamily columnFamily}) {
+    var startEnc = _keyEncoding.encode(start);
+    var endEnc = _keyEncoding.encode(end);
+    _syncDeleteRange(startEnc, endEnc, _columnFamilyIndexOf(columnFamily));
+  }
+
+  /// Compact the keys from [start] (inclusive) to [end] (inclusive) of
+  /// [columnFamily], or of the default column family, without blocking the
+  /// isolate. A null [start] or [end] leaves that end of the range open.
+  ///
+  /// Compaction drops deleted and overwritten entries, reclaiming their space
+  /// and restoring the speed of scans, for example after a [deleteRange].
+  /// Files in the last level are only rewritten if there is something else
+  /// to compact them with, unless [bottommostForce] is true.
+  ///
+  /// The compaction runs on a thread of its own, and other reads and writes
+  /// carry on meanwhile. The database is kept open until the future
+  /// completes, even if it is closed.
+  Future<void> compactRange(K start, K end,
+      {bool bottommostForce = false, RocksColumnFamily columnFamily}) {
+    var startEnc = start == null ? null : _keyEncoding.encode(start);
+    var endEnc = end == null ? null : _keyEncoding.encode(end);
+    var index = _columnFamilyIndexOf(columnFamily);
+    return _AsyncReplies.start((SendPort port, int id) => _asyncCompactRange(
+        port, id, startEnc, endEnc, bottommostForce, index));
+  }
+
+  /// Create a [RocksSstWriter] that builds a table file at [path], in the
+  /// format of [columnFamily] or of the default column family, to be added to
+  /// the database with [ingest].
+  RocksSstWriter<K, V> sstWriter(String path,
+      {RocksColumnFamily columnFamily}) {
+    var writer = RocksSstWriter<K, V>._internal(
+        _keyEncoding, _valueEncoding, path);
+    writer._open(this, path, _columnFamilyIndexOf(columnFamily));
+    return writer;
+  }
+
+  /// Add the table [files] built by [RocksSstWriter] to [columnFamily], or to
+  /// the default column family, without blocking the isolate.
+  ///
+  /// The files are added as they are, without going through the write ahead
+  /// log, the memtable or compaction, and their entries replace any existing
+  /// entries with the same keys. If [move] is true the files are moved into
+  /// the database rather than copied.
+  Future<void> ingest(List<String> files,
+      {bool move = false, RocksColumnFamily columnFamily}) {
+    var index = _columnFamilyIndexOf(columnFamily);
+    return _AsyncReplies.start((SendPort port, int id) =>
+        _asyncIngest(port, id, List<String>.from(files), move, index));
+  }
+
+  /// Catch a database opened with [RocksOpenMode.secondary] up with the
+  /// writes of its primary, without blocking the isolate. The future fails
+  /// with a [RocksInvalidArgumentError] for any other database.
+  Future<void> tryCatchUpWithPrimary() {
+    return _AsyncReplies.start(
+        (SendPort port, int id) => _asyncCatchUp(port, id));
+  }
+
+  /// Create a checkpoint of the database in [dir], which must not exist,
+  /// without blocking the isolate.
+  ///
+  /// The checkpoint is a consistent copy of the database that can be opened
+  /// like any other. Table files are hard linked rather than copied when [dir]
+  /// is on the same file system, which makes the checkpoint nearly instant.
+  Future<void> checkpoint(String dir) {
+    return _AsyncReplies.start(
+        (SendPort port, int id) => _asyncCheckpoint(port, id, dir));
+  }
+
+  /// Make a new backup of the database in [backupDir] without blocking the
+  /// isolate. If [keepLatest] is greater than 0, only that many of the latest
+  /// backups are kept.
+  ///
+  /// Backups are incremental: only the table files that are not in an earlier
+  /// backup are copied. Restore the latest backup with [restoreBackup].
+  ///
+  /// Reads and writes carry on during the backup, which keeps the database
+  /// open until the future completes, even if it is closed.
+  Future<void> backup(String backupDir, {int keepLatest = 0}) {
+    return _AsyncReplies.start((SendPort port, int id) =>
+        _asyncBackup(port, id, backupDir, keepLatest));
+  }
+
+  /// Get a key in the database without blocking the isolate. The future
+  /// completes with null if the key is not found.
+  ///
+  /// This and the other asynchronous operations run on a pool of native
+  /// threads shared by all databases in the process, so the isolate can keep
+  /// handling events while the database waits for the disk.
+  Future<V> getAsync(K key, {RocksColumnFamily columnFamily}) async {
+    var keyEnc = _keyEncoding.encode(key);
+    var index = _columnFamilyIndexOf(columnFamily);
+    var value = await _AsyncReplies.start(
+        (SendPort port, int id) => _asyncGet(port, id, keyEnc, index));
+    // The value is never copied out of the database, see [get].
+    return value == null
+        ? null
+        : _valueEncoding.decode(UnmodifiableUint8ListView(value));
   }
 
-  /// Remove a key from the database.
-  void delete(K key) {
+  /// Set a key to a value without blocking the isolate.
+  ///
+  /// If [sync] is true, the write is committed together with the other
+  /// durable writes made meanwhile, from any isolate sharing the database, and
+  /// the future completes once the group has been synced to the write ahead
+  /// log. See [RocksOptions.groupCommitDelayMicros].
+  Future<void> putAsync(K key, V value,
+      {bool sync = false, RocksColumnFamily columnFamily}) async {
     var keyEnc = _keyEncoding.encode(key);
-    _syncDelete(keyEnc);
+    var valueEnc = _valueEncoding.encode(value);
+    var index = _columnFamilyIndexOf(columnFamily);
+    await _AsyncReplies.start((SendPort port, int id) =>
+        _asyncPut(port, id, keyEnc, valueEnc, sync, index));
+  }
+
+  /// Apply all of the updates in [batch] atomically without blocking the
+  /// isolate. The batch may be modified as soon as this method returns.
+  ///
+  /// A [sync] write is committed in a group as for [putAsync].
+  Future<void> writeAsync(RocksWriteBatch<K, V> batch, {bool sync = false}) {
+    return _AsyncReplies.start((SendPort port, int id) => _asyncWrite(
+        port, id, batch._ops._buffer, batch._ops.length, sync));
+  }
+
+  /// Read the entries in a range of keys without blocking the isolate. The
+  /// range is given the same way as for [getItems], or as a [prefix] as for
+  /// [getPrefix]. All of the entries are returned at once, so use [limit] to
+  /// bound the size of the result.
+  Future<List<RocksItem<K, V>>> scanAsync(
+      {K gt,
+      K gte,
+      K lt,
+      K lte,
+      K prefix,
+      int limit = -1,
+      bool reverse = false,
+      RocksColumnFamily columnFamily,
+      bool fillCache = true}) async {
+    var index = _columnFamilyIndexOf(columnFamily);
+    var start = gt ?? gte;
+    var end = lt ?? lte;
+    var startEnc = start == null ? null : _keyEncoding.encode(start);
+    var endEnc = end == null ? null : _keyEncoding.encode(end);
+    var prefixEnc = prefix == null ? null : _keyEncoding.encode(prefix);
+    var entries = await _AsyncReplies.start((SendPort port, int id) =>
+        _asyncScan(port, id, limit, fillCache, startEnc, gt == null, endEnc,
+            lt == null, prefixEnc, reverse, index));
+    var items = <RocksItem<K, V>>[];
+    var reader = _EntryReader(entries);
+    while (reader.moveNext()) {
+      items.add(RocksItem<K, V>._internal(_keyEncoding.decode(reader.key),
+          _valueEncoding.decode(reader.value)));
+    }
+    return items;
+  }
+
+  /// Stream the entries in a range of keys, read by a native thread so that
+  /// the isolate is not blocked however large the range is. The range is
+  /// given as for [scanAsync], and the other parameters are as for
+  /// [getItems].
+  ///
+  /// The thread reads the entries in batches of up to [batchSize] entries or
+  /// roughly [batchBytes] bytes, and stays at most [prefetch] batches ahead of
+  /// the listener. It stops reading while the subscription is paused, so a
+  /// slow consumer, such as a socket, holds back the reads rather than have
+  /// the entries pile up in memory. The table files are read [readaheadSize]
+  /// bytes ahead of the iteration, asynchronously with RocksDB 7 or later.
+  ///
+  /// Cancelling the subscription stops the thread. Closing the database stops
+  /// it too, and the stream then ends with a [RocksClosedError].
+  Stream<RocksItem<K, V>> stream(
+      {K gt,
+      K gte,
+      K lt,
+      K lte,
+      K prefix,
+      int limit = -1,
+      bool reverse = false,
+      RocksSnapshot snapshot,
+      RocksColumnFamily columnFamily,
+      bool fillCache = true,
+      int batchSize = 1024,
+      int batchBytes = 1024 * 1024,
+      int prefetch = 2,
+      int readaheadSize = 2 * 1024 * 1024}) {
+    assert(batchSize > 0);
+    assert(prefetch > 0);
+    snapshot?._checkNotReleased();
+    var index = _columnFamilyIndexOf(columnFamily);
+    var start = gt ?? gte;
+    var end = lt ?? lte;
+    var startEnc = start == null ? null : _keyEncoding.encode(start);
+    var endEnc = end == null ? null : _keyEncoding.encode(end);
+    var prefixEnc = prefix == null ? null : _keyEncoding.encode(prefix);
+    return _RocksStream<RocksItem<K, V>>(
+        _decodeItems,
+        (_RocksStream<RocksItem<K, V>> stream, SendPort port) => stream._start(
+            this,
+            port,
+            limit,
+            fillCache,
+            startEnc,
+            gt == null,
+            endEnc,
+            lt == null,
+            prefixEnc,
+            reverse,
+            snapshot,
+            index,
+            batchSize,
+            batchBytes,
+            readaheadSize,
+            prefetch)).stream;
+  }
+
+  Iterable<RocksItem<K, V>> _decodeItems(Uint8List entries) sync* {
+    var reader = _EntryReader(entries);
+    while (reader.moveNext()) {
+      yield RocksItem<K, V>._internal(_keyEncoding.decode(reader.key),
+          _valueEncoding.decode(reader.value));
+    }
+  }
+
+  /// The sequence number of the latest write to the database. Each update
+  /// that is written takes the next sequence number, so the updates of a
+  /// [RocksWriteBatch] have consecutive numbers.
+  int get latestSequenceNumber => _latestSequenceNumber();
+
+  /// Stream the updates made to the database from the one with the sequence
+  /// number [sequence] on, in the order they were written. They are read from
+  /// the write ahead log by a native thread. To see only the updates made from
+  /// now on, start from [latestSequenceNumber] + 1, and to resume a stream
+  /// start from the [RocksChange.sequence] of its last change + 1.
+  ///
+  /// Only the updates to [columnFamily], or to the default column family if
+  /// it is null, are included. Writes made without the write ahead log and
+  /// ingested table files are not seen.
+  ///
+  /// If [tail] is true the stream waits for more updates once it has every
+  /// update, until the subscription is cancelled or the database is closed,
+  /// and otherwise it ends. The batches and [prefetch] are as for [stream].
+  ///
+  /// The log files are deleted once their updates are flushed, unless
+  /// [RocksOptions.walTtlSeconds] keeps them, and the stream ends with a
+  /// [RocksInvalidArgumentError] if the updates from [sequence] are no longer
+  /// in the log.
+  Stream<RocksChange<K, V>> changesSince(int sequence,
+      {RocksColumnFamily columnFamily,
+      bool tail = true,
+      int batchSize = 1024,
+      int batchBytes = 1024 * 1024,
+      int prefetch = 2}) {
+    assert(sequence >= 0);
+    assert(batchSize > 0);
+    assert(prefetch > 0);
+    var index = _columnFamilyIndexOf(columnFamily);
+    return _RocksStream<RocksChange<K, V>>(
+        _decodeChanges,
+        (_RocksStream<RocksChange<K, V>> stream, SendPort port) =>
+            stream._startChanges(this, port, sequence, index, tail, batchSize,
+                batchBytes, prefetch)).stream;
+  }
+
+  // Decode the changes packed by the native ChangePacker, each the 64-bit
+  // sequence number followed by an update packed as by RocksWriteBatch.
+  Iterable<RocksChange<K, V>> _decodeChanges(Uint8List changes) sync* {
+    var view =
+        ByteData.view(changes.buffer, changes.offsetInBytes, changes.length);
+    var offset = 0;
+    while (offset < changes.length) {
+      var sequence = view.getUint64(offset, Endian.little);
+      var op = view.getUint32(offset + 8, Endian.little) & 0xFF;
+      var keyLength = view.getUint32(offset + 12, Endian.little);
+      var valueLength = view.getUint32(offset + 16, Endian.little);
+      var keyOffset = offset + 20;
+      var valueOffset = keyOffset + _align4(keyLength);
+      offset = valueOffset + _align4(valueLength);
+      var key = _keyEncoding.decode(Uint8List.view(
+          changes.buffer, changes.offsetInBytes + keyOffset, keyLength));
+      var value = Uint8List.view(
+          changes.buffer, changes.offsetInBytes + valueOffset, valueLength);
+      // The op codes follow the order of RocksChangeType, from 1.
+      var type = RocksChangeType.values[op - 1];
+      yield RocksChange<K, V>._internal(
+          sequence,
+          type,
+          key,
+          type == RocksChangeType.put || type == RocksChangeType.merge
+              ? _valueEncoding.decode(value)
+              : null,
+          type == RocksChangeType.deleteRange
+              ? _keyEncoding.decode(value)
+              : null);
+    }
+  }
+
+  /// Create an empty [RocksWriteBatch] that uses the encodings of this
+  /// database. Apply it to the database with [write].
+  RocksWriteBatch<K, V> batch() =>
+      RocksWriteBatch<K, V>._internal(_keyEncoding, _valueEncoding);
+
+  /// Apply all of the updates in [batch] atomically, in a single write.
+  ///
+  /// The batch is left unchanged and may be reused or cleared afterwards.
+  void write(RocksWriteBatch<K, V> batch, {bool sync = false}) {
+    var length = batch._ops.length;
+    if (length > _ffiBufferSize) {
+      _syncWrite(batch._ops._buffer, length, sync);
+      return;
+    }
+    _ffiBufferView().setRange(0, length, batch._ops._buffer);
+    _checkFfiResult(
+        _Ffi.instance.write(_handle, _buffer, length, sync ? 1 : 0));
   }
 
   /// Return an [Iterable] which will iterate through the database in key
@@ -252,17 +1303,796 @@ class RocksDB<K, V> extends NativeFieldWrapperClass2 {
   ///
   /// The [limit] parameter limits the total number of items iterated.
   ///
+  /// If a [snapshot] is given, the iteration sees the database as it was when
+  /// the snapshot was taken, even if the snapshot is released before the
+  /// iteration ends. Otherwise it sees the database as it is when it starts.
+  ///
+  /// The keys of [columnFamily] are iterated if one is given. The work done
+  /// by the iteration is added to [perf] if one is given.
+  ///
+  /// If [reverse] is true the iteration starts at the last key in the range
+  /// and moves backwards, so with a [limit] of `n` it returns the last `n`
+  /// items of the range, starting with the greatest key.
+  ///
+  /// Entries are fetched from the database in batches of up to [batchSize]
+  /// entries or roughly [batchBytes] bytes, whichever is reached first, so that
+  /// each native call returns many entries. A [batchSize] of 1 fetches a single
+  /// entry at a time.
+  ///
   /// For example, say a database contains the keys `a`, `b`, `c` and `d`. To
   /// iterate over all items from key `b` and before `d` in the collation order
   /// you can write:
   ///
   ///     getItems(gte: 'b', lt: 'd')
   ///
+  /// and to get the last item before `d`:
+  ///
+  ///     getItems(lt: 'd', reverse: true, limit: 1)
+  ///
   RocksIterable<K, V> getItems(
-      {K gt, K gte, K lt, K lte, int limit = -1, bool fillCache = true}) {
+      {K gt,
+      K gte,
+      K lt,
+      K lte,
+      int limit = -1,
+      bool reverse = false,
+      RocksSnapshot snapshot,
+      RocksColumnFamily columnFamily,
+      RocksPerfContext perf,
+      bool fillCache = true,
+      int batchSize = 128,
+      int batchBytes = 65536}) {
+    assert(batchSize > 0);
     return RocksIterable<K, V>._internal(
-        this, limit, fillCache, gt ?? gte, gt == null, lt ?? lte, lt == null);
+        this,
+        limit,
+        fillCache,
+        gt ?? gte,
+        gt == null,
+        lt ?? lte,
+        lt == null,
+        null,
+        reverse,
+        snapshot,
+        _columnFamilyIndexOf(columnFamily),
+        perf,
+        batchSize,
+        batchBytes);
+  }
+
+  /// Return an [Iterable] over the entries whose keys start with [prefix], in
+  /// key byte-collated order. The other parameters are as for [getItems].
+  ///
+  /// The scan stops at the end of the prefix without reading any further. If
+  /// the database has a prefix extractor (see [RocksOptions.prefixLength] and
+  /// [RocksOptions.prefixDelimiter]) and [prefix] is at least as long as the
+  /// extracted prefix, the prefix filters are used to skip table files and
+  /// memtables that do not contain the prefix.
+  RocksIterable<K, V> getPrefix(K prefix,
+      {int limit = -1,
+      bool reverse = false,
+      RocksSnapshot snapshot,
+      RocksColumnFamily columnFamily,
+      RocksPerfContext perf,
+      bool fillCache = true,
+      int batchSize = 128,
+      int batchBytes = 65536}) {
+    assert(prefix != null);
+    assert(batchSize > 0);
+    return RocksIterable<K, V>._internal(
+        this,
+        limit,
+        fillCache,
+        null,
+        true,
+        null,
+        true,
+        prefix,
+        reverse,
+        snapshot,
+        _columnFamilyIndexOf(columnFamily),
+        perf,
+        batchSize,
+        batchBytes);
+  }
+
+  /// Count the keys in a range, given as for [getItems] or as a [prefix] as
+  /// for [getPrefix], counting at most [limit] keys if it is not negative.
+  ///
+  /// The keys are counted natively, without reading the values or copying
+  /// anything into Dart, but the count still takes time in proportion to the
+  /// number of keys. Use [approximateSize] for a quick estimate of the size
+  /// of a range.
+  int count(
+      {K gt,
+      K gte,
+      K lt,
+      K lte,
+      K prefix,
+      int limit = -1,
+      RocksSnapshot snapshot,
+      RocksColumnFamily columnFamily,
+      bool fillCache = true}) {
+    snapshot?._checkNotReleased();
+    var start = gt ?? gte;
+    var end = lt ?? lte;
+    return _count(
+        limit,
+        fillCache,
+        start == null ? null : _keyEncoding.encode(start),
+        gt == null,
+        end == null ? null : _keyEncoding.encode(end),
+        lt == null,
+        prefix == null ? null : _keyEncoding.encode(prefix),
+        false,
+        snapshot,
+        _columnFamilyIndexOf(columnFamily));
+  }
+
+  /// Returns the approximate number of bytes taken by the keys from [start]
+  /// (inclusive) to [end] (exclusive), in [columnFamily] if one is given.
+  ///
+  /// The size is estimated from the indexes of the table files and from a
+  /// sample of the memtables, without reading the range, so it is cheap
+  /// however large the range is. It reflects the size on disk, after
+  /// compression, and includes overwritten and deleted entries that have not
+  /// been compacted away yet.
+  int approximateSize(K start, K end, {RocksColumnFamily columnFamily}) {
+    return _approximateSize(_keyEncoding.encode(start),
+        _keyEncoding.encode(end), _columnFamilyIndexOf(columnFamily));
+  }
+
+  /// Take a snapshot of the current state of the database. Passing it to
+  /// [get], [getMany], [getItems] or [getPrefix] gives reads that are
+  /// consistent with each other while other writes carry on.
+  ///
+  /// A snapshot keeps overwritten and deleted entries from being removed, so
+  /// [RocksSnapshot.release] it as soon as it is no longer needed. Snapshots
+  /// that are not released are released when they are garbage collected or
+  /// when the database is closed.
+  RocksSnapshot snapshot() {
+    var snapshot = RocksSnapshot._internal();
+    snapshot._init(this);
+    return snapshot;
   }
+
+  /// Begin a [RocksTransaction], whose writes are applied atomically when it
+  /// commits, and only if no other writer has written the keys it wrote or
+  /// read for update in the meantime. Throws [RocksInvalidArgumentError] if
+  /// the database was opened without a [RocksTransactionMode].
+  ///
+  /// If [setSnapshot] is true the transaction reads the database as it is now,
+  /// and fails if any key it writes or reads for update is changed by someone
+  /// else after this call, rather than after the key is first touched.
+  ///
+  /// In a [RocksTransactionMode.pessimistic] database, a transaction waits at
+  /// most [lockTimeout] for a key locked by another transaction, and by
+  /// default fails straight away with [RocksBusyError].
+  RocksTransaction<K, V> transaction(
+      {bool sync = false,
+      bool setSnapshot = false,
+      Duration lockTimeout = Duration.zero}) {
+    var transaction = RocksTransaction<K, V>._internal(this);
+    transaction._begin(this, sync, setSnapshot, lockTimeout.inMilliseconds);
+    return transaction;
+  }
+}
+
+/// Statistics of a database, returned by [RocksDB.stats].
+class RocksStatistics {
+  /// The counters of the database by their RocksDB name. Among others these
+  /// include `rocksdb.block.cache.hit` and `rocksdb.block.cache.miss`,
+  /// `rocksdb.bloom.filter.useful` (lookups that a filter saved from reading a
+  /// file), `rocksdb.compact.read.bytes` and `rocksdb.compact.write.bytes`,
+  /// and `rocksdb.stall.micros` (time that writes were stalled).
+  final Map<String, int> tickers;
+
+  /// The histograms of the database by their RocksDB name. Among others these
+  /// include `rocksdb.db.get.micros` and `rocksdb.db.write.micros`, the
+  /// latencies of gets and writes.
+  final Map<String, RocksHistogram> histograms;
+
+  RocksStatistics._internal(this.tickers, this.histograms);
+}
+
+/// The distribution of a statistic, see [RocksStatistics.histograms].
+class RocksHistogram {
+  /// The median value.
+  final double median;
+
+  /// The 95th percentile.
+  final double p95;
+
+  /// The 99th percentile.
+  final double p99;
+
+  /// The mean value.
+  final double average;
+
+  /// The largest value.
+  final double max;
+
+  /// The number of values recorded.
+  final int count;
+
+  /// The sum of the values recorded.
+  final int sum;
+
+  RocksHistogram._internal(this.median, this.p95, this.p99, this.average,
+      this.max, this.count, this.sum);
+}
+
+/// Counts the work done inside RocksDB by the operations it is given to, to
+/// find out why particular reads are slow.
+///
+/// Pass the same context to several calls of [RocksDB.get],
+/// [RocksDB.getMany], [RocksDB.getItems] or [RocksDB.getPrefix] to add up
+/// their counts. Timing the operations has a cost, so only pass a context to
+/// the calls that are being investigated.
+class RocksPerfContext {
+  final Int64List _counters = Int64List(14);
+
+  /// Default constructor
+  RocksPerfContext();
+
+  /// The number of key comparisons.
+  int get userKeyComparisons => _counters[0];
+
+  /// The number of blocks found in the block cache.
+  int get blockCacheHits => _counters[1];
+
+  /// The number of blocks read from table files.
+  int get blockReads => _counters[2];
+
+  /// The number of bytes in the blocks read from table files.
+  int get blockReadBytes => _counters[3];
+
+  /// The time spent reading blocks from table files, in nanoseconds.
+  int get blockReadNanos => _counters[4];
+
+  /// The number of older versions of keys skipped.
+  int get internalKeysSkipped => _counters[5];
+
+  /// The number of deleted keys skipped.
+  int get internalDeletesSkipped => _counters[6];
+
+  /// The time spent reading from memtables by gets, in nanoseconds.
+  int get getFromMemtableNanos => _counters[7];
+
+  /// The time spent reading from table files by gets, in nanoseconds.
+  int get getFromFilesNanos => _counters[8];
+
+  /// The number of times a memtable prefix bloom filter passed a key.
+  int get bloomMemtableHits => _counters[9];
+
+  /// The number of times a table file filter passed a key.
+  int get bloomFileHits => _counters[10];
+
+  /// The number of times a table file filter ruled out a key.
+  int get bloomFileMisses => _counters[11];
+
+  /// The number of bytes read from files.
+  int get bytesRead => _counters[12];
+
+  /// The time spent reading files, in nanoseconds.
+  int get readNanos => _counters[13];
+
+  /// Set all of the counts back to 0.
+  void reset() {
+    _counters.fillRange(0, _counters.length, 0);
+  }
+}
+
+/// A consistent, read-only view of a [RocksDB] as it was when
+/// [RocksDB.snapshot] was called.
+///
+/// Reads that are given the snapshot do not see any writes made after it was
+/// taken, and writers are not blocked while it is in use.
+class RocksSnapshot extends NativeFieldWrapperClass2 {
+  bool _isReleased = false;
+
+  RocksSnapshot._internal();
+
+  void _init(RocksDB db) native 'Snapshot_New';
+  void _release() native 'Snapshot_Release';
+
+  /// Whether [release] has been called.
+  bool get isReleased => _isReleased;
+
+  /// Release the snapshot. It may not be used for any further reads, although
+  /// iterations that have already started are not affected.
+  void release() {
+    if (!_isReleased) {
+      _isReleased = true;
+      _release();
+    }
+  }
+
+  void _checkNotReleased() {
+    if (_isReleased) {
+      throw StateError('Snapshot already released');
+    }
+  }
+}
+
+/// A transaction on a [RocksDB], returned by [RocksDB.transaction].
+///
+/// The writes of the transaction are only seen by its own reads until it is
+/// committed, when they are applied atomically. The commit fails with
+/// [RocksBusyError] if another writer, in any isolate, has written a key that
+/// the transaction wrote or read with [getForUpdate], which gives a
+/// conditional update without any locking in Dart:
+///
+///     var txn = db.transaction();
+///     var count = txn.getForUpdate('count');
+///     txn.put('count', '${int.parse(count) + 1}');
+///     txn.commit();
+///
+/// A transaction that is neither committed nor rolled back is rolled back
+/// when it is garbage collected or when the database is closed.
+class RocksTransaction<K, V> extends NativeFieldWrapperClass2 {
+  final RocksDB<K, V> _db;
+  bool _isFinished = false;
+
+  RocksTransaction._internal(this._db);
+
+  void _begin(RocksDB db, bool sync, bool setSnapshot, int lockTimeout)
+      native 'Transaction_Begin';
+  Uint8List _get(Uint8List key, int columnFamily, bool forUpdate,
+      bool exclusive) native 'Transaction_Get';
+  void _put(Uint8List key, Uint8List value, int columnFamily)
+      native 'Transaction_Put';
+  void _delete(Uint8List key, int columnFamily) native 'Transaction_Delete';
+  void _commit() native 'Transaction_Commit';
+  void _rollback() native 'Transaction_Rollback';
+
+  /// Whether [commit] or [rollback] has been called.
+  bool get isFinished => _isFinished;
+
+  /// Get a key as seen by the transaction, including its own writes. Returns
+  /// null if the key is not found.
+  V get(K key, {RocksColumnFamily columnFamily}) =>
+      _getValue(key, columnFamily, false, false);
+
+  /// Get a key like [get], and have the commit fail if someone else writes
+  /// the key before then. In a pessimistic transaction the key is locked
+  /// instead, and [exclusive] set to false takes a lock that is shared with
+  /// other readers.
+  V getForUpdate(K key,
+          {RocksColumnFamily columnFamily, bool exclusive = true}) =>
+      _getValue(key, columnFamily, true, exclusive);
+
+  /// Set a key to a value when the transaction commits.
+  void put(K key, V value, {RocksColumnFamily columnFamily}) {
+    _checkNotFinished();
+    _put(_db._keyEncoding.encode(key), _db._valueEncoding.encode(value),
+        _db._columnFamilyIndexOf(columnFamily));
+  }
+
+  /// Remove a key when the transaction commits.
+  void delete(K key, {RocksColumnFamily columnFamily}) {
+    _checkNotFinished();
+    _delete(_db._keyEncoding.encode(key),
+        _db._columnFamilyIndexOf(columnFamily));
+  }
+
+  /// Return an [Iterable] over the items as seen by the transaction, including
+  /// its own writes. The parameters are as for [RocksDB.getItems]. Iterations
+  /// end with the transaction, after which they throw [StateError].
+  RocksIterable<K, V> getItems(
+      {K gt,
+      K gte,
+      K lt,
+      K lte,
+      int limit = -1,
+      bool reverse = false,
+      RocksColumnFamily columnFamily,
+      bool fillCache = true,
+      int batchSize = 128,
+      int batchBytes = 65536}) {
+    assert(batchSize > 0);
+    return RocksIterable<K, V>._internal(
+        _db,
+        limit,
+        fillCache,
+        gt ?? gte,
+        gt == null,
+        lt ?? lte,
+        lt == null,
+        null,
+        reverse,
+        null,
+        _db._columnFamilyIndexOf(columnFamily),
+        null,
+        batchSize,
+        batchBytes,
+        this);
+  }
+
+  /// Apply the writes of the transaction atomically. Throws [RocksBusyError]
+  /// if they conflict with another writer, in which case nothing is written.
+  /// The transaction is finished either way.
+  void commit() {
+    _checkNotFinished();
+    _isFinished = true;
+    _commit();
+  }
+
+  /// Discard the writes of the transaction, and release its locks.
+  void rollback() {
+    if (!_isFinished) {
+      _isFinished = true;
+      _rollback();
+    }
+  }
+
+  V _getValue(
+      K key, RocksColumnFamily columnFamily, bool forUpdate, bool exclusive) {
+    _checkNotFinished();
+    var value = _get(_db._keyEncoding.encode(key),
+        _db._columnFamilyIndexOf(columnFamily), forUpdate, exclusive);
+    return value == null ? null : _db._valueEncoding.decode(value);
+  }
+
+  void _checkNotFinished() {
+    if (_isFinished) {
+      throw StateError('Transaction already finished');
+    }
+  }
+}
+
+/// Builds a table file from entries in increasing key order, to be added to a
+/// database with [RocksDB.ingest]. Create a writer with [RocksDB.sstWriter].
+///
+/// Bulk loading sorted data this way avoids the write ahead log, the memtable
+/// and compaction: the file is written once and then moved into the database.
+class RocksSstWriter<K, V> extends NativeFieldWrapperClass2 {
+  final convert.Codec<K, Uint8List> _keyEncoding;
+  final convert.Codec<V, Uint8List> _valueEncoding;
+  bool _isFinished = false;
+
+  /// The path of the file.
+  final String path;
+
+  RocksSstWriter._internal(this._keyEncoding, this._valueEncoding, this.path);
+
+  void _open(RocksDB db, String path, int columnFamily)
+      native 'SstWriter_Open';
+  void _put(Uint8List key, Uint8List value) native 'SstWriter_Put';
+  void _write(Uint8List ops, int length) native 'SstWriter_Write';
+  int _finish() native 'SstWriter_Finish';
+
+  /// Whether [finish] has been called.
+  bool get isFinished => _isFinished;
+
+  /// Add an entry. The key must be greater than the keys of all the entries
+  /// added before, otherwise [RocksInvalidArgumentError] is thrown.
+  void put(K key, V value) {
+    _checkNotFinished();
+    _put(_keyEncoding.encode(key), _valueEncoding.encode(value));
+  }
+
+  /// Add the updates of [batch], in a single call. The keys must be in
+  /// increasing order, following the keys added before, and the updates must
+  /// be to the column family of this writer.
+  void write(RocksWriteBatch<K, V> batch) {
+    _checkNotFinished();
+    _write(batch._ops._buffer, batch._ops.length);
+  }
+
+  /// Finish writing the file, which must have at least one entry, and return
+  /// its size in bytes. An unfinished file is abandoned once the writer is
+  /// garbage collected.
+  int finish() {
+    _checkNotFinished();
+    _isFinished = true;
+    return _finish();
+  }
+
+  void _checkNotFinished() {
+    if (_isFinished) {
+      throw StateError('Table file already finished');
+    }
+  }
+}
+
+/// The native producer of [RocksDB.stream] or [RocksDB.changesSince], started
+/// once the stream is listened to.
+///
+/// The producer thread posts a batch of entries for each credit it is given,
+/// and waits once it runs out. A credit is given back for each batch that is
+/// delivered while the subscription is not paused, and for the batches
+/// delivered while it was paused once it is resumed.
+class _RocksStream<T> extends NativeFieldWrapperClass2 {
+  final Iterable<T> Function(Uint8List batch) _decode;
+  final void Function(_RocksStream<T> stream, SendPort port) _run;
+  StreamController<T> _controller;
+  RawReceivePort _port;
+  bool _isRunning = false;
+  // Number of batches delivered while the subscription was paused.
+  int _owed = 0;
+
+  _RocksStream(this._decode, this._run) {
+    _controller = StreamController<T>(
+        onListen: _onListen, onResume: _onResume, onCancel: _onCancel);
+  }
+
+  Stream<T> get stream => _controller.stream;
+
+  void _start(
+      RocksDB db,
+      SendPort port,
+      int limit,
+      bool fillCache,
+      Uint8List gt,
+      bool isGtClosed,
+      Uint8List lt,
+      bool isLtClosed,
+      Uint8List prefix,
+      bool reverse,
+      RocksSnapshot snapshot,
+      int columnFamily,
+      int batchSize,
+      int batchBytes,
+      int readaheadSize,
+      int credits) native 'Stream_Start';
+  void _startChanges(RocksDB db, SendPort port, int sequence,
+      int columnFamily, bool tail, int batchSize, int batchBytes,
+      int credits) native 'Stream_StartChanges';
+  void _request(int batches) native 'Stream_Request';
+  void _cancel() native 'Stream_Cancel';
+
+  void _onListen() {
+    _port = RawReceivePort(_onReply);
+    try {
+      _run(this, _port.sendPort);
+      _isRunning = true;
+    } catch (e) {
+      _port.close();
+      _controller
+        ..addError(e)
+        ..close();
+    }
+  }
+
+  // Handle a message of the producer thread, [0, 0, entries] for a batch and
+  // [0, status, null] once it is done.
+  void _onReply(dynamic reply) {
+    var message = reply as List<dynamic>;
+    var entries = message[2] as Uint8List;
+    if (entries == null) {
+      _stop();
+      var error = RocksDB._getError(message[1]);
+      if (error != null) {
+        _controller.addError(error);
+      }
+      _controller.close();
+      return;
+    }
+    for (var item in _decode(entries)) {
+      _controller.add(item);
+    }
+    if (_controller.isPaused) {
+      _owed += 1;
+    } else {
+      _request(1);
+    }
+  }
+
+  void _onResume() {
+    if (_isRunning && _owed > 0) {
+      _request(_owed);
+      _owed = 0;
+    }
+  }
+
+  void _onCancel() {
+    if (_isRunning) {
+      _stop();
+    }
+  }
+
+  void _stop() {
+    _isRunning = false;
+    _port.close();
+    _cancel();
+  }
+}
+
+/// Dispatches the results of asynchronous operations posted by the native
+/// threads to the futures waiting for them.
+///
+/// Every operation in an isolate replies to the same port, tagged with an id
+/// that identifies the operation. The port is only open while operations are
+/// pending so that it does not keep the isolate alive.
+class _AsyncReplies {
+  static RawReceivePort _port;
+  static final Map<int, Completer<Uint8List>> _pending = {};
+  static int _nextId = 0;
+
+  /// Call [op] with the reply port and a new id, and return a future that
+  /// completes with the result posted by the native code.
+  static Future<Uint8List> start(void Function(SendPort port, int id) op) {
+    _port ??= RawReceivePort(_handle);
+    var id = _nextId++;
+    var completer = Completer<Uint8List>();
+    _pending[id] = completer;
+    try {
+      op(_port.sendPort, id);
+    } catch (_) {
+      _remove(id);
+      rethrow;
+    }
+    return completer.future;
+  }
+
+  static Completer<Uint8List> _remove(int id) {
+    var completer = _pending.remove(id);
+    if (_pending.isEmpty) {
+      _port.close();
+      _port = null;
+    }
+    return completer;
+  }
+
+  // Handle a reply of the form [id, status, result].
+  static void _handle(dynamic message) {
+    var reply = message as List<dynamic>;
+    var completer = _remove(reply[0] as int);
+    if (RocksDB._completeError(completer, reply[1])) {
+      return;
+    }
+    completer.complete(reply[2] as Uint8List);
+  }
+}
+
+/// Builder for the packed buffers that are passed to the native code.
+///
+/// Values are written as 32-bit little-endian integers and byte strings are
+/// padded to a multiple of 4 bytes.
+class _PackedBuilder {
+  Uint8List _buffer = Uint8List(256);
+  ByteData _view;
+  int _length = 0;
+
+  _PackedBuilder() {
+    _view = ByteData.view(_buffer.buffer);
+  }
+
+  /// The number of bytes written so far.
+  int get length => _length;
+
+  void _reserve(int extra) {
+    var required = _length + extra;
+    if (required <= _buffer.length) {
+      return;
+    }
+    var capacity = _buffer.length * 2;
+    while (capacity < required) {
+      capacity *= 2;
+    }
+    var buffer = Uint8List(capacity);
+    buffer.setRange(0, _length, _buffer);
+    _buffer = buffer;
+    _view = ByteData.view(_buffer.buffer);
+  }
+
+  void addUint32(int value) {
+    _reserve(4);
+    _view.setUint32(_length, value, Endian.little);
+    _length += 4;
+  }
+
+  void addPadded(Uint8List bytes) {
+    var padded = _align4(bytes.length);
+    _reserve(padded);
+    _buffer.setRange(_length, _length + bytes.length, bytes);
+    _buffer.fillRange(_length + bytes.length, _length + padded, 0);
+    _length += padded;
+  }
+
+  void clear() {
+    _length = 0;
+  }
+}
+
+/// A batch of puts, merges and deletes that are applied to a database
+/// atomically.
+///
+/// Create a batch with [RocksDB.batch] and apply it with [RocksDB.write]. The
+/// updates are encoded into a single buffer as they are added, so applying the
+/// batch takes only one call into the database regardless of its size.
+///
+/// Updates may be to any of the column families of the database that the
+/// batch is written to, and are still applied atomically.
+class RocksWriteBatch<K, V> {
+  static const int _put = 1;
+  static const int _delete = 2;
+  static const int _deleteRange = 3;
+  static const int _merge = 4;
+  static final Uint8List _empty = Uint8List(0);
+
+  final convert.Codec<K, Uint8List> _keyEncoding;
+  final convert.Codec<V, Uint8List> _valueEncoding;
+  final _PackedBuilder _ops = _PackedBuilder();
+  int _count = 0;
+
+  RocksWriteBatch._internal(this._keyEncoding, this._valueEncoding);
+
+  /// The number of updates in this batch.
+  int get length => _count;
+
+  /// Returns true if this batch has no updates.
+  bool get isEmpty => _count == 0;
+
+  void _add(int op, RocksColumnFamily columnFamily, Uint8List key,
+      Uint8List value) {
+    // The column family index is packed above the op code.
+    _ops.addUint32(op | ((columnFamily?._index ?? 0) << 8));
+    _ops.addUint32(key.length);
+    _ops.addUint32(value.length);
+    _ops.addPadded(key);
+    _ops.addPadded(value);
+    _count++;
+  }
+
+  /// Set a key to a value, in [columnFamily] if one is given.
+  void put(K key, V value, {RocksColumnFamily columnFamily}) {
+    _add(_put, columnFamily, _keyEncoding.encode(key),
+        _valueEncoding.encode(value));
+  }
+
+  /// Merge [operand] into the value of a key, in [columnFamily] if one is
+  /// given. See [RocksDB.merge].
+  void merge(K key, V operand, {RocksColumnFamily columnFamily}) {
+    _add(_merge, columnFamily, _keyEncoding.encode(key),
+        _valueEncoding.encode(operand));
+  }
+
+  /// Remove a key, from [columnFamily] if one is given.
+  void delete(K key, {RocksColumnFamily columnFamily}) {
+    _add(_delete, columnFamily, _keyEncoding.encode(key), _empty);
+  }
+
+  /// Remove all keys in the range from [start] (inclusive) to [end]
+  /// (exclusive), from [columnFamily] if one is given.
+  void deleteRange(K start, K end, {RocksColumnFamily columnFamily}) {
+    _add(_deleteRange, columnFamily, _keyEncoding.encode(start),
+        _keyEncoding.encode(end));
+  }
+
+  /// Remove all updates from this batch.
+  void clear() {
+    _ops.clear();
+    _count = 0;
+  }
+}
+
+/// The kinds of update in a [RocksChange].
+enum RocksChangeType { put, delete, deleteRange, merge }
+
+/// An update read from the write ahead log by [RocksDB.changesSince].
+class RocksChange<K, V> {
+  /// The sequence number of the update.
+  final int sequence;
+
+  /// The kind of update.
+  final RocksChangeType type;
+
+  /// The key that was updated, or the start of the range (inclusive) for a
+  /// [RocksChangeType.deleteRange].
+  final K key;
+
+  /// The value that was put, or the operand of a [RocksChangeType.merge].
+  /// Null for deletes.
+  final V value;
+
+  /// The end of the range (exclusive) for a [RocksChangeType.deleteRange],
+  /// otherwise null.
+  final K end;
+
+  RocksChange._internal(
+      this.sequence, this.type, this.key, this.value, this.end);
 }
 
 /// A key-value pair returned by the iterator.
@@ -277,50 +2107,227 @@ class RocksItem<K, V> {
   RocksItem._internal(this.key, this.value);
 }
 
+int _align4(int v) => (v + 3) & ~3;
+
+// Values at least this large are returned by the native get without copying.
+// This must match PINNED_VALUE_THRESHOLD in the native code.
+const int _pinnedValueThreshold = 16 * 1024;
+
+// Length given by the native code in place of a value that was not found.
+const int _missingValueLength = 0xFFFFFFFF;
+
+// Result of the C ABI for a key that was not found.
+const int _notFoundError = -5;
+
+// Size of the native buffer that the C ABI is called with. Larger keys, put
+// values and write batches go through the native extension instead.
+const int _ffiBufferSize = 64 * 1024;
+
+typedef _FfiGetNative = ffi.Int64 Function(
+    ffi.Pointer<ffi.Void> db,
+    ffi.Int64 columnFamily,
+    ffi.Pointer<ffi.Uint8> key,
+    ffi.Int64 keyLength,
+    ffi.Pointer<ffi.Uint8> value,
+    ffi.Int64 capacity);
+typedef _FfiGet = int Function(ffi.Pointer<ffi.Void> db, int columnFamily,
+    ffi.Pointer<ffi.Uint8> key, int keyLength, ffi.Pointer<ffi.Uint8> value,
+    int capacity);
+typedef _FfiPutNative = ffi.Int64 Function(
+    ffi.Pointer<ffi.Void> db,
+    ffi.Int64 columnFamily,
+    ffi.Pointer<ffi.Uint8> key,
+    ffi.Int64 keyLength,
+    ffi.Pointer<ffi.Uint8> value,
+    ffi.Int64 valueLength,
+    ffi.Int64 sync);
+typedef _FfiPut = int Function(ffi.Pointer<ffi.Void> db, int columnFamily,
+    ffi.Pointer<ffi.Uint8> key, int keyLength, ffi.Pointer<ffi.Uint8> value,
+    int valueLength, int sync);
+typedef _FfiDeleteNative = ffi.Int64 Function(ffi.Pointer<ffi.Void> db,
+    ffi.Int64 columnFamily, ffi.Pointer<ffi.Uint8> key, ffi.Int64 keyLength);
+typedef _FfiDelete = int Function(ffi.Pointer<ffi.Void> db, int columnFamily,
+    ffi.Pointer<ffi.Uint8> key, int keyLength);
+typedef _FfiWriteNative = ffi.Int64 Function(ffi.Pointer<ffi.Void> db,
+    ffi.Pointer<ffi.Uint8> ops, ffi.Int64 length, ffi.Int64 sync);
+typedef _FfiWrite = int Function(
+    ffi.Pointer<ffi.Void> db, ffi.Pointer<ffi.Uint8> ops, int length, int sync);
+typedef _FfiNextBatchNative = ffi.Int64 Function(
+    ffi.Pointer<ffi.Void> iterator, ffi.Int64 maxCount, ffi.Int64 maxBytes);
+typedef _FfiNextBatch = int Function(
+    ffi.Pointer<ffi.Void> iterator, int maxCount, int maxBytes);
+typedef _FfiBatchNative = ffi.Pointer<ffi.Uint8> Function(
+    ffi.Pointer<ffi.Void> iterator);
+typedef _FfiBatch = ffi.Pointer<ffi.Uint8> Function(
+    ffi.Pointer<ffi.Void> iterator);
+
+/// The functions of the C ABI of the native library, which are called through
+/// dart:ffi on the hot paths instead of through the native extension.
+///
+/// Their addresses are handed over by the extension, in the order of the
+/// `Ffi_Functions` native, since the library is not loaded globally and so
+/// cannot be looked up with `DynamicLibrary`.
+class _Ffi {
+  static final _Ffi instance = _Ffi._internal(RocksDB._ffiFunctions());
+
+  final _FfiGet get;
+  final _FfiPut put;
+  final _FfiDelete delete;
+  final _FfiWrite write;
+  final _FfiNextBatch iteratorNextBatch;
+  final _FfiBatch iteratorBatch;
+
+  _Ffi._internal(List<dynamic> addresses)
+      : get = ffi.Pointer<ffi.NativeFunction<_FfiGetNative>>.fromAddress(
+                addresses[0] as int)
+            .asFunction<_FfiGet>(),
+        put = ffi.Pointer<ffi.NativeFunction<_FfiPutNative>>.fromAddress(
+                addresses[1] as int)
+            .asFunction<_FfiPut>(),
+        delete = ffi.Pointer<ffi.NativeFunction<_FfiDeleteNative>>.fromAddress(
+                addresses[2] as int)
+            .asFunction<_FfiDelete>(),
+        write = ffi.Pointer<ffi.NativeFunction<_FfiWriteNative>>.fromAddress(
+                addresses[3] as int)
+            .asFunction<_FfiWrite>(),
+        iteratorNextBatch =
+            ffi.Pointer<ffi.NativeFunction<_FfiNextBatchNative>>.fromAddress(
+                    addresses[4] as int)
+                .asFunction<_FfiNextBatch>(),
+        iteratorBatch =
+            ffi.Pointer<ffi.NativeFunction<_FfiBatchNative>>.fromAddress(
+                    addresses[5] as int)
+                .asFunction<_FfiBatch>();
+}
+
+/// Reader for the packed key-value entries returned by the native batch calls.
+///
+/// Each entry is the key length and the value length (32-bit little-endian)
+/// followed by the key and the value, each padded to a multiple of 4 bytes.
+class _EntryReader {
+  final Uint8List _data;
+  final ByteData _view;
+  int _offset = 0;
+
+  int _keyOffset;
+  int _keyLength;
+  int _valueOffset;
+  int _valueLength;
+
+  _EntryReader(Uint8List data)
+      : _data = data,
+        _view = ByteData.view(data.buffer, data.offsetInBytes, data.length);
+
+  /// Advance to the next entry, returning false if there are no more.
+  bool moveNext() {
+    if (_offset >= _data.length) {
+      return false;
+    }
+    _keyLength = _view.getUint32(_offset, Endian.little);
+    _valueLength = _view.getUint32(_offset + 4, Endian.little);
+    _keyOffset = _offset + 8;
+    _valueOffset = _keyOffset + _align4(_keyLength);
+    _offset = _valueOffset + _align4(_valueLength);
+    return true;
+  }
+
+  /// The key bytes of the current entry.
+  Uint8List get key =>
+      Uint8List.view(_data.buffer, _data.offsetInBytes + _keyOffset, _keyLength);
+
+  /// The value bytes of the current entry.
+  Uint8List get value => Uint8List.view(
+      _data.buffer, _data.offsetInBytes + _valueOffset, _valueLength);
+}
+
 /// An iterator returned by an instance of [RocksIterable].
 class RocksIterator<K, V> extends NativeFieldWrapperClass2
     implements Iterator<RocksItem<K, V>> {
+  final RocksDB<K, V> _db;
   final convert.Codec<K, Uint8List> _keyEncoding;
   final convert.Codec<V, Uint8List> _valueEncoding;
+  final int _batchSize;
+  final int _batchBytes;
+  final RocksPerfContext _perf;
+  final RocksTransaction<K, V> _transaction;
+
+  // The native iterator, passed to the functions of the C ABI.
+  ffi.Pointer<ffi.Void> _handle;
 
   RocksIterator._internal(RocksIterable<K, V> it)
-      : _keyEncoding = it._db._keyEncoding,
-        _valueEncoding = it._db._valueEncoding;
+      : _db = it._db,
+        _keyEncoding = it._db._keyEncoding,
+        _valueEncoding = it._db._valueEncoding,
+        _batchSize = it._batchSize,
+        _batchBytes = it._batchBytes,
+        _perf = it._perf,
+        _transaction = it._transaction;
 
   int _init(RocksDB<K, V> db, int limit, bool fillCache, Uint8List gt,
-      bool isGtClosed, Uint8List lt, bool isLtClosed) native 'SyncIterator_New';
-  Uint8List _next() native 'SyncIterator_Next';
-  Uint8List _current;
+      bool isGtClosed, Uint8List lt, bool isLtClosed, Uint8List prefix,
+      bool reverse, RocksSnapshot snapshot, int columnFamily,
+      Int64List perfCounters, RocksTransaction<K, V> transaction,
+      bool keysOnly) native 'SyncIterator_New';
+  Uint8List _nextBatch(int maxCount, int maxBytes, Int64List perfCounters)
+      native 'SyncIterator_NextBatch';
+  _EntryReader _entries;
+  bool _hasCurrent = false;
 
   /// The key of the current RocksItem.
-  K get currentKey => _current == null
-      ? null
-      : _keyEncoding.decode(
-          Uint8List.view(_current.buffer, 4, (_current[1] << 8) + _current[0]));
+  K get currentKey => _hasCurrent ? _keyEncoding.decode(_entries.key) : null;
 
   /// The value of the current RocksItem.
-  V get currentValue => _current == null
-      ? null
-      : _valueEncoding.decode(Uint8List.view(
-          _current.buffer, 4 + (_current[3] << 8) + _current[2]));
+  V get currentValue =>
+      _hasCurrent ? _valueEncoding.decode(_entries.value) : null;
 
   @override
   RocksItem<K, V> get current {
-    return _current == null
-        ? null
-        : RocksItem<K, V>._internal(currentKey, currentValue);
+    return _hasCurrent
+        ? RocksItem<K, V>._internal(currentKey, currentValue)
+        : null;
   }
 
   @override
   bool moveNext() {
-    _current = _next();
-    return _current != null;
+    // Entries already fetched are still backed by the database, so check that
+    // it has not been closed in the meantime.
+    if (_db._isClosed) {
+      throw const RocksClosedError._internal();
+    }
+    _transaction?._checkNotFinished();
+    _hasCurrent = (_entries != null && _entries.moveNext()) || _fetch();
+    return _hasCurrent;
+  }
+
+  // Fetch the next batch of entries from the database.
+  bool _fetch() {
+    Uint8List batch;
+    if (_perf == null) {
+      // The entries are copied out of the native batch buffer, which the next
+      // fetch overwrites.
+      var length =
+          _Ffi.instance.iteratorNextBatch(_handle, _batchSize, _batchBytes);
+      RocksDB._checkFfiResult(length);
+      if (length > 0) {
+        batch = Uint8List.fromList(
+            _Ffi.instance.iteratorBatch(_handle).asTypedList(length));
+      }
+    } else {
+      batch = _nextBatch(_batchSize, _batchBytes, _perf._counters);
+    }
+    if (batch == null) {
+      _entries = null;
+      return false;
+    }
+    _entries = _EntryReader(batch);
+    return _entries.moveNext();
   }
 }
 
 /// An [Iterable<RocksItem>] for iterating over key-value pairs.
 ///
-/// Iteration is sorted by key in byte collation order.
+/// Iteration is sorted by key in byte collation order, or in the reverse of
+/// that order.
 ///
 /// You can use the [keys] and [values] getters to get an [Iterable] over just
 /// the keys or just the values in the database.
@@ -336,18 +2343,55 @@ class RocksIterable<K, V> extends IterableBase<RocksItem<K, V>> {
   final K _lt;
   final bool _isLtClosed;
 
-  RocksIterable._internal(RocksDB<K, V> db, int limit, bool fillCache, K gt,
-      bool isGtClosed, K lt, bool isLtClosed)
+  final K _prefix;
+  final bool _reverse;
+  final RocksSnapshot _snapshot;
+  final int _columnFamily;
+  final RocksPerfContext _perf;
+
+  final int _batchSize;
+  final int _batchBytes;
+  final RocksTransaction<K, V> _transaction;
+
+  RocksIterable._internal(
+      RocksDB<K, V> db,
+      int limit,
+      bool fillCache,
+      K gt,
+      bool isGtClosed,
+      K lt,
+      bool isLtClosed,
+      K prefix,
+      bool reverse,
+      RocksSnapshot snapshot,
+      int columnFamily,
+      RocksPerfContext perf,
+      int batchSize,
+      int batchBytes,
+      [RocksTransaction<K, V> transaction])
       : _db = db,
         _limit = limit,
         _fillCache = fillCache,
         _gt = gt,
         _isGtClosed = isGtClosed,
         _lt = lt,
-        _isLtClosed = isLtClosed;
+        _isLtClosed = isLtClosed,
+        _prefix = prefix,
+        _reverse = reverse,
+        _snapshot = snapshot,
+        _columnFamily = columnFamily,
+        _perf = perf,
+        _batchSize = batchSize,
+        _batchBytes = batchBytes,
+        _transaction = transaction;
 
   @override
-  RocksIterator<K, V> get iterator {
+  RocksIterator<K, V> get iterator => _iterator(false);
+
+  // Create an iterator, which leaves the values empty if keysOnly is true.
+  RocksIterator<K, V> _iterator(bool keysOnly) {
+    _snapshot?._checkNotReleased();
+    _transaction?._checkNotFinished();
     var ret = RocksIterator<K, V>._internal(this);
     Uint8List ltEncoded;
     if (_lt != null) {
@@ -358,14 +2402,24 @@ class RocksIterable<K, V> extends IterableBase<RocksItem<K, V>> {
       gtEncoded = _db._keyEncoding.encode(_gt);
     }
 
-    ret._init(_db, _limit, _fillCache, gtEncoded, _isGtClosed, ltEncoded,
-        _isLtClosed);
+    Uint8List prefixEncoded;
+    if (_prefix != null) {
+      prefixEncoded = _db._keyEncoding.encode(_prefix);
+    }
+
+    var handle = ret._init(_db, _limit, _fillCache, gtEncoded, _isGtClosed,
+        ltEncoded, _isLtClosed, prefixEncoded, _reverse, _snapshot,
+        _columnFamily, _perf?._counters, _transaction, keysOnly);
+    ret._handle = ffi.Pointer<ffi.Void>.fromAddress(handle);
     return ret;
   }
 
   /// Returns an [Iterable] of the keys in the database.
+  ///
+  /// Only the keys are read, and the values are not copied. With RocksDB 9 or
+  /// later, values kept in blob files are not read from disk either.
   Iterable<K> get keys sync* {
-    var it = iterator;
+    var it = _iterator(true);
     while (it.moveNext()) {
       yield it.currentKey;
     }
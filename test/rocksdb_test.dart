@@ -35,6 +35,12 @@ class _InvalidArgumentMatcher extends TypeMatcher<RocksInvalidArgumentError> {
   const _InvalidArgumentMatcher();
 }
 
+const Matcher _isBusyError = _BusyMatcher();
+
+class _BusyMatcher extends TypeMatcher<RocksBusyError> {
+  const _BusyMatcher();
+}
+
 void main() {
   tearDown(() async {
     // make a copy of the current elements to allow pruning the set
@@ -147,6 +153,835 @@ void main() {
     }
   });
 
+  test('delete range and compaction', () async {
+    var path = generateTempPath('delete-range');
+    var db = await RocksDB.openUtf8(path);
+    for (var i in Iterable<int>.generate(100)) {
+      db.put('tenant1/${i.toString().padLeft(3, '0')}', 'v');
+      db.put('tenant2/${i.toString().padLeft(3, '0')}', 'v');
+    }
+    db.deleteRange('tenant1/', 'tenant1/\uffff');
+    expect(db.getPrefix('tenant1/'), isEmpty);
+    expect(db.getPrefix('tenant2/').length, equals(100));
+
+    // Compaction leaves the remaining keys in place.
+    await db.compactRange('tenant1/', 'tenant2/');
+    await db.compactRange(null, null, bottommostForce: true);
+    expect(db.getItems().length, equals(100));
+    expect(db.get('tenant2/000'), equals('v'));
+
+    // The compaction keeps the database open until it completes.
+    var compaction = db.compactRange(null, null);
+    db.close();
+    await compaction;
+    dbPaths.add(path);
+  });
+
+  test('bulk load', () async {
+    var path = generateTempPath('bulk-load');
+    var files = generateTempPath('bulk-load-files');
+    var db = await RocksDB.openUtf8(path);
+    db.put('k000', 'old');
+
+    var writer = db.sstWriter(p.join(files, '1.sst'));
+    writer.put('k000', 'new');
+    var batch = db.batch();
+    for (var i = 1; i < 100; i++) {
+      batch.put('k${i.toString().padLeft(3, '0')}', 'v$i');
+    }
+    writer.write(batch);
+    expect(() => writer.put('a', 'out of order'),
+        throwsA(_isInvalidArgumentError));
+    expect(writer.finish(), greaterThan(0));
+    expect(() => writer.put('z', 'v'), throwsStateError);
+
+    await db.ingest(<String>[writer.path], move: true);
+    expect(File(writer.path).existsSync(), isFalse);
+    expect(db.get('k000'), equals('new'));
+    expect(db.get('k099'), equals('v99'));
+    expect(db.getItems().length, equals(100));
+    db.close();
+    dbPaths.add(path);
+    dbPaths.add(files);
+  });
+
+  test('checkpoints and backups', () async {
+    var path = generateTempPath('backup-db');
+    var checkpointDir = p.join(generateTempPath('checkpoint'), 'db');
+    var backupDir = generateTempPath('backups');
+    var db = await RocksDB.openUtf8(path, shared: true);
+    db.put('k1', 'v1');
+    await db.checkpoint(checkpointDir);
+    await db.backup(backupDir);
+    db.put('k2', 'v2');
+    await db.backup(backupDir, keepLatest: 1);
+
+    var checkpoint = await RocksDB.openUtf8(checkpointDir);
+    expect(checkpoint.getItems().keys.toList(), equals(<String>['k1']));
+    checkpoint.close();
+
+    // An open database cannot be restored.
+    await expectLater(RocksDB.restoreBackup(backupDir, path),
+        throwsA(const TypeMatcher<RocksIOError>()));
+    db.close();
+    await RocksDB.restoreBackup(backupDir, path);
+    db = await RocksDB.openUtf8(path);
+    expect(db.getItems().keys.toList(), equals(<String>['k1', 'k2']));
+    db.close();
+    dbPaths.add(path);
+    dbPaths.add(p.dirname(checkpointDir));
+    dbPaths.add(backupDir);
+  });
+
+  test('write batch', () async {
+    var path = generateTempPath('write-batch');
+    var db = await RocksDB.openUtf8(path);
+    try {
+      db.put('a', 'old');
+      db.put('m1', 'v');
+      db.put('m2', 'v');
+
+      var batch = db.batch();
+      expect(batch.isEmpty, isTrue);
+      batch.put('a', 'new');
+      batch.put('b', 'v' * 1001);
+      batch.delete('x');
+      batch.deleteRange('m', 'n');
+      expect(batch.length, equals(4));
+      // Nothing is written until the batch is applied.
+      expect(db.get('b'), isNull);
+
+      db.write(batch, sync: true);
+      expect(db.get('a'), equals('new'));
+      expect(db.get('b'), equals('v' * 1001));
+      expect(db.getItems().keys.toList(), equals(<String>['a', 'b']));
+
+      // The batch may be cleared and reused.
+      batch.clear();
+      expect(batch.isEmpty, isTrue);
+      batch.delete('a');
+      db.write(batch);
+      expect(db.getItems().keys.toList(), equals(<String>['b']));
+    } finally {
+      db.close();
+      dbPaths.add(path);
+    }
+  });
+
+  test('key-only iteration, counts and sizes', () async {
+    var path = generateTempPath('count');
+    var db = await RocksDB.openUtf8(path);
+    try {
+      var batch = db.batch();
+      for (var i = 0; i < 1000; i++) {
+        batch.put('k${i.toString().padLeft(4, '0')}', 'v' * 100);
+      }
+      batch.put('x', 'y');
+      db.write(batch);
+
+      expect(db.getItems(gte: 'k0998').keys.toList(),
+          equals(<String>['k0998', 'k0999', 'x']));
+      expect(db.getItems(lt: 'k0002', reverse: true).keys.toList(),
+          equals(<String>['k0001', 'k0000']));
+      expect(db.count(), equals(1001));
+      expect(db.count(prefix: 'k'), equals(1000));
+      expect(db.count(gt: 'k0100', lte: 'k0200'), equals(100));
+      expect(db.count(limit: 10), equals(10));
+
+      var snapshot = db.snapshot();
+      db.delete('x');
+      expect(db.count(gte: 'x'), equals(0));
+      expect(db.count(gte: 'x', snapshot: snapshot), equals(1));
+      snapshot.release();
+
+      // Estimated from the memtable, then from the table file.
+      expect(db.approximateSize('k', 'l'), greaterThan(0));
+      await db.compactRange(null, null);
+      expect(db.approximateSize('k', 'l'), greaterThan(0));
+      expect(db.approximateSize('y', 'z'), equals(0));
+    } finally {
+      db.close();
+      dbPaths.add(path);
+    }
+  });
+
+  test('get many', () async {
+    var path = generateTempPath('get-many');
+    var db = await RocksDB.openUtf8(path);
+    try {
+      db.put('a', '1');
+      db.put('b', '');
+      db.put('c', 'v' * 5000);
+
+      expect(db.getMany(<String>[]), isEmpty);
+      expect(db.getMany(<String>['c', 'x', 'a', 'b', 'a']),
+          equals(<String>['v' * 5000, null, '1', '', '1']));
+      expect(db.getMany(<String>['y', 'z']), equals(<String>[null, null]));
+    } finally {
+      db.close();
+      dbPaths.add(path);
+    }
+  });
+
+  test('small and large keys and values', () async {
+    var path = generateTempPath('sizes');
+    var db = await RocksDB.openUtf8(path);
+    try {
+      // Sizes on either side of the 64 KB buffer that dart:ffi calls use, and
+      // of the 16 KB from which values are pinned.
+      var sizes = <int>[0, 1, 100, 16 * 1024, 48 * 1024, 64 * 1024, 100000];
+      for (var size in sizes) {
+        db.put('k' * (size + 1), 'v' * size);
+        db.put('$size', 'v' * size);
+      }
+      for (var size in sizes) {
+        expect(db.get('k' * (size + 1)), equals('v' * size));
+        expect(db.get('$size'), equals('v' * size));
+      }
+      expect(db.get('x' * 100000), isNull);
+
+      var batch = db.batch();
+      for (var size in sizes) {
+        batch.delete('k' * (size + 1));
+      }
+      db.write(batch);
+      batch
+        ..clear()
+        ..put('large', 'v' * 100000)
+        ..delete('0');
+      db.write(batch);
+      expect(db.get('large'), equals('v' * 100000));
+      expect(db.get('0'), isNull);
+
+      expect(db.getItems(batchSize: 2).map((item) => item.value.length),
+          equals(<int>[1, 100, 100000, 16 * 1024, 48 * 1024, 64 * 1024,
+              100000]));
+      db.delete('large');
+      expect(db.get('large'), isNull);
+    } finally {
+      db.close();
+      dbPaths.add(path);
+    }
+  });
+
+  test('asynchronous operations', () async {
+    var path = generateTempPath('async');
+    var db = await RocksDB.openUtf8(path);
+    try {
+      await db.putAsync('a', '1');
+      await db.putAsync('b', '2', sync: true);
+      expect(await db.getAsync('a'), equals('1'));
+      expect(await db.getAsync('x'), isNull);
+      expect(db.get('b'), equals('2'));
+
+      var batch = db.batch()
+        ..put('c', '3')
+        ..delete('a');
+      var written = db.writeAsync(batch);
+      // The batch is copied, so clearing it does not affect the write.
+      batch.clear();
+      await written;
+      expect(db.get('a'), isNull);
+      expect(db.get('c'), equals('3'));
+
+      // Many operations may be in flight at once.
+      await Future.wait(Iterable<int>.generate(100)
+          .map((int i) => db.putAsync('key-$i', 'value-$i')));
+      var values = await Future.wait(Iterable<int>.generate(100)
+          .map((int i) => db.getAsync('key-$i')));
+      expect(
+          values,
+          equals(Iterable<int>.generate(100)
+              .map((int i) => 'value-$i')
+              .toList()));
+
+      var items = await db.scanAsync(gte: 'b', lt: 'key-1', limit: 10);
+      expect(items.map((i) => i.key).toList(),
+          equals(<String>['b', 'c', 'key-0']));
+      expect(items.map((i) => i.value).toList(),
+          equals(<String>['2', '3', 'value-0']));
+      expect(await db.scanAsync(gt: 'z'), isEmpty);
+    } finally {
+      db.close();
+      dbPaths.add(path);
+    }
+  });
+
+  test('group commit', () async {
+    var path = generateTempPath('group-commit');
+    var unloggedPath = generateTempPath('group-commit-unlogged');
+    var db = await RocksDB.openUtf8(path,
+        options:
+            const RocksOptions(groupCommitDelayMicros: 1000, statistics: true));
+    var unlogged = await RocksDB.openUtf8(unloggedPath,
+        options: const RocksOptions(disableWal: true));
+    try {
+      await Future.wait(Iterable<int>.generate(100)
+          .map((int i) => db.putAsync('key-$i', 'value-$i', sync: true)));
+      expect(db.count(), equals(100));
+      // The writes share their syncs of the write ahead log.
+      var syncs = db.stats().tickers['rocksdb.wal.synced'];
+      expect(syncs, greaterThan(0));
+      expect(syncs, lessThan(50));
+
+      // A write that fails does not fail the rest of its group.
+      var failed = db
+          .writeAsync(
+              db.batch()
+                ..put('a', '1')
+                ..merge('m', 'x'),
+              sync: true)
+          .then<Object>((_) => null, onError: (Object e) => e);
+      var written = db.putAsync('b', '2', sync: true);
+      expect(await failed, _isInvalidArgumentError);
+      await written;
+      expect(db.get('a'), isNull);
+      expect(db.get('b'), equals('2'));
+
+      unlogged.put('a', '1', sync: true);
+      await unlogged.putAsync('b', '2', sync: true);
+      expect(unlogged.get('a'), equals('1'));
+      expect(unlogged.get('b'), equals('2'));
+    } finally {
+      unlogged.close();
+      db.close();
+      dbPaths.addAll([path, unloggedPath]);
+    }
+  });
+
+  test('asynchronous operation outlives close', () async {
+    var path = generateTempPath('async-close');
+    var db = await RocksDB.openUtf8(path);
+    var put = db.putAsync('a', '1');
+    db.close();
+    await put;
+    expect(() => db.getAsync('a'), throwsA(_isClosedError));
+
+    db = await RocksDB.openUtf8(path);
+    expect(db.get('a'), equals('1'));
+    db.close();
+    dbPaths.add(path);
+  });
+
+  test('large values are pinned', () async {
+    var path = generateTempPath('pinned');
+    var db = await RocksDB.openUint8List(path);
+    try {
+      var key = Uint8List.fromList(<int>[1, 2, 3]);
+      var large = Uint8List(1 << 20);
+      for (var i = 0; i < large.length; i++) {
+        large[i] = i & 0xFF;
+      }
+      db.put(key, large);
+
+      var value = db.get(key);
+      expect(value, equals(large));
+      // The value refers to memory owned by the database, so it is read-only.
+      expect(() => value[0] = 42, throwsUnsupportedError);
+      expect(await db.getAsync(key), equals(large));
+
+      // Small values are copied and remain writable.
+      db.put(key, Uint8List.fromList(<int>[4, 5, 6]));
+      value = db.get(key);
+      value[0] = 42;
+      expect(db.get(key), equals(<int>[4, 5, 6]));
+
+      // A pinned value remains valid after the database is closed.
+      db.put(key, large);
+      value = db.get(key);
+      db.close();
+      expect(value, equals(large));
+    } finally {
+      dbPaths.add(path);
+    }
+  });
+
+  test('table options', () async {
+    var path1 = generateTempPath('options-1');
+    var db1 = await RocksDB.openUtf8(path1,
+        options: RocksOptions(
+            blockSize: 16 * 1024,
+            bitsPerKey: 12,
+            blockCacheSize: 1024 * 1024,
+            cacheIndexAndFilterBlocks: true,
+            partitionFilters: true));
+    var path2 = generateTempPath('options-2');
+    var db2 = await RocksDB.openUtf8(path2,
+        options: RocksOptions(
+            bitsPerKey: 0, blockCacheSize: 0, sharedBlockCache: false));
+    var path3 = generateTempPath('options-3');
+    var db3 = await RocksDB.openUtf8(path3,
+        options: RocksOptions(blockCacheSize: 64 * 1024 * 1024));
+
+    for (var db in [db1, db2, db3]) {
+      for (var i in Iterable<int>.generate(100)) {
+        db.put('key-$i', 'value-$i');
+      }
+      expect(db.get('key-42'), equals('value-42'));
+      expect(db.get('key-100'), isNull);
+      expect(db.getItems().length, equals(100));
+      db.close();
+    }
+    dbPaths.addAll([path1, path2, path3]);
+  });
+
+  test('ribbon filters', () async {
+    var path = generateTempPath('ribbon');
+    RocksDB<String, String> db;
+    try {
+      db = await RocksDB.openUtf8(path,
+          options: RocksOptions(bitsPerKey: 12, ribbonFilter: true));
+    } on RocksInvalidArgumentError catch (_) {
+      // Built against RocksDB 6, which has no ribbon filters.
+      return;
+    }
+    for (var i in Iterable<int>.generate(100)) {
+      db.put('key-$i', 'value-$i');
+    }
+    await db.compactRange(null, null);
+    expect(db.get('key-42'), equals('value-42'));
+    expect(db.get('key-100'), isNull);
+    db.close();
+    dbPaths.add(path);
+  });
+
+  test('snapshots', () async {
+    var path = generateTempPath('snapshot');
+    var db = await RocksDB.openUtf8(path);
+
+    db.put('k1', 'v1');
+    db.put('k2', 'v2');
+    var snapshot = db.snapshot();
+    db.put('k1', 'v1-new');
+    db.delete('k2');
+    db.put('k3', 'v3');
+
+    expect(db.get('k1'), equals('v1-new'));
+    expect(db.get('k1', snapshot: snapshot), equals('v1'));
+    expect(db.get('k2', snapshot: snapshot), equals('v2'));
+    expect(db.get('k3', snapshot: snapshot), isNull);
+    expect(db.getMany(<String>['k1', 'k2', 'k3'], snapshot: snapshot),
+        equals(<String>['v1', 'v2', null]));
+    expect(db.getItems(snapshot: snapshot).keys.toList(),
+        equals(<String>['k1', 'k2']));
+    expect(db.getItems().keys.toList(), equals(<String>['k1', 'k3']));
+
+    // An iteration that has started keeps its view after the release.
+    var it = db.getItems(snapshot: snapshot, batchSize: 1).iterator;
+    snapshot.release();
+    expect(snapshot.isReleased, isTrue);
+    db.put('k0', 'v0');
+    var keys = <String>[];
+    while (it.moveNext()) {
+      keys.add(it.currentKey);
+    }
+    expect(keys, equals(<String>['k1', 'k2']));
+    expect(() => db.get('k1', snapshot: snapshot), throwsStateError);
+    expect(() => db.getItems(snapshot: snapshot).toList(), throwsStateError);
+    snapshot.release();
+
+    // Snapshots belong to the database they were taken from.
+    var otherPath = generateTempPath('snapshot-other');
+    var other = await RocksDB.openUtf8(otherPath);
+    snapshot = other.snapshot();
+    expect(() => db.get('k1', snapshot: snapshot),
+        throwsA(_isInvalidArgumentError));
+    other.close();
+    dbPaths.add(otherPath);
+
+    // Closing the database releases its snapshots.
+    snapshot = db.snapshot();
+    db.close();
+    expect(() => db.snapshot(), throwsA(_isClosedError));
+    snapshot.release();
+    dbPaths.add(path);
+  });
+
+  test('column families', () async {
+    var path = generateTempPath('column-families');
+    var families = const <RocksColumnFamilyDescriptor>[
+      RocksColumnFamilyDescriptor('users',
+          options: RocksOptions(
+              blockSize: 16 * 1024, compression: RocksCompression.none)),
+      RocksColumnFamilyDescriptor('events',
+          options: RocksOptions(
+              bitsPerKey: 0,
+              compactionStyle: RocksCompactionStyle.universal)),
+    ];
+    var db = await RocksDB.openUtf8(path, columnFamilies: families);
+    var users = db.columnFamily('users');
+    var events = db.columnFamily('events');
+    expect(users.name, equals('users'));
+    expect(db.columnFamily('default'), isNotNull);
+    expect(db.columnFamily('missing'), isNull);
+
+    // Each column family is a separate key space.
+    db.put('k', 'default');
+    db.put('k', 'user', columnFamily: users);
+    expect(db.get('k'), equals('default'));
+    expect(db.get('k', columnFamily: users), equals('user'));
+    expect(db.get('k', columnFamily: events), isNull);
+    expect(db.getMany(<String>['k'], columnFamily: users),
+        equals(<String>['user']));
+    await db.putAsync('e1', 'event', columnFamily: events);
+    expect(await db.getAsync('e1', columnFamily: events), equals('event'));
+    db.delete('k', columnFamily: users);
+    expect(db.get('k', columnFamily: users), isNull);
+    expect(db.get('k'), equals('default'));
+
+    // A batch may span column families.
+    var batch = db.batch()
+      ..put('u1', 'a', columnFamily: users)
+      ..put('e2', 'b', columnFamily: events)
+      ..delete('k');
+    db.write(batch);
+    expect(db.getItems(columnFamily: users).keys.toList(),
+        equals(<String>['u1']));
+    expect(db.getItems(columnFamily: events).keys.toList(),
+        equals(<String>['e1', 'e2']));
+    expect(db.getItems(), isEmpty);
+    var items = await db.scanAsync(columnFamily: events, reverse: true);
+    expect(items.map((i) => i.key).toList(), equals(<String>['e2', 'e1']));
+
+    var otherPath = generateTempPath('column-families-other');
+    var other = await RocksDB.openUtf8(otherPath, columnFamilies: families);
+    expect(() => db.get('k', columnFamily: other.columnFamily('users')),
+        throwsArgumentError);
+    other.close();
+    dbPaths.add(otherPath);
+    db.close();
+
+    // The column families are still there when the database is reopened.
+    db = await RocksDB.openUtf8(path, columnFamilies: families);
+    expect(db.get('u1', columnFamily: db.columnFamily('users')), equals('a'));
+    db.close();
+    dbPaths.add(path);
+  });
+
+  test('statistics and properties', () async {
+    var path = generateTempPath('statistics');
+    var db = await RocksDB.openUtf8(path,
+        options: const RocksOptions(statistics: true));
+    for (var i in Iterable<int>.generate(100)) {
+      db.put('key-$i', 'value-$i');
+    }
+    db.get('key-1');
+    db.get('missing');
+
+    var stats = db.stats(reset: true);
+    expect(stats.tickers, contains('rocksdb.block.cache.hit'));
+    expect(stats.tickers['rocksdb.number.keys.written'], equals(100));
+    var gets = stats.histograms['rocksdb.db.get.micros'];
+    expect(gets.count, equals(2));
+    expect(gets.p99, greaterThanOrEqualTo(gets.median));
+    expect(db.stats().tickers['rocksdb.number.keys.written'], equals(0));
+
+    expect(db.intProperty('rocksdb.estimate-num-keys'), greaterThan(0));
+    expect(db.intProperty('rocksdb.cur-size-all-mem-tables'), greaterThan(0));
+    expect(db.property('rocksdb.stats'), isNotEmpty);
+    expect(db.property('rocksdb.no-such-property'), isNull);
+
+    var perf = RocksPerfContext();
+    expect(db.get('key-50', perf: perf), equals('value-50'));
+    var comparisons = perf.userKeyComparisons;
+    expect(comparisons, greaterThan(0));
+    expect(db.getItems(perf: perf).length, equals(100));
+    expect(perf.userKeyComparisons, greaterThan(comparisons));
+    perf.reset();
+    expect(perf.userKeyComparisons, equals(0));
+    db.close();
+    dbPaths.add(path);
+
+    path = generateTempPath('no-statistics');
+    db = await RocksDB.openUtf8(path);
+    expect(db.stats(), isNull);
+    db.close();
+    dbPaths.add(path);
+  });
+
+  test('compression per level and dictionaries', () async {
+    // Small JSON documents that share their structure.
+    String document(int i) => jsonEncode(<String, Object>{
+          'id': i,
+          'name': 'user-$i',
+          'email': 'user-$i@example.com',
+          'active': i.isEven
+        });
+    Future<int> tableSize(String path, RocksOptions options) async {
+      var db = await RocksDB.openUtf8(path, options: options);
+      try {
+        var batch = db.batch();
+        for (var i = 0; i < 5000; i++) {
+          batch.put('key-$i', document(i));
+        }
+        db.write(batch);
+        await db.compactRange(null, null, bottommostForce: true);
+        expect(db.get('key-42'), equals(document(42)));
+        return db.intProperty('rocksdb.total-sst-files-size');
+      } finally {
+        db.close();
+        dbPaths.add(path);
+      }
+    }
+
+    var plain = await tableSize(generateTempPath('compression-none'),
+        const RocksOptions(compression: RocksCompression.none));
+    var compressed = await tableSize(
+        generateTempPath('compression-zstd'),
+        const RocksOptions(
+            compressionPerLevel: [RocksCompression.none, RocksCompression.lz4],
+            bottommostCompression: RocksCompression.zstd,
+            bottommostCompressionLevel: 19,
+            compressionDictBytes: 16 * 1024,
+            compressionTrainBytes: 100 * 16 * 1024));
+    expect(compressed, lessThan(plain ~/ 2));
+  });
+
+  test('merge operators', () async {
+    var path = generateTempPath('merge');
+    var db = await RocksDB.open<String, int>(path,
+        keyEncoding: RocksDB.utf8,
+        valueEncoding: RocksDB.uint64,
+        options:
+            const RocksOptions(mergeOperator: RocksMergeOperator.uint64Add),
+        columnFamilies: const <RocksColumnFamilyDescriptor>[
+          RocksColumnFamilyDescriptor('max',
+              options:
+                  RocksOptions(mergeOperator: RocksMergeOperator.uint64Max)),
+        ]);
+    db.merge('hits', 1);
+    db.merge('hits', 2);
+    expect(db.get('hits'), equals(3));
+    db.put('hits', 10);
+    db.merge('hits', -4);
+    expect(db.get('hits'), equals(6));
+    var batch = db.batch()
+      ..merge('hits', 5)
+      ..merge('misses', 1);
+    db.write(batch);
+    expect(db.getMany(<String>['hits', 'misses']), equals(<int>[11, 1]));
+    expect(db.getItems().values.toList(), equals(<int>[11, 1]));
+
+    var max = db.columnFamily('max');
+    for (var v in <int>[3, 9, 4]) {
+      db.merge('peak', v, columnFamily: max);
+    }
+    expect(db.get('peak', columnFamily: max), equals(9));
+    db.close();
+    dbPaths.add(path);
+
+    path = generateTempPath('merge-append');
+    var log = await RocksDB.openUtf8(path,
+        options: const RocksOptions(
+            mergeOperator: RocksMergeOperator.append, mergeDelimiter: '|'));
+    log.merge('log', 'a');
+    log.merge('log', 'b');
+    expect(log.get('log'), equals('a|b'));
+    log.close();
+    dbPaths.add(path);
+
+    // Merges need a merge operator.
+    path = generateTempPath('merge-none');
+    var plain = await RocksDB.openUtf8(path);
+    expect(() => plain.merge('k', 'v'), throwsA(_isInvalidArgumentError));
+    expect(() => plain.write(plain.batch()..merge('k', 'v')),
+        throwsA(_isInvalidArgumentError));
+    plain.close();
+    dbPaths.add(path);
+  });
+
+  test('asynchronous close', () async {
+    var path = generateTempPath('close-async');
+    var db = await RocksDB.openUtf8(path);
+    db.put('k', 'v');
+    var closed = db.closeAsync();
+    expect(() => db.get('k'), throwsA(_isClosedError));
+    expect(() => db.closeAsync(), throwsA(_isClosedError));
+
+    // Reopening the path waits for the close to finish.
+    var reopened = await RocksDB.openUtf8(path, shared: true);
+    await closed;
+    expect(reopened.get('k'), equals('v'));
+
+    // A database still used by another reference is left open.
+    var shared = await RocksDB.openUtf8(path, shared: true);
+    await reopened.closeAsync();
+    var other = await RocksDB.openUtf8(path, shared: true);
+    await other.closeAsync();
+    expect(shared.get('k'), equals('v'));
+    await shared.closeAsync();
+    dbPaths.add(path);
+  });
+
+  test('streams', () async {
+    var path = generateTempPath('stream');
+    var db = await RocksDB.openUtf8(path);
+    var keys =
+        List<String>.generate(1000, (i) => i.toString().padLeft(4, '0'));
+    var batch = db.batch();
+    for (var key in keys) {
+      batch.put(key, 'v$key');
+    }
+    db.write(batch);
+
+    var items = await db.stream(batchSize: 7).toList();
+    expect(items.map((item) => item.key).toList(), equals(keys));
+    expect(items.last.value, equals('v0999'));
+    expect(
+        await db
+            .stream(gte: '0100', lt: '0200', reverse: true)
+            .map((item) => item.key)
+            .toList(),
+        equals(keys.sublist(100, 200).reversed.toList()));
+    expect(await db.stream(prefix: '012').length, equals(10));
+
+    // Cancelling the subscription stops the producer.
+    expect(
+        await db.stream(batchSize: 1).take(3).map((item) => item.key).toList(),
+        equals(keys.sublist(0, 3)));
+
+    // A paused subscription holds back the producer, and closing the database
+    // ends the stream with an error.
+    var received = <String>[];
+    var error = Completer<Object>();
+    StreamSubscription<RocksItem<String, String>> subscription;
+    subscription = db.stream(batchSize: 1, prefetch: 1).listen((item) {
+      received.add(item.key);
+      if (received.length == 2) {
+        subscription.pause();
+      }
+    }, onError: (Object e) => error.complete(e));
+    await Future<void>.delayed(const Duration(milliseconds: 100));
+    expect(received, equals(keys.sublist(0, 2)));
+    db.close();
+    subscription.resume();
+    expect(await error.future, _isClosedError);
+    await subscription.cancel();
+    dbPaths.add(path);
+  });
+
+  test('change feed', () async {
+    var path = generateTempPath('change-feed');
+    var db = await RocksDB.openUtf8(path,
+        options: const RocksOptions(walTtlSeconds: 60));
+    try {
+      var start = db.latestSequenceNumber + 1;
+      db.put('a', '1');
+      db.write(db.batch()
+        ..put('b', '2')
+        ..delete('a')
+        ..deleteRange('c', 'd'));
+      expect(db.latestSequenceNumber, equals(start + 3));
+
+      var changes = await db.changesSince(start, tail: false).toList();
+      expect(changes.map((c) => c.sequence),
+          equals([start, start + 1, start + 2, start + 3]));
+      expect(
+          changes.map((c) => c.type),
+          equals([
+            RocksChangeType.put,
+            RocksChangeType.put,
+            RocksChangeType.delete,
+            RocksChangeType.deleteRange
+          ]));
+      expect(changes[1].key, equals('b'));
+      expect(changes[1].value, equals('2'));
+      expect(changes[2].value, isNull);
+      expect(changes[3].end, equals('d'));
+
+      // A feed may start in the middle of a write batch.
+      changes = await db.changesSince(start + 2, tail: false).toList();
+      expect(changes.map((c) => c.key), equals(['a', 'c']));
+
+      // A tailing feed sees the writes made after it starts.
+      var feed = StreamIterator(db.changesSince(db.latestSequenceNumber + 1));
+      db.put('e', '5');
+      expect(await feed.moveNext(), isTrue);
+      expect(feed.current.key, equals('e'));
+      await feed.cancel();
+    } finally {
+      db.close();
+      dbPaths.add(path);
+    }
+  });
+
+  test('optimistic transactions', () async {
+    var path = generateTempPath('optimistic-transactions');
+    var db = await RocksDB.openUtf8(path,
+        transactionMode: RocksTransactionMode.optimistic);
+    try {
+      db.put('a', '1');
+      db.put('b', '2');
+
+      // Writes are only seen by the transaction until it commits.
+      var txn = db.transaction();
+      txn.put('c', '3');
+      txn.delete('a');
+      expect(txn.get('c'), equals('3'));
+      expect(txn.get('a'), isNull);
+      expect(txn.getItems().keys.toList(), equals(<String>['b', 'c']));
+      expect(db.get('c'), isNull);
+      var items = txn.getItems().iterator;
+      txn.commit();
+      expect(txn.isFinished, isTrue);
+      expect(db.getItems().keys.toList(), equals(<String>['b', 'c']));
+      expect(() => txn.get('b'), throwsStateError);
+      expect(() => items.moveNext(), throwsStateError);
+
+      // A key read for update and then written by someone else fails the
+      // commit, and nothing is written.
+      var first = db.transaction();
+      var second = db.transaction();
+      first.put('b', '${int.parse(first.getForUpdate('b')) + 1}');
+      second.put('b', '${int.parse(second.getForUpdate('b')) + 10}');
+      second.put('d', '4');
+      first.commit();
+      expect(() => second.commit(), throwsA(_isBusyError));
+      expect(db.get('b'), equals('3'));
+      expect(db.get('d'), isNull);
+
+      txn = db.transaction();
+      txn.put('e', '5');
+      txn.rollback();
+      expect(db.get('e'), isNull);
+    } finally {
+      db.close();
+      dbPaths.add(path);
+    }
+
+    var plain = await RocksDB.openUtf8(path);
+    expect(() => plain.transaction(), throwsA(_isInvalidArgumentError));
+    plain.close();
+  });
+
+  test('pessimistic transactions', () async {
+    var path = generateTempPath('pessimistic-transactions');
+    var db = await RocksDB.openUtf8(path,
+        transactionMode: RocksTransactionMode.pessimistic);
+    try {
+      db.put('a', '1');
+
+      // A key locked by another transaction fails straight away.
+      var first = db.transaction();
+      var second = db.transaction();
+      expect(first.getForUpdate('a'), equals('1'));
+      expect(() => second.put('a', '2'), throwsA(_isBusyError));
+      second.put('b', '2');
+      first.put('a', '3');
+      first.commit();
+      second.put('a', '4');
+      second.commit();
+      expect(db.getItems().values.toList(), equals(<String>['4', '2']));
+
+      // Transactions left open are rolled back on close.
+      var txn = db.transaction(setSnapshot: true);
+      txn.put('c', '5');
+    } finally {
+      db.close();
+      dbPaths.add(path);
+    }
+  });
+
   test('two separate databases', () async {
     var path1 = generateTempPath('two-db-1');
     var db1 = await RocksDB.openUtf8(path1);
@@ -170,8 +1005,11 @@ void main() {
     db.close();
 
     expect(() => db.get('SOME KEY'), throwsA(_isClosedError));
+    expect(() => db.getMany(<String>['SOME KEY']), throwsA(_isClosedError));
     expect(() => db.delete('SOME KEY'), throwsA(_isClosedError));
     expect(() => db.put('SOME KEY', 'SOME KEY'), throwsA(_isClosedError));
+    expect(() => db.write(db.batch()..delete('SOME KEY')),
+        throwsA(_isClosedError));
     expect(() => db.close(), throwsA(_isClosedError));
 
     try {
@@ -198,6 +1036,44 @@ void main() {
     }
   });
 
+  test('read-only and secondary instances', () async {
+    var path = generateTempPath('secondary');
+    var secondaryPath = generateTempPath('secondary-log');
+    var timedPath = generateTempPath('secondary-timed-log');
+    var db = await RocksDB.openUtf8(path);
+    db.put('a', '1');
+    var readOnly =
+        await RocksDB.openUtf8(path, openMode: RocksOpenMode.readOnly);
+    var secondary = await RocksDB.openUtf8(path,
+        openMode: RocksOpenMode.secondary, secondaryPath: secondaryPath);
+    var timed = await RocksDB.openUtf8(path,
+        openMode: RocksOpenMode.secondary,
+        secondaryPath: timedPath,
+        catchUpInterval: const Duration(milliseconds: 10));
+    try {
+      expect(readOnly.get('a'), equals('1'));
+      expect(secondary.get('a'), equals('1'));
+      expect(() => readOnly.put('b', '2'), throwsA(_isInvalidArgumentError));
+      expect(() => secondary.put('b', '2'), throwsA(_isInvalidArgumentError));
+
+      // The secondary instances see the later writes once caught up.
+      db.put('b', '2');
+      expect(secondary.get('b'), isNull);
+      await secondary.tryCatchUpWithPrimary();
+      expect(secondary.get('b'), equals('2'));
+      await Future<void>.delayed(const Duration(milliseconds: 200));
+      expect(timed.get('b'), equals('2'));
+      expect(readOnly.get('b'), isNull);
+      expect(db.tryCatchUpWithPrimary(), throwsA(_isInvalidArgumentError));
+    } finally {
+      timed.close();
+      secondary.close();
+      readOnly.close();
+      db.close();
+      dbPaths.addAll([path, secondaryPath, timedPath]);
+    }
+  });
+
   test('throw inside iteration', () async {
     var path = generateTempPath('bad-iter');
     var db = await RocksDB.openUtf8(path);
@@ -289,6 +1165,21 @@ void main() {
     dbPaths.add(tp);
   });
 
+  test('rejected options', () async {
+    var path = generateTempPath('rejected-options');
+    await expectLater(
+        RocksDB.openUtf8(path,
+            options: RocksOptions(
+                compressionPerLevel: [RocksCompression.none, null])),
+        throwsA(_isInvalidArgumentError));
+
+    var db = await RocksDB.openUtf8(path);
+    db.put('a', '1');
+    expect(db.get('a'), equals('1'));
+    db.close();
+    dbPaths.add(path);
+  });
+
   test('iteration', () async {
     var path = generateTempPath('sync-iter');
     var db = await RocksDB.openUtf8(path);
@@ -354,6 +1245,139 @@ void main() {
     dbPaths.add(path);
   });
 
+  test('batched iteration', () async {
+    var path = generateTempPath('batch-iter');
+    var db = await RocksDB.openUtf8(path);
+
+    var expected = <String>[];
+    for (var i in Iterable<int>.generate(1000)) {
+      var key = 'key-${i.toString().padLeft(4, '0')}';
+      db.put(key, 'value-$i' * (i % 7));
+      expected.add(key);
+    }
+
+    // Small batches split by count and by bytes must yield the same entries as
+    // a single entry at a time.
+    for (var batchSize in <int>[1, 7, 128, 5000]) {
+      var items = db.getItems(batchSize: batchSize).toList();
+      expect(items.map((i) => i.key).toList(), equals(expected));
+      expect(items[500].value, equals('value-500' * (500 % 7)));
+    }
+    var keys = db.getItems(batchSize: 1000, batchBytes: 64).keys.toList();
+    expect(keys, equals(expected));
+
+    // Limits and bounds are honoured across batch boundaries.
+    keys = db.getItems(limit: 10, batchSize: 3).keys.toList();
+    expect(keys, equals(expected.sublist(0, 10)));
+    keys = db
+        .getItems(gt: 'key-0100', lte: 'key-0200', batchSize: 16)
+        .keys
+        .toList();
+    expect(keys, equals(expected.sublist(101, 201)));
+
+    db.close();
+    dbPaths.add(path);
+  });
+
+  test('reverse iteration', () async {
+    var path = generateTempPath('reverse-iter');
+    var db = await RocksDB.openUtf8(path);
+
+    var expected = <String>[];
+    for (var i in Iterable<int>.generate(300)) {
+      var key = 'key-${i.toString().padLeft(4, '0')}';
+      db.put(key, 'value-$i');
+      expected.add(key);
+    }
+    // Keys that extend a bound and deleted keys beyond it.
+    db.put('key-0100-x', 'x');
+    db.put('key-0200-x', 'x');
+    db.delete('key-0250');
+    expected.remove('key-0250');
+    var reversed = expected.reversed.toList();
+
+    for (var batchSize in <int>[1, 7, 128]) {
+      var keys = db
+          .getItems(reverse: true, batchSize: batchSize)
+          .keys
+          .where((k) => !k.endsWith('-x'))
+          .toList();
+      expect(keys, equals(reversed));
+    }
+
+    // The bounds are the same as for forward iteration.
+    var keys =
+        db.getItems(gt: 'key-0100', lte: 'key-0200', reverse: true).keys;
+    expect(keys.first, equals('key-0200'));
+    expect(keys.last, equals('key-0100-x'));
+    expect(keys.length, equals(101));
+    keys = db.getItems(gte: 'key-0100', lt: 'key-0200', reverse: true).keys;
+    expect(keys.first, equals('key-0199'));
+    expect(keys.last, equals('key-0100'));
+    keys = db.getItems(gt: 'key-0100', lt: 'key-0200').keys;
+    expect(keys.first, equals('key-0100-x'));
+    expect(keys.last, equals('key-0199'));
+    expect(db.getItems(gt: 'key-0299', reverse: true), isEmpty);
+    expect(db.getItems(gt: 'key-0200', lt: 'key-0100', reverse: true), isEmpty);
+
+    // The latest entries of a range.
+    keys = db.getItems(lt: 'key-0260', reverse: true, limit: 3).keys;
+    expect(keys.toList(), equals(<String>['key-0259', 'key-0258', 'key-0257']));
+    keys = db.getPrefix('key-01', reverse: true, limit: 2).keys;
+    expect(keys.toList(), equals(<String>['key-0199', 'key-0198']));
+    var items = await db.scanAsync(lte: 'key-0251', reverse: true, limit: 2);
+    expect(items.map((i) => i.key).toList(),
+        equals(<String>['key-0251', 'key-0249']));
+
+    db.close();
+    dbPaths.add(path);
+  });
+
+  test('prefix iteration', () async {
+    var keys = <String>['a', 'a/1', 'a/2', 'a/2/x', 'ab/1', 'b/1', 'b/2'];
+    var options = <RocksOptions>[
+      RocksOptions(),
+      RocksOptions(prefixLength: 2),
+      RocksOptions(prefixDelimiter: '/'),
+    ];
+    for (var i = 0; i < options.length; i++) {
+      var path = generateTempPath('prefix-$i');
+      var db = await RocksDB.openUtf8(path, options: options[i]);
+      for (var key in keys) {
+        db.put(key, 'v-$key');
+      }
+
+      expect(db.getPrefix('a/').keys.toList(),
+          equals(<String>['a/1', 'a/2', 'a/2/x']));
+      expect(db.getPrefix('a').keys.toList(),
+          equals(<String>['a', 'a/1', 'a/2', 'a/2/x', 'ab/1']));
+      expect(db.getPrefix('a/2').keys.toList(),
+          equals(<String>['a/2', 'a/2/x']));
+      expect(db.getPrefix('b/', limit: 1).toList().single.value,
+          equals('v-b/1'));
+      expect(db.getPrefix('c/'), isEmpty);
+      // Ranges that span prefixes still see every key.
+      expect(db.getItems(gte: 'a/2', lt: 'b/2').keys.toList(),
+          equals(<String>['a/2', 'a/2/x', 'ab/1', 'b/1']));
+      var items = await db.scanAsync(prefix: 'b/');
+      expect(items.map((i) => i.key).toList(), equals(<String>['b/1', 'b/2']));
+
+      db.close();
+      dbPaths.add(path);
+    }
+
+    var path = generateTempPath('prefix-ff');
+    var db = await RocksDB.openUint8List(path);
+    db.put(Uint8List.fromList(<int>[0xFE, 1]), Uint8List(0));
+    db.put(Uint8List.fromList(<int>[0xFF, 1]), Uint8List(0));
+    db.put(Uint8List.fromList(<int>[0xFF, 0xFF]), Uint8List(0));
+    expect(db.getPrefix(Uint8List.fromList(<int>[0xFF])).length, equals(2));
+    expect(db.getPrefix(Uint8List.fromList(<int>[0xFF, 0xFF])).length,
+        equals(1));
+    db.close();
+    dbPaths.add(path);
+  });
+
   test('iterator use after close', () async {
     var path = generateTempPath('after-close');
     var db = await RocksDB.openUtf8(path);